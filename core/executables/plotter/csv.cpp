@@ -1,71 +1,944 @@
 #include "csv.hpp"
+#include "profiler/compression.hpp"
+#include "profiler/encoding.hpp"
 #include "profiler/profiler.hpp"
 
+#include <algorithm>
+#include <cinttypes>
+#include <cstdio>
+#include <filesystem>
 #include <fstream>
+#include <iterator>
 #include <iostream>
+#include <memory>
 #include <sstream>
 #include <string>
+#include <thread>
 
-bool ReadSessionCSV(const std::string &path, std::vector<session_row_t> &data,
-                    std::unordered_map<uint64_t, id_map> &locationIDMap,
-                    std::atomic<float> &progress) {
-  std::ifstream locationIDMapFile(path + SESSION_ID_MAP_FILENAME,
-                                  std::fstream::in);
-  if (!locationIDMapFile.is_open()) {
+// Sessions recorded before the block format are a flat array of fixed size
+// records
+static void decodeLegacySession(const std::vector<uint8_t> &raw,
+                                double ticksToSeconds,
+                                std::vector<session_row_t> &data,
+                                std::unordered_map<uint64_t, id_map> &locationIDMap,
+                                std::atomic<float> &progress) {
+  const size_t recordCount = raw.size() / sizeof(session_row_binary_t);
+  const session_row_binary_t *rawRecords =
+      reinterpret_cast<const session_row_binary_t *>(raw.data());
+  data.reserve(recordCount);
+  constexpr size_t kProgressStride = 4096;
+  for (size_t i = 0; i < recordCount; i++) {
+    const session_row_binary_t &ser = rawRecords[i];
+    const id_map &loc = locationIDMap[ser.location_id];
+    data.emplace_back(session_row_t{ser.time * ticksToSeconds,
+                                    ser.duration * ticksToSeconds,
+                                    ser.location_id, ser.thread_id, loc.path,
+                                    loc.line, loc.function, loc.name});
+    if ((i % kProgressStride) == 0 || i + 1 == recordCount) {
+      progress = (float)(i + 1) / recordCount;
+    }
+  }
+}
+
+struct record_t {
+  int64_t deltaTime;
+  uint64_t location;
+  session_encoding::RecordKind kind;
+  int64_t value;
+  uint32_t depth;
+  uint64_t parent;
+  // Of the mutex of lock records
+  uint64_t instance;
+};
+
+static bool decodeRecord(const uint8_t *&in, const uint8_t *end,
+                         record_t &record) {
+  using namespace session_encoding;
+  uint64_t deltaTime, tag, value, depth, parent;
+  if (!getVarint(in, end, deltaTime) || !getVarint(in, end, tag)) {
+    return false;
+  }
+  record.deltaTime = unzigzag(deltaTime);
+  record.kind = RecordKind::Scope;
+  record.location = tag >> 1;
+  if (tag & 1) {
+    uint64_t kind;
+    if (!getVarint(in, end, kind) || !getVarint(in, end, value)) {
+      return false;
+    }
+    record.kind = (RecordKind)kind;
+    record.value = unzigzag(value);
+    return !isLock(record.kind) || getVarint(in, end, record.instance);
+  }
+  if (!getVarint(in, end, value) || !getVarint(in, end, depth) ||
+      !getVarint(in, end, parent)) {
     return false;
   }
-  FILE *csv = fopen((path + SESSION_FILENAME).c_str(), "rb");
-  if (!csv) {
+  record.value = unzigzag(value);
+  record.depth = (uint32_t)depth;
+  record.parent = parent == 0 ? session_row_t::kNoParentLocation : parent - 1;
+  return true;
+}
+
+static bool readFile(const std::string &path, std::vector<uint8_t> &raw) {
+  FILE *file = fopen(path.c_str(), "rb");
+  if (!file) {
     return false;
   }
+  fseek(file, 0, SEEK_END);
+  const size_t size = ftell(file);
+  fseek(file, 0, SEEK_SET);
+  raw.resize(size);
+  raw.resize(fread(raw.data(), 1, size, file));
+  fclose(file);
+  return true;
+}
 
-	locationIDMap.clear();
+// Adds the locations defined by a definitions block to locationIDMap.
+// Entries already known are kept, rows may point to them.
+static bool decodeDefinitions(const uint8_t *in, const uint8_t *end,
+                              uint64_t count,
+                              std::unordered_map<uint64_t, id_map> &locationIDMap) {
+  using session_encoding::getVarint;
+  for (uint64_t i = 0; i < count; i++) {
+    uint64_t id, line;
+    if (!getVarint(in, end, id) || !getVarint(in, end, line)) {
+      return false;
+    }
+    std::string fields[3];
+    for (std::string &field : fields) {
+      uint64_t size;
+      if (!getVarint(in, end, size) || size > (uint64_t)(end - in)) {
+        return false;
+      }
+      field.assign((const char *)in, size);
+      in += size;
+    }
+    locationIDMap.try_emplace(id, id_map{id, std::move(fields[0]), (int)line,
+                                         std::move(fields[1]),
+                                         std::move(fields[2])});
+  }
+  return true;
+}
+
+static bool isDefinitions(const session_encoding::block_header_t &header) {
+  return header.threadId == session_encoding::kDefinitionsThreadId;
+}
+
+// Appends the rows of the records of a block, found at payload and
+// decompressed if needed. Locations are only looked up, so that blocks can be
+// decoded in parallel: rows of unknown locations get empty names.
+static void decodeBlockRecords(
+    const session_encoding::block_header_t &header, const uint8_t *payload,
+    double ticksToSeconds,
+    const std::unordered_map<uint64_t, id_map> &locationIDMap,
+    std::vector<session_row_t> &data, std::vector<uint8_t> &scratch) {
+  using namespace session_encoding;
+  const uint8_t *in = payload;
+  if (header.codec != BlockCodec::None) {
+    scratch.resize(header.rawSize);
+    if (!block_compression::decompress(header.codec, payload,
+                                       header.payloadSize, scratch.data(),
+                                       header.rawSize)) {
+      std::cerr << "Error: Could not decompress a block of the session file!"
+                << std::endl;
+      return;
+    }
+    in = scratch.data();
+  }
+  const uint8_t *const end = in + header.rawSize;
+  static const id_map kUnknownLocation{};
+  int64_t time = header.baseTime;
+  for (uint64_t i = 0; i < header.count; i++) {
+    record_t record;
+    if (!decodeRecord(in, end, record)) {
+      std::cerr << "Error: Corrupted block in the session file!" << std::endl;
+      break;
+    }
+    time += record.deltaTime;
+    const auto location = locationIDMap.find(record.location);
+    const id_map &loc = location != locationIDMap.end() ? location->second
+                                                        : kUnknownLocation;
+    session_row_t &row = data.emplace_back(
+        session_row_t{time * ticksToSeconds, 0.0, record.location,
+                      header.threadId, loc.path, loc.line, loc.function,
+                      loc.name});
+    row.kind = record.kind;
+    if (record.kind == RecordKind::Scope) {
+      row.duration = record.value * ticksToSeconds;
+      row.depth = record.depth;
+      row.parentLocationId = record.parent;
+    } else if (isLock(record.kind)) {
+      row.duration = record.value * ticksToSeconds;
+      row.value = (int64_t)record.instance;
+    } else if (isInterval(record.kind)) {
+      row.duration = record.value * ticksToSeconds;
+    } else {
+      row.value = record.value;
+    }
+  }
+}
+
+bool DecodeSessionBlock(const uint8_t *&in, const uint8_t *end,
+                        double ticksToSeconds,
+                        std::vector<session_row_t> &data,
+                        std::unordered_map<uint64_t, id_map> &locationIDMap) {
+  using namespace session_encoding;
+  block_header_t header;
+  if (!getBlockHeader(in, end, header)) {
+    return false;
+  }
+  if (isDefinitions(header)) {
+    if (!decodeDefinitions(in, in + header.payloadSize, header.count,
+                           locationIDMap)) {
+      std::cerr << "Error: Corrupted location definitions in the session file!"
+                << std::endl;
+    }
+  } else {
+    std::vector<uint8_t> scratch;
+    decodeBlockRecords(header, in, ticksToSeconds, locationIDMap, data,
+                       scratch);
+  }
+  in += header.payloadSize;
+  return true;
+}
+
+bool ParseThreadLine(const std::string &line, thread_meta_t &thread) {
+  std::stringstream ss(line);
+  std::string idStr, tidStr;
+
+  std::getline(ss, idStr, ';');
+  std::getline(ss, tidStr, ';');
+  std::getline(ss, thread.name);
+
+  try {
+    thread.threadId = std::stoull(idStr);
+    thread.tid = std::stoll(tidStr);
+    return true;
+  } catch (const std::invalid_argument &e) {
+    return false;
+  }
+}
+
+bool ParseLocationLine(const std::string &line, id_map &location) {
+  std::stringstream ss(line);
+  std::string idStr, lineStr;
+
+  std::getline(ss, location.path, ';');
+  std::getline(ss, lineStr, ';');
+  std::getline(ss, location.function, ';');
+  std::getline(ss, location.name, ';');
+  std::getline(ss, idStr);
+
+  try {
+    location.id = std::stoull(idStr);
+    location.line = std::stoi(lineStr);
+    return true;
+  } catch (const std::invalid_argument &e) {
+    std::cerr << "Error: Invalid data format in the CSV file!" << std::endl;
+    return false;
+  }
+}
+
+double ParseTicksPerNs(std::istream &sessionInfo) {
+  double ticksPerNs = 1.0;
   std::string line;
-  while (std::getline(locationIDMapFile, line)) {
+  while (std::getline(sessionInfo, line)) {
     std::stringstream ss(line);
-    id_map el;
-    std::string idStr, lineStr;
-
-    std::getline(ss, el.path, ';');
-    std::getline(ss, lineStr, ';');
-    std::getline(ss, el.function, ';');
-    std::getline(ss, el.name, ';');
-    std::getline(ss, idStr);
+    std::string key, value;
+    std::getline(ss, key, ';');
+    std::getline(ss, value);
+    try {
+      if (key == "ticks_per_ns") {
+        ticksPerNs = std::stod(value);
+      }
+    } catch (const std::invalid_argument &e) {
+      std::cerr << "Error: Invalid data format in the session info file!"
+                << std::endl;
+    }
+  }
+  return ticksPerNs > 0.0 ? ticksPerNs : 1.0;
+}
 
+scope_overhead_t ParseScopeOverhead(std::istream &sessionInfo) {
+  scope_overhead_t overhead;
+  std::string line;
+  while (std::getline(sessionInfo, line)) {
+    std::stringstream ss(line);
+    std::string key, value;
+    std::getline(ss, key, ';');
+    std::getline(ss, value);
     try {
-      el.id = std::stoull(idStr);
-      el.line = std::stoi(lineStr);
-      locationIDMap[el.id] = el;
+      if (key == "scope_overhead_ns") {
+        overhead.own = std::stod(value) * 1e-9;
+      } else if (key == "nested_scope_overhead_ns") {
+        overhead.nested = std::stod(value) * 1e-9;
+      }
     } catch (const std::invalid_argument &e) {
-      std::cerr << "Error: Invalid data format in the CSV file!" << std::endl;
+      std::cerr << "Error: Invalid data format in the session info file!"
+                << std::endl;
+    }
+  }
+  return overhead;
+}
+
+// Appends the rows of the blocks in [in, end), returns false if the stream is
+// truncated. Blocks are decoded in parallel once the locations they use are
+// known.
+static bool decodeBlocks(const uint8_t *in, const uint8_t *end,
+                         double ticksToSeconds,
+                         std::vector<session_row_t> &data,
+                         std::unordered_map<uint64_t, id_map> &locationIDMap,
+                         std::atomic<float> &progress) {
+  using namespace session_encoding;
+  struct block_t {
+    block_header_t header;
+    const uint8_t *payload;
+  };
+  std::vector<block_t> blocks;
+  while (in < end) {
+    block_header_t header;
+    if (!getBlockHeader(in, end, header)) {
+      break;
+    }
+    if (!isDefinitions(header)) {
+      blocks.push_back({header, in});
+    } else if (!decodeDefinitions(in, in + header.payloadSize, header.count,
+                                  locationIDMap)) {
+      std::cerr << "Error: Corrupted location definitions in the session file!"
+                << std::endl;
+    }
+    in += header.payloadSize;
+  }
+
+  // Every worker decodes a contiguous range of blocks, so that the rows keep
+  // the order of the file
+  constexpr size_t kMinBlocksPerWorker = 16;
+  const size_t workerCount = std::max<size_t>(
+      1, std::min<size_t>(std::thread::hardware_concurrency(),
+                          blocks.size() / kMinBlocksPerWorker));
+  std::vector<std::vector<session_row_t>> rows(workerCount);
+  std::atomic<size_t> decoded = 0;
+  const auto decodeRange = [&](size_t worker) {
+    std::vector<uint8_t> scratch;
+    const size_t last = (worker + 1) * blocks.size() / workerCount;
+    for (size_t i = worker * blocks.size() / workerCount; i < last; i++) {
+      decodeBlockRecords(blocks[i].header, blocks[i].payload, ticksToSeconds,
+                         locationIDMap, rows[worker], scratch);
+      progress = (float)(decoded.fetch_add(1) + 1) / blocks.size();
+    }
+  };
+  std::vector<std::thread> workers;
+  for (size_t worker = 1; worker < workerCount; worker++) {
+    workers.emplace_back(decodeRange, worker);
+  }
+  decodeRange(0);
+  for (std::thread &worker : workers) {
+    worker.join();
+  }
+  size_t rowCount = data.size();
+  for (const std::vector<session_row_t> &workerRows : rows) {
+    rowCount += workerRows.size();
+  }
+  data.reserve(rowCount);
+  for (std::vector<session_row_t> &workerRows : rows) {
+    data.insert(data.end(), workerRows.begin(), workerRows.end());
+    workerRows = {};
+  }
+  return in == end;
+}
+
+// Tables embedded at the end of a closed session file, see encoding.hpp
+struct session_sections_t {
+  uint64_t blocksOffset = 0;
+  uint64_t blocksSize = 0;
+  std::vector<id_map> locations;
+  std::vector<thread_meta_t> threads;
+  std::string info;
+};
+
+static bool readFileRange(FILE *file, uint64_t offset, uint64_t size,
+                          std::vector<uint8_t> &raw) {
+  raw.resize(size);
+  return fseek(file, (long)offset, SEEK_SET) == 0 &&
+         fread(raw.data(), 1, size, file) == size;
+}
+
+static bool decodeStrings(const uint8_t *in, const uint8_t *end,
+                          std::vector<std::string> &strings) {
+  using session_encoding::getVarint;
+  uint64_t count;
+  if (!getVarint(in, end, count) || count > (uint64_t)(end - in)) {
+    return false;
+  }
+  strings.reserve(count);
+  for (uint64_t i = 0; i < count; i++) {
+    uint64_t size;
+    if (!getVarint(in, end, size) || size > (uint64_t)(end - in)) {
+      return false;
     }
+    strings.emplace_back((const char *)in, size);
+    in += size;
   }
-  locationIDMapFile.close();
+  return true;
+}
 
-  size_t csvSize = 0;
-  fseek(csv, 0, SEEK_END);
-  csvSize = ftell(csv);
-  fseek(csv, 0, SEEK_SET);
+static bool decodeLocations(const uint8_t *in, const uint8_t *end,
+                            const std::vector<std::string> &strings,
+                            std::vector<id_map> &locations) {
+  using session_encoding::getVarint;
+  uint64_t count;
+  if (!getVarint(in, end, count) || count > (uint64_t)(end - in)) {
+    return false;
+  }
+  locations.reserve(count);
+  for (uint64_t i = 0; i < count; i++) {
+    uint64_t id, line, file, function, name;
+    if (!getVarint(in, end, id) || !getVarint(in, end, line) ||
+        !getVarint(in, end, file) || !getVarint(in, end, function) ||
+        !getVarint(in, end, name) || file >= strings.size() ||
+        function >= strings.size() || name >= strings.size()) {
+      return false;
+    }
+    locations.push_back(id_map{id, strings[file], (int)line, strings[function],
+                               strings[name]});
+  }
+  return true;
+}
 
-  const size_t recordCount = csvSize / sizeof(session_row_binary_t);
-  std::vector<session_row_binary_t> rawRecords(recordCount);
-  const size_t readCount =
-      fread(rawRecords.data(), sizeof(session_row_binary_t), recordCount, csv);
-  fclose(csv);
-  rawRecords.resize(readCount);
+static bool decodeThreads(const uint8_t *in, const uint8_t *end,
+                          const std::vector<std::string> &strings,
+                          std::vector<thread_meta_t> &threads) {
+  using namespace session_encoding;
+  uint64_t count;
+  if (!getVarint(in, end, count) || count > (uint64_t)(end - in)) {
+    return false;
+  }
+  threads.reserve(count);
+  for (uint64_t i = 0; i < count; i++) {
+    uint64_t threadId, tid, name;
+    if (!getVarint(in, end, threadId) || !getVarint(in, end, tid) ||
+        !getVarint(in, end, name) || name >= strings.size()) {
+      return false;
+    }
+    threads.push_back(thread_meta_t{threadId, unzigzag(tid), strings[name]});
+  }
+  return true;
+}
 
+// Reads the sections of a closed session file, without its blocks. Returns
+// false if the file has no trailer (being written, or left by a crash) or
+// its sections are corrupted.
+static bool readSessionSections(const std::string &path,
+                                session_sections_t &sections) {
+  using namespace session_encoding;
+  std::unique_ptr<FILE, FileCloser> file(fopen(path.c_str(), "rb"));
+  if (!file || fseek(file.get(), 0, SEEK_END) != 0) {
+    return false;
+  }
+  const long fileSize = ftell(file.get());
+  uint64_t indexOffset;
+  std::vector<uint8_t> index;
+  if (fileSize < (long)kTrailerSize ||
+      !readFileRange(file.get(), fileSize - kTrailerSize, kTrailerSize,
+                     index) ||
+      !getTrailer(index.data(), fileSize, indexOffset) ||
+      !readFileRange(file.get(), indexOffset,
+                     fileSize - kTrailerSize - indexOffset, index)) {
+    return false;
+  }
+
+  std::vector<section_t> entries;
+  const uint8_t *in = index.data();
+  const uint8_t *const end = in + index.size();
+  uint64_t count;
+  if (!getVarint(in, end, count)) {
+    return false;
+  }
+  bool haveBlocks = false;
+  for (uint64_t i = 0; i < count; i++) {
+    uint64_t kind, offset, size;
+    if (!getVarint(in, end, kind) || !getVarint(in, end, offset) ||
+        !getVarint(in, end, size) || offset > indexOffset ||
+        size > indexOffset - offset) {
+      return false;
+    }
+    if ((SectionKind)kind == SectionKind::Blocks) {
+      sections.blocksOffset = offset;
+      sections.blocksSize = size;
+      haveBlocks = true;
+    } else {
+      entries.push_back(section_t{(SectionKind)kind, offset, size});
+    }
+  }
+  if (!haveBlocks) {
+    return false;
+  }
+
+  // The strings come first, the other sections index them. Sections of
+  // unknown kinds are skipped.
+  std::stable_sort(entries.begin(), entries.end(),
+                   [](const section_t &a, const section_t &b) {
+                     return (a.kind == SectionKind::Strings) >
+                            (b.kind == SectionKind::Strings);
+                   });
+  std::vector<std::string> strings;
+  std::vector<uint8_t> raw;
+  for (const section_t &section : entries) {
+    if (!readFileRange(file.get(), section.offset, section.size, raw)) {
+      return false;
+    }
+    const uint8_t *data = raw.data();
+    const uint8_t *const dataEnd = data + raw.size();
+    bool valid = true;
+    switch (section.kind) {
+    case SectionKind::Strings:
+      valid = decodeStrings(data, dataEnd, strings);
+      break;
+    case SectionKind::Locations:
+      valid = decodeLocations(data, dataEnd, strings, sections.locations);
+      break;
+    case SectionKind::Threads:
+      valid = decodeThreads(data, dataEnd, strings, sections.threads);
+      break;
+    case SectionKind::Info:
+      sections.info.assign((const char *)data, raw.size());
+      break;
+    default:
+      break;
+    }
+    if (!valid) {
+      return false;
+    }
+  }
+  return true;
+}
+
+static bool readLocationTable(const std::string &path,
+                              std::unordered_map<uint64_t, id_map> &locationIDMap) {
+  std::ifstream locationIDMapFile(path, std::fstream::in);
+  if (!locationIDMapFile.is_open()) {
+    return false;
+  }
+  std::string line;
+  while (std::getline(locationIDMapFile, line)) {
+    id_map el;
+    if (ParseLocationLine(line, el)) {
+      locationIDMap[el.id] = el;
+    }
+  }
+  return true;
+}
+
+std::vector<uint64_t> ListSessionSegments(const std::string &path) {
+  std::vector<uint64_t> segments;
+  std::error_code error;
+  for (const auto &entry : std::filesystem::directory_iterator(path, error)) {
+    const std::string name = entry.path().filename().string();
+    uint64_t index;
+    if (sscanf(name.c_str(), "profiler_session.%" SCNu64, &index) == 1 &&
+        name == sessionSegmentFilename(index)) {
+      segments.push_back(index);
+    }
+  }
+  std::sort(segments.begin(), segments.end());
+  return segments;
+}
+
+uint64_t ParseDroppedMeasures(std::istream &sessionInfo) {
+  uint64_t dropped = 0;
+  std::string line;
+  while (std::getline(sessionInfo, line)) {
+    sscanf(line.c_str(), "dropped_measures;%" SCNu64, &dropped);
+  }
+  return dropped;
+}
+
+// Content of the session info file of a session folder, or of the info
+// section of its last session file
+static std::string readSessionInfo(const std::string &path) {
+  std::ifstream sessionInfoFile(path + SESSION_INFO_FILENAME, std::fstream::in);
+  if (sessionInfoFile.is_open()) {
+    std::stringstream info;
+    info << sessionInfoFile.rdbuf();
+    return info.str();
+  }
+  // A closed session file is enough on its own
+  const std::vector<uint64_t> segments = ListSessionSegments(path);
+  session_sections_t sections;
+  readSessionSections(path + (segments.empty()
+                                  ? std::string(SESSION_FILENAME)
+                                  : sessionSegmentFilename(segments.back())),
+                      sections);
+  return sections.info;
+}
+
+scope_overhead_t ReadScopeOverhead(const std::string &path) {
+  std::istringstream sessionInfo(readSessionInfo(path));
+  return ParseScopeOverhead(sessionInfo);
+}
+
+uint64_t ReadDroppedMeasures(const std::string &path) {
+  std::istringstream sessionInfo(readSessionInfo(path));
+  return ParseDroppedMeasures(sessionInfo);
+}
+
+// Pid saved in a session info file, 0 if missing
+static uint32_t parseSessionPid(std::istream &sessionInfo) {
+  std::string line;
+  while (std::getline(sessionInfo, line)) {
+    uint32_t pid;
+    if (sscanf(line.c_str(), "pid;%" SCNu32, &pid) == 1) {
+      return pid;
+    }
+  }
+  return 0;
+}
+
+// Later lines of a thread replace the earlier ones (renamed threads)
+static void readThreadTable(const std::string &path, uint32_t pid,
+                            thread_table_t &threads) {
+  std::ifstream threadsFile(path, std::fstream::in);
+  std::string line;
+  while (std::getline(threadsFile, line)) {
+    thread_meta_t thread;
+    if (ParseThreadLine(line, thread)) {
+      threads[{pid, thread.threadId}] = std::move(thread);
+    }
+  }
+}
+
+// Process folders of the children forked during the session, by pid
+static std::vector<std::string> listProcessFolders(const std::string &path) {
+  std::vector<std::pair<int, std::string>> folders;
+  std::error_code error;
+  for (const auto &entry : std::filesystem::directory_iterator(path, error)) {
+    const std::string name = entry.path().filename().string();
+    int pid;
+    if (entry.is_directory(error) &&
+        sscanf(name.c_str(), "process_%d", &pid) == 1 &&
+        name == processFolderName(pid)) {
+      folders.emplace_back(pid, name);
+    }
+  }
+  std::sort(folders.begin(), folders.end());
+  std::vector<std::string> names;
+  for (auto &[pid, name] : folders) {
+    names.push_back(std::move(name));
+  }
+  return names;
+}
+
+// Appends the rows of the session of one process
+static bool readProcessSession(const std::string &path,
+                               std::vector<session_row_t> &data,
+                               std::unordered_map<uint64_t, id_map> &locationIDMap,
+                               thread_table_t &threads,
+                               std::atomic<float> &progress,
+                               const segment_range_t &segments) {
+  const std::vector<uint64_t> allSegments = ListSessionSegments(path);
+  std::vector<std::string> sessionFiles;
+  if (allSegments.empty()) {
+    sessionFiles.push_back(SESSION_FILENAME);
+  }
+  for (uint64_t segment : allSegments) {
+    if (segment >= segments.first && segment <= segments.last) {
+      sessionFiles.push_back(sessionSegmentFilename(segment));
+    }
+  }
+  if (sessionFiles.empty()) {
+    std::cerr << "Error: No session segment in the requested range!"
+              << std::endl;
+    return false;
+  }
+
+  // Closed files embed their tables and every file defines its locations as
+  // it goes. The tables written next to the files are only needed by the
+  // crash dumps and the legacy sessions.
+  std::unordered_map<std::string, session_sections_t> fileSections;
+  for (const std::string &sessionFile : sessionFiles) {
+    session_sections_t sections;
+    if (readSessionSections(path + sessionFile, sections)) {
+      fileSections[sessionFile] = std::move(sections);
+    }
+  }
+  // Rows point into the location table, it has to be complete before
+  // decoding
+  bool haveLocations = false;
+  std::string info;
+  std::vector<thread_meta_t> embeddedThreads;
+  for (const std::string &sessionFile : sessionFiles) {
+    const auto sections = fileSections.find(sessionFile);
+    if (sections == fileSections.end()) {
+      continue;
+    }
+    for (id_map &location : sections->second.locations) {
+      locationIDMap[location.id] = std::move(location);
+    }
+    haveLocations = true;
+    // Later files know more threads
+    info = std::move(sections->second.info);
+    embeddedThreads = std::move(sections->second.threads);
+  }
+  const bool allEmbedded = fileSections.size() == sessionFiles.size();
+  if (!allEmbedded) {
+    // Location ids are the same in every segment, so all the tables are
+    // merged: the segment being written has none yet
+    haveLocations |=
+        readLocationTable(path + SESSION_ID_MAP_FILENAME, locationIDMap);
+    for (uint64_t segment : allSegments) {
+      haveLocations |= readLocationTable(
+          path + segmentLocationsFilename(segment), locationIDMap);
+    }
+  }
+
+  // Session info is optional, legacy sessions without it were recorded in
+  // nanoseconds. The clock rate of the others is in the session header.
+  if (info.empty()) {
+    std::ifstream sessionInfoFile(path + SESSION_INFO_FILENAME,
+                                  std::fstream::in);
+    info.assign(std::istreambuf_iterator<char>(sessionInfoFile),
+                std::istreambuf_iterator<char>());
+  }
+  std::istringstream ticksInfo(info);
+  const double infoTicksToSeconds = 1.0 / (ParseTicksPerNs(ticksInfo) * 1e9);
+
+  // Range of the blocks of a file following its preamble
+  bool warnedRecordKinds = false;
+  const auto findBlocks = [&](const std::string &sessionFile,
+                              const std::vector<uint8_t> &raw,
+                              const uint8_t *&begin, const uint8_t *&end,
+                              double &ticksToSeconds) {
+    using namespace session_encoding;
+    begin = raw.data() + kPreambleSize;
+    end = raw.data() + raw.size();
+    session_header_t header;
+    if (!getSessionHeader(begin, end, header) || header.ticksPerNs <= 0.0) {
+      return false;
+    }
+    ticksToSeconds = 1.0 / (header.ticksPerNs * 1e9);
+    if (header.recordKinds > kRecordKinds && !warnedRecordKinds) {
+      std::cerr << "Warning: " << sessionFile
+                << " holds records of a newer profiler, they are ignored"
+                << std::endl;
+      warnedRecordKinds = true;
+    }
+    const auto sections = fileSections.find(sessionFile);
+    if (sections != fileSections.end()) {
+      const session_sections_t &blocks = sections->second;
+      if (blocks.blocksOffset < (uint64_t)(begin - raw.data()) ||
+          blocks.blocksOffset + blocks.blocksSize > raw.size()) {
+        return false;
+      }
+      begin = raw.data() + blocks.blocksOffset;
+      end = begin + blocks.blocksSize;
+    }
+    return true;
+  };
+
+  const size_t firstRow = data.size();
+  for (const std::string &sessionFile : sessionFiles) {
+    std::vector<uint8_t> raw;
+    if (!readFile(path + sessionFile, raw)) {
+      // Segments may be deleted by the rotation while loading
+      std::cerr << "Error: Could not read " << sessionFile << std::endl;
+      if (allSegments.empty()) {
+        return false;
+      }
+      continue;
+    }
+    const uint32_t version =
+        session_encoding::getPreamble(raw.data(), raw.size());
+    // Legacy sessions don't define their locations
+    if (version == 0 && !haveLocations) {
+      return false;
+    }
+    if (version == 0 && allSegments.empty()) {
+      decodeLegacySession(raw, infoTicksToSeconds, data, locationIDMap,
+                          progress);
+      return true;
+    }
+    if (version != session_encoding::kFormatVersion) {
+      std::cerr << "Error: Unsupported session format version " << version
+                << std::endl;
+      return false;
+    }
+    const uint8_t *begin, *end;
+    double ticksToSeconds;
+    if (!findBlocks(sessionFile, raw, begin, end, ticksToSeconds)) {
+      std::cerr << "Error: Corrupted header in " << sessionFile << std::endl;
+      continue;
+    }
+
+    data.reserve(data.size() + raw.size() / 6);
+    if (!decodeBlocks(begin, end, ticksToSeconds, data, locationIDMap,
+                      progress)) {
+      std::cerr << "Error: " << sessionFile << " is truncated!" << std::endl;
+    }
+  }
+
+  // Measures that were still in memory when the process crashed, they follow
+  // the last segment
+  std::vector<uint8_t> crashRaw;
+  if ((allSegments.empty() || segments.last >= allSegments.back()) &&
+      readFile(path + SESSION_CRASH_FILENAME, crashRaw)) {
+    const uint32_t crashVersion =
+        session_encoding::getPreamble(crashRaw.data(), crashRaw.size());
+    const uint8_t *begin, *end;
+    double ticksToSeconds;
+    if (crashVersion != session_encoding::kFormatVersion ||
+        !findBlocks(SESSION_CRASH_FILENAME, crashRaw, begin, end,
+                    ticksToSeconds) ||
+        !decodeBlocks(begin, end, ticksToSeconds, data, locationIDMap,
+                      progress)) {
+      std::cerr << "Error: Crash dump of the session is corrupted!"
+                << std::endl;
+    }
+  }
+  std::istringstream pidInfo(info);
+  const uint32_t pid = parseSessionPid(pidInfo);
+  for (size_t i = firstRow; i < data.size(); i++) {
+    data[i].pid = pid;
+  }
+  if (allEmbedded) {
+    for (thread_meta_t &thread : embeddedThreads) {
+      threads[{pid, thread.threadId}] = std::move(thread);
+    }
+  } else {
+    readThreadTable(path + SESSION_THREADS_FILENAME, pid, threads);
+  }
+  progress = 1.0f;
+  return true;
+}
+
+bool ReadSessionCSV(const std::string &path, std::vector<session_row_t> &data,
+                    std::unordered_map<uint64_t, id_map> &locationIDMap,
+                    thread_table_t &threads, std::atomic<float> &progress,
+                    const segment_range_t &segments) {
   data.clear();
-  data.reserve(readCount);
-  constexpr size_t kProgressStride = 4096;
-  for (size_t i = 0; i < readCount; i++) {
-    const session_row_binary_t &ser = rawRecords[i];
-    const id_map &loc = locationIDMap[ser.location_id];
-    data.emplace_back(session_row_t{ser.time / 1e9, ser.duration / 1e9,
-                                    ser.location_id, ser.thread_id, loc.path,
-                                    loc.line, loc.function, loc.name});
-    if ((i % kProgressStride) == 0 || i + 1 == readCount) {
-      progress = (float)(i + 1) / readCount;
+  locationIDMap.clear();
+  threads.clear();
+  if (!readProcessSession(path, data, locationIDMap, threads, progress,
+                          segments)) {
+    return false;
+  }
+
+  // Every process numbers its own locations
+  uint64_t processIndex = 0;
+  for (const std::string &folder : listProcessFolders(path)) {
+    std::vector<session_row_t> rows;
+    std::unordered_map<uint64_t, id_map> locations;
+    if (!readProcessSession(path + folder + "/", rows, locations, threads,
+                            progress, {})) {
+      std::cerr << "Error: Could not load " << folder << std::endl;
+      continue;
+    }
+    const uint64_t idBase = ++processIndex << 32;
+    for (auto &[id, location] : locations) {
+      location.id = idBase | id;
+      locationIDMap[idBase | id] = std::move(location);
+    }
+    // The rows point into locations, bind them to the merged entries
+    data.reserve(data.size() + rows.size());
+    for (session_row_t &row : rows) {
+      row.locationId |= idBase;
+      if (row.parentLocationId != session_row_t::kNoParentLocation) {
+        row.parentLocationId |= idBase;
+      }
+      const id_map &loc = locationIDMap[row.locationId];
+      row.path = loc.path;
+      row.function = loc.function;
+      row.name = loc.name;
+      data.push_back(row);
     }
   }
   return true;
 }
+
+void ComputeSelfDurations(std::vector<session_row_t> &data) {
+  std::vector<size_t> order;
+  order.reserve(data.size());
+  for (size_t i = 0; i < data.size(); i++) {
+    data[i].selfDuration = data[i].duration;
+    data[i].children = 0;
+    data[i].descendants = 0;
+    if (data[i].kind == session_encoding::RecordKind::Scope) {
+      order.push_back(i);
+    }
+  }
+  // Parents start before (or together with, at a lower depth) their children
+  std::sort(order.begin(), order.end(), [&](size_t a, size_t b) {
+    const session_row_t &rowA = data[a];
+    const session_row_t &rowB = data[b];
+    if (rowA.pid != rowB.pid) {
+      return rowA.pid < rowB.pid;
+    }
+    if (rowA.threadId != rowB.threadId) {
+      return rowA.threadId < rowB.threadId;
+    }
+    if (rowA.time != rowB.time) {
+      return rowA.time < rowB.time;
+    }
+    return rowA.depth < rowB.depth;
+  });
+
+  std::vector<size_t> stack;
+  for (size_t i = 0; i < order.size(); i++) {
+    session_row_t &row = data[order[i]];
+    while (!stack.empty()) {
+      const session_row_t &top = data[stack.back()];
+      if (top.pid == row.pid && top.threadId == row.threadId &&
+          top.depth < row.depth &&
+          row.time < top.time + top.duration) {
+        break;
+      }
+      stack.pop_back();
+    }
+    if (!stack.empty() && data[stack.back()].depth + 1 == row.depth) {
+      data[stack.back()].selfDuration -= row.duration;
+      data[stack.back()].children++;
+    }
+    for (size_t enclosing : stack) {
+      data[enclosing].descendants++;
+    }
+    stack.push_back(order[i]);
+  }
+}
+
+void UpdateSelfDurations(std::vector<session_row_t> &data,
+                         self_durations_t &state) {
+  std::pair<uint32_t, uint64_t> lastThread{0, UINT64_MAX};
+  std::vector<self_durations_t::pending_t> *pending = nullptr;
+  for (size_t i = state.rows; i < data.size(); i++) {
+    session_row_t &row = data[i];
+    row.selfDuration = row.duration;
+    row.children = 0;
+    row.descendants = 0;
+    if (row.kind != session_encoding::RecordKind::Scope) {
+      continue;
+    }
+    const std::pair<uint32_t, uint64_t> thread{row.pid, row.threadId};
+    if (!pending || thread != lastThread) {
+      pending = &state.threads[thread];
+      lastThread = thread;
+    }
+    if (pending->size() < (size_t)row.depth + 2) {
+      pending->resize((size_t)row.depth + 2);
+    }
+    // Deeper than the direct children only when their parent was dropped
+    for (size_t depth = row.depth + 1; depth < pending->size(); depth++) {
+      self_durations_t::pending_t &nested = (*pending)[depth];
+      if (depth == row.depth + 1) {
+        row.selfDuration -= nested.duration;
+        row.children = nested.count;
+      }
+      row.descendants += nested.count + nested.descendants;
+      nested = {};
+    }
+    self_durations_t::pending_t &level = (*pending)[row.depth];
+    level.duration += row.duration;
+    level.count++;
+    level.descendants += row.descendants;
+  }
+  state.rows = data.size();
+}
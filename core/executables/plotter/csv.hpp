@@ -1,10 +1,15 @@
 #pragma once
 
 #include <atomic>
+#include <cstdint>
+#include <istream>
+#include <map>
 #include <string>
 #include <unordered_map>
 #include <vector>
 
+#include "profiler/encoding.hpp"
+
 struct __attribute__((packed)) session_row_binary_t {
   int64_t time;
   uint64_t location_id;
@@ -20,6 +25,22 @@ struct session_row_t {
   int line;
   std::string_view function;
   std::string_view name;
+  uint32_t depth = 0;
+  // Location of the enclosing scope, kNoParentLocation if none
+  uint64_t parentLocationId = kNoParentLocation;
+  // Duration minus the duration of the direct children
+  double selfDuration = 0.0;
+  session_encoding::RecordKind kind = session_encoding::RecordKind::Scope;
+  // Raw sample of counters and gauges, instance of the mutex of lock records
+  int64_t value = 0;
+  // Process that recorded the row, 0 if the session doesn't say
+  uint32_t pid = 0;
+  // Scopes nested in this one, directly and at any depth, see
+  // ComputeSelfDurations()
+  uint32_t children = 0;
+  uint32_t descendants = 0;
+
+  static constexpr uint64_t kNoParentLocation = UINT64_MAX;
 };
 struct id_map {
   uint64_t id;
@@ -28,7 +49,90 @@ struct id_map {
   std::string function;
   std::string name;
 };
+// One line of the thread table of a process (see SESSION_THREADS_FILENAME)
+struct thread_meta_t {
+  uint64_t threadId;
+  // OS thread id, 0 if unknown
+  int64_t tid = 0;
+  std::string name;
+};
+// Threads of every process of the session, by (pid, thread id)
+using thread_table_t =
+    std::map<std::pair<uint32_t, uint64_t>, thread_meta_t>;
+
+// Decodes the block at in, appending its rows or adding the locations it
+// defines, and moves in past it. Returns false if the block header is
+// truncated.
+bool DecodeSessionBlock(const uint8_t *&in, const uint8_t *end,
+                        double ticksToSeconds,
+                        std::vector<session_row_t> &data,
+                        std::unordered_map<uint64_t, id_map> &locationIDMap);
+// One line of the location table file
+bool ParseLocationLine(const std::string &line, id_map &location);
+// One line of the thread table file
+bool ParseThreadLine(const std::string &line, thread_meta_t &thread);
+// Clock rate saved in a session info file, 1 if missing
+double ParseTicksPerNs(std::istream &sessionInfo);
+
+// Cost of the profiler measured when the session started, in seconds, zero
+// if the session was not calibrated
+struct scope_overhead_t {
+  // Part of its own duration a scope records for itself
+  double own = 0.0;
+  // Added to the duration of the enclosing scopes by each nested scope
+  double nested = 0.0;
+};
+scope_overhead_t ParseScopeOverhead(std::istream &sessionInfo);
+// Calibration saved in the session info of a session folder
+scope_overhead_t ReadScopeOverhead(const std::string &path);
+// Measures the process discarded because the ring of their thread was full
+uint64_t ParseDroppedMeasures(std::istream &sessionInfo);
+uint64_t ReadDroppedMeasures(const std::string &path);
 
+// Segments of a rotated session to load, bounds included
+struct segment_range_t {
+  uint64_t first = 0;
+  uint64_t last = UINT64_MAX;
+};
+
+// Indices of the segments of a rotated session, sorted, empty if the session
+// is not rotated
+std::vector<uint64_t> ListSessionSegments(const std::string &path);
+
+// Loads a session folder. The segments of a rotated session in the range are
+// loaded as a single session. The sessions of the child processes forked
+// after initialize() (see processFolderName) are merged in, their location
+// ids offset by (child number << 32). The thread tables of every process are
+// loaded in threads.
 bool ReadSessionCSV(const std::string &path, std::vector<session_row_t> &data,
                     std::unordered_map<uint64_t, id_map> &locationIDMap,
-                    std::atomic<float> &progress);
+                    thread_table_t &threads,
+                    std::atomic<float> &progress,
+                    const segment_range_t &segments = {});
+
+// Fills selfDuration, children and descendants of every row by matching each
+// scope with its direct children (same thread, nested in time, one level
+// deeper).
+void ComputeSelfDurations(std::vector<session_row_t> &data);
+
+// State of UpdateSelfDurations() between calls
+struct self_durations_t {
+  // Scopes ended at one depth of a thread since their parent, if any, ended
+  struct pending_t {
+    double duration = 0.0;
+    uint32_t count = 0;
+    uint32_t descendants = 0;
+  };
+  // Rows already filled
+  size_t rows = 0;
+  // By (pid, thread id), then depth
+  std::map<std::pair<uint32_t, uint64_t>, std::vector<pending_t>> threads;
+};
+
+// Same as ComputeSelfDurations() for the rows appended since the last call,
+// as they arrive from a live session. Relies on the rows of each thread
+// coming in the order their scopes ended, so that the children of a scope
+// are the scopes ended one level deeper since the previous scope at its
+// depth or above.
+void UpdateSelfDurations(std::vector<session_row_t> &data,
+                         self_durations_t &state);
@@ -0,0 +1,203 @@
+#include "live.hpp"
+#include "profiler/live_stream.hpp"
+
+#include <cstring>
+#include <iostream>
+#include <sstream>
+
+#include <sys/socket.h>
+#include <sys/un.h>
+#include <unistd.h>
+
+using live_protocol::LiveMessage;
+
+LiveConnection::~LiveConnection() { disconnect(); }
+
+bool LiveConnection::connect(const std::string &path) {
+  disconnect();
+  sockaddr_un address{};
+  if (path.empty() || path.size() >= sizeof(address.sun_path)) {
+    return false;
+  }
+  address.sun_family = AF_UNIX;
+  memcpy(address.sun_path, path.c_str(), path.size());
+  fd = socket(AF_UNIX, SOCK_STREAM | SOCK_CLOEXEC, 0);
+  if (fd < 0) {
+    return false;
+  }
+  if (::connect(fd, (const sockaddr *)&address, sizeof(address)) != 0) {
+    std::cerr << "Error: Could not connect to " << path << ": "
+              << strerror(errno) << std::endl;
+    ::close(fd);
+    fd = -1;
+    return false;
+  }
+  running = true;
+  receiver = std::thread(&LiveConnection::receiveLoop, this);
+  return true;
+}
+
+void LiveConnection::disconnect() {
+  if (fd < 0) {
+    return;
+  }
+  // Wakes up the receiver blocked in recv
+  shutdown(fd, SHUT_RDWR);
+  if (receiver.joinable()) {
+    receiver.join();
+  }
+  ::close(fd);
+  fd = -1;
+  running = false;
+}
+
+size_t LiveConnection::takeRows(std::vector<session_row_t> &rows) {
+  std::scoped_lock lck(pendingMtx);
+  const size_t count = pending.size();
+  rows.insert(rows.end(), pending.begin(), pending.end());
+  pending.clear();
+  return count;
+}
+
+thread_table_t LiveConnection::threads() {
+  std::scoped_lock lck(pendingMtx);
+  return threadTable;
+}
+
+scope_overhead_t LiveConnection::overhead() {
+  std::scoped_lock lck(pendingMtx);
+  return scopeOverhead;
+}
+
+void LiveConnection::receiveLoop() {
+  std::vector<uint8_t> buffer;
+  size_t consumed = 0;
+  for (;;) {
+    uint8_t chunk[1 << 16];
+    const ssize_t res = recv(fd, chunk, sizeof(chunk), 0);
+    if (res < 0 && errno == EINTR) {
+      continue;
+    }
+    if (res <= 0) {
+      break;
+    }
+    buffer.insert(buffer.end(), chunk, chunk + res);
+
+    const uint8_t *in = buffer.data() + consumed;
+    const uint8_t *const end = buffer.data() + buffer.size();
+    if (version == 0) {
+      if (end - in < (ptrdiff_t)session_encoding::kPreambleSize) {
+        continue;
+      }
+      version = session_encoding::getPreamble(in, end - in);
+      if (version != session_encoding::kFormatVersion) {
+        std::cerr << "Error: Unsupported live stream" << std::endl;
+        break;
+      }
+      in += session_encoding::kPreambleSize;
+    }
+    if (!haveHeader) {
+      session_encoding::session_header_t header;
+      const uint8_t *fields = in;
+      if (!session_encoding::getSessionHeader(fields, end, header)) {
+        // Incomplete header, wait for more data
+        consumed = in - buffer.data();
+        continue;
+      }
+      haveHeader = true;
+      ticksToSeconds = 1.0 / (header.ticksPerNs * 1e9);
+      in = fields;
+    }
+    bool failed = false;
+    for (;;) {
+      const uint8_t *message = in;
+      if (message == end) {
+        break;
+      }
+      const uint8_t type = *message++;
+      uint64_t size;
+      if (!session_encoding::getVarint(message, end, size) ||
+          size > (uint64_t)(end - message)) {
+        // Incomplete message, wait for more data
+        break;
+      }
+      if (!handleMessage(type, message, size)) {
+        failed = true;
+        break;
+      }
+      in = message + size;
+    }
+    if (failed) {
+      break;
+    }
+    consumed = in - buffer.data();
+    // Drop the parsed messages once they make up most of the buffer
+    if (consumed > buffer.size() / 2) {
+      buffer.erase(buffer.begin(), buffer.begin() + consumed);
+      consumed = 0;
+    }
+  }
+  running = false;
+}
+
+bool LiveConnection::handleMessage(uint8_t type, const uint8_t *payload,
+                                   size_t size) {
+  switch ((LiveMessage)type) {
+  case LiveMessage::Info: {
+    const std::string text((const char *)payload, size);
+    std::istringstream info(text);
+    ticksToSeconds = 1.0 / (ParseTicksPerNs(info) * 1e9);
+    std::istringstream overheadInfo(text);
+    std::scoped_lock lck(pendingMtx);
+    scopeOverhead = ParseScopeOverhead(overheadInfo);
+    return true;
+  }
+  case LiveMessage::Locations: {
+    std::istringstream lines(std::string((const char *)payload, size));
+    std::string line;
+    while (std::getline(lines, line)) {
+      id_map location;
+      if (ParseLocationLine(line, location)) {
+        // Rows handed out may already point to existing entries
+        locationIDMap.try_emplace(location.id, location);
+      }
+    }
+    return true;
+  }
+  case LiveMessage::Threads: {
+    std::istringstream lines(std::string((const char *)payload, size));
+    std::string line;
+    std::scoped_lock lck(pendingMtx);
+    while (std::getline(lines, line)) {
+      thread_meta_t thread;
+      if (ParseThreadLine(line, thread)) {
+        // The process is not known, the live stream is a single process
+        threadTable[{0, thread.threadId}] = std::move(thread);
+      }
+    }
+    return true;
+  }
+  case LiveMessage::Block: {
+    std::vector<session_row_t> rows;
+    const uint8_t *in = payload;
+    if (!DecodeSessionBlock(in, payload + size, ticksToSeconds, rows,
+                            locationIDMap)) {
+      return false;
+    }
+    std::scoped_lock lck(pendingMtx);
+    pending.insert(pending.end(), rows.begin(), rows.end());
+    return true;
+  }
+  case LiveMessage::Dropped: {
+    uint64_t dropped;
+    const uint8_t *in = payload;
+    if (session_encoding::getVarint(in, payload + size, dropped)) {
+      droppedMeasures = dropped;
+    }
+    return true;
+  }
+  default:
+    // Unknown messages are skipped, newer processes may send more
+    return true;
+  }
+}
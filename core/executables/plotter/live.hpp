@@ -0,0 +1,57 @@
+#pragma once
+
+#include <atomic>
+#include <mutex>
+#include <string>
+#include <thread>
+#include <unordered_map>
+#include <vector>
+
+#include "csv.hpp"
+
+// Client of the live stream of a running session (see
+// SessionConfig::liveSocket). Messages are decoded on a background thread
+// and the rows collected with takeRows().
+class LiveConnection {
+public:
+  ~LiveConnection();
+
+  // Returns false if nothing listens on path
+  bool connect(const std::string &path);
+  void disconnect();
+  // false once the process closed the session or the connection broke
+  bool connected() const { return running.load(); }
+
+  // Appends the rows received since the last call, returns their number
+  size_t takeRows(std::vector<session_row_t> &rows);
+  // Measures the process dropped because the plotter didn't keep up
+  uint64_t dropped() const { return droppedMeasures.load(); }
+
+  // Locations received so far, the rows point into it so it has to outlive
+  // them. Only grows, entries are never modified once inserted.
+  std::unordered_map<uint64_t, id_map> &locations() { return locationIDMap; }
+  // Copy of the thread table received so far
+  thread_table_t threads();
+  // Calibration sent in the session info
+  scope_overhead_t overhead();
+
+private:
+  void receiveLoop();
+  bool handleMessage(uint8_t type, const uint8_t *payload, size_t size);
+
+  int fd = -1;
+  std::thread receiver;
+  std::atomic<bool> running = false;
+  std::atomic<uint64_t> droppedMeasures = 0;
+
+  // Written by the receiver only
+  std::unordered_map<uint64_t, id_map> locationIDMap;
+  uint32_t version = 0;
+  bool haveHeader = false;
+  double ticksToSeconds = 1e-9;
+
+  std::mutex pendingMtx;
+  std::vector<session_row_t> pending;
+  thread_table_t threadTable;
+  scope_overhead_t scopeOverhead;
+};
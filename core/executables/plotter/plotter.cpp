@@ -13,6 +13,7 @@ extern "C" {
 #include <fstream>
 #include <iostream>
 #include <inttypes.h>
+#include <set>
 
 ImFont *h1;
 ImFont *h2;
@@ -61,15 +62,128 @@ void Plotter::startLoading(SessionState &session) {
     session.loadingThread->join();
   }
   session.loadingThread = std::make_unique<std::thread>([this, &session]() {
+    session.availableSegments = ListSessionSegments(session.loadedPath);
+    segment_range_t segments;
+    segments.first = std::max(session.firstSegment, 0);
+    if (session.lastSegment >= 0) {
+      segments.last = session.lastSegment;
+    }
     session.sessionCsvValid = ReadSessionCSV(
         session.loadedPath, session.sessionData, session.locationIDMap,
-        session.progress);
+        session.threads, session.progress, segments);
+    session.overhead = ReadScopeOverhead(session.loadedPath);
+    session.droppedMeasures = ReadDroppedMeasures(session.loadedPath);
+    ComputeSelfDurations(session.sessionData);
+    session.processedRows = 0;
     processSessionData(session);
     session.loading = false;
   });
   session.loading = true;
 }
 
+static constexpr auto kLiveRefreshPeriod = std::chrono::seconds(1);
+
+// Moves the processed data of from into to, leaving the rows in place
+static void swapResults(SessionState &from, SessionState &to) {
+  std::swap(from.measurements, to.measurements);
+  to.threads = from.threads;
+  to.overhead = from.overhead;
+  to.droppedMeasures = from.droppedMeasures;
+  std::swap(from.counters, to.counters);
+  std::swap(from.locks, to.locks);
+  std::swap(from.asyncTracks, to.asyncTracks);
+  std::swap(from.locksByWait, to.locksByWait);
+  std::swap(from.endTime, to.endTime);
+  std::swap(from.measurementsPerSecond, to.measurementsPerSecond);
+  std::swap(from.keysByDuration, to.keysByDuration);
+  std::swap(from.keysByAppearance, to.keysByAppearance);
+  std::swap(from.multiProcess, to.multiProcess);
+  std::swap(from.processedRows, to.processedRows);
+  std::swap(from.processedGrouped, to.processedGrouped);
+  std::swap(from.processedSubtracted, to.processedSubtracted);
+  std::swap(from.asyncSpans, to.asyncSpans);
+}
+
+void Plotter::connectLive(const std::string &path) {
+  finishLive();
+  live = std::make_unique<LiveConnection>();
+  if (!live->connect(path)) {
+    liveError = "Could not connect to " + path;
+    live.reset();
+    return;
+  }
+  liveError.clear();
+  liveSession.sessionData.clear();
+  liveSession.processedRows = 0;
+  liveSession.selfDurations = {};
+  primary.sessionData.clear();
+  primary.processedRows = 0;
+  primary.loadedPath = path;
+  primary.sessionCsvValid = false;
+  lastLiveUpdate = {};
+}
+
+// Called every frame while connected: the rows received are processed at
+// most once per kLiveRefreshPeriod, without blocking the UI. The results
+// swapped out of primary are one refresh behind and get the rows they miss
+// at the next one.
+void Plotter::updateLive() {
+  if (liveResultsReady) {
+    liveSession.loadingThread->join();
+    liveResultsReady = false;
+    liveSession.loading = false;
+    swapResults(liveSession, primary);
+    primary.sessionCsvValid = true;
+  }
+  if (liveSession.loading ||
+      std::chrono::steady_clock::now() - lastLiveUpdate < kLiveRefreshPeriod) {
+    return;
+  }
+  lastLiveUpdate = std::chrono::steady_clock::now();
+  // Rows still pending are taken before checking the connection, so the
+  // last ones are not lost
+  const bool stillConnected = live->connected();
+  if (live->takeRows(liveSession.sessionData) == 0) {
+    if (!stillConnected) {
+      finishLive();
+    }
+    return;
+  }
+  liveSession.threads = live->threads();
+  liveSession.overhead = live->overhead();
+  liveSession.loading = true;
+  liveSession.loadingThread = std::make_unique<std::thread>([this]() {
+    UpdateSelfDurations(liveSession.sessionData, liveSession.selfDurations);
+    processSessionData(liveSession);
+    liveResultsReady = true;
+  });
+}
+
+// Turns the live data into a regular session
+void Plotter::finishLive() {
+  if (!live) {
+    return;
+  }
+  live->disconnect();
+  if (liveSession.loadingThread && liveSession.loadingThread->joinable()) {
+    liveSession.loadingThread->join();
+  }
+  liveSession.loading = false;
+  liveResultsReady = false;
+  live->takeRows(liveSession.sessionData);
+  liveSession.threads = live->threads();
+  liveSession.overhead = live->overhead();
+  UpdateSelfDurations(liveSession.sessionData, liveSession.selfDurations);
+  processSessionData(liveSession);
+  swapResults(liveSession, primary);
+  primary.sessionData = std::move(liveSession.sessionData);
+  liveSession.sessionData.clear();
+  // Rows point into the location map, moving it keeps its entries in place
+  primary.locationIDMap = std::move(live->locations());
+  primary.sessionCsvValid = true;
+  live.reset();
+}
+
 bool Plotter::drawPathPicker(const char *idLabel, std::string &path) {
   ImGui::PushID(idLabel);
   ImGui::AlignTextToFramePadding();
@@ -93,7 +207,11 @@ bool Plotter::drawPathPicker(const char *idLabel, std::string &path) {
 }
 
 void Plotter::Draw() {
+  if (live) {
+    updateLive();
+  }
   if (primary.shouldStartLoading) {
+    finishLive();
     startLoading(primary);
   }
 
@@ -117,6 +235,17 @@ void Plotter::Draw() {
     return;
   }
 
+  if (live && !primary.sessionCsvValid) {
+    ImGui::SetNextWindowSize(ImVec2(400, 100), ImGuiCond_Once);
+    ImGui::Begin("Loading");
+    ImGui::Text("Waiting for data from %s", primary.loadedPath.c_str());
+    if (ImGui::Button("Disconnect")) {
+      finishLive();
+    }
+    ImGui::End();
+    return;
+  }
+
   if (!primary.sessionCsvValid) {
     ImGui::SetNextWindowSize(ImVec2(600, 200), ImGuiCond_Once);
     if (!ImGui::IsWindowFocused(ImGuiFocusedFlags_ChildWindows)) {
@@ -130,6 +259,32 @@ void Plotter::Draw() {
       primary.loadedPath = path;
       primary.shouldStartLoading = true;
     }
+    ImGui::AlignTextToFramePadding();
+    ImGui::Text("Segments of a rotated session:");
+    ImGui::SameLine();
+    ImGui::SetNextItemWidth(100);
+    ImGui::InputInt("first##segments", &primary.firstSegment);
+    ImGui::SameLine();
+    ImGui::SetNextItemWidth(100);
+    ImGui::InputInt("last (-1 for the latest)##segments",
+                    &primary.lastSegment);
+    primary.firstSegment = std::max(primary.firstSegment, 0);
+    primary.lastSegment = std::max(primary.lastSegment, -1);
+    ImGui::Separator();
+    ImGui::AlignTextToFramePadding();
+    ImGui::Text("Live process socket:");
+    ImGui::SameLine();
+    std::string &socketPath = KVP::getMutable("live socket");
+    const bool enterPressed = ImGui::InputText(
+        "##live_socket", &socketPath, ImGuiInputTextFlags_EnterReturnsTrue);
+    ImGui::SameLine();
+    if (ImGui::Button("Connect to live process") || enterPressed) {
+      connectLive(socketPath);
+    }
+    if (!liveError.empty()) {
+      ImGui::TextColored(ImVec4(1.0f, 0.4f, 0.4f, 1.0f), "%s",
+                         liveError.c_str());
+    }
     ImGui::End();
   } else {
     drawMenuBar();
@@ -157,6 +312,14 @@ void Plotter::Draw() {
       drawCompare();
     }
     ImGui::End();
+
+    if (!ImGui::GetCurrentContext()->SettingsLoaded) {
+      ImGui::SetNextWindowSize(ImVec2(600, 400), ImGuiCond_Once);
+    }
+    if (ImGui::Begin("Contention")) {
+      drawContention();
+    }
+    ImGui::End();
   }
 
   if (exportModalOpen) {
@@ -255,88 +418,385 @@ std::string formatMetricValue(double value, int opts) {
   return buf;
 }
 
+// Total of meas that accumulates the records of kind, nullptr for kinds that
+// are not attached to scopes
+static uint64_t *scopeMetric(measurement_element_t &meas,
+                             session_encoding::RecordKind kind) {
+  using session_encoding::RecordKind;
+  switch (kind) {
+  case RecordKind::Allocations:
+    return &meas.allocations;
+  case RecordKind::AllocatedBytes:
+    return &meas.allocatedBytes;
+  case RecordKind::Cycles:
+    return &meas.cycles;
+  case RecordKind::Instructions:
+    return &meas.instructions;
+  case RecordKind::CacheMisses:
+    return &meas.cacheMisses;
+  case RecordKind::BranchMisses:
+    return &meas.branchMisses;
+  case RecordKind::ContextSwitches:
+    return &meas.contextSwitches;
+  case RecordKind::TaskClock:
+    return &meas.taskClock;
+  case RecordKind::PageFaults:
+    return &meas.pageFaults;
+  default:
+    return nullptr;
+  }
+}
+
+static constexpr auto byTime = [](const auto &a, const auto &b) {
+  return a.time < b.time;
+};
+
+// Sorts the elements appended to values after its first sorted ones into
+// place, only moving the sorted elements they overlap
+template <typename T, typename Less>
+static void mergeAppended(std::vector<T> &values, size_t sorted, Less less) {
+  std::sort(values.begin() + sorted, values.end(), less);
+  if (sorted == 0 || sorted == values.size()) {
+    return;
+  }
+  const auto first = std::upper_bound(values.begin(), values.begin() + sorted,
+                                      values[sorted], less);
+  std::inplace_merge(first, values.begin() + sorted, values.end(), less);
+}
+
+// Same for the samples of a track. Counter samples hold the running total,
+// which is recomputed for the samples moved.
+static void mergeAppendedSamples(counter_track_t &track, size_t sorted) {
+  auto &samples = track.samples;
+  std::sort(samples.begin() + sorted, samples.end(), byTime);
+  const size_t first =
+      std::upper_bound(samples.begin(), samples.begin() + sorted,
+                       samples[sorted], byTime) -
+      samples.begin();
+  const bool accumulated = track.kind == session_encoding::RecordKind::Counter;
+  if (accumulated) {
+    for (size_t i = sorted; i-- > std::max<size_t>(first, 1);) {
+      samples[i].value -= samples[i - 1].value;
+    }
+  }
+  std::inplace_merge(samples.begin() + first, samples.begin() + sorted,
+                     samples.end(), byTime);
+  if (accumulated) {
+    for (size_t i = std::max<size_t>(first, 1); i < samples.size(); i++) {
+      samples[i].value += samples[i - 1].value;
+    }
+  }
+}
+
+// Adds the rows after session.processedRows to the results, from the first
+// row when the options changed. The self durations of the rows must be
+// filled.
 void Plotter::processSessionData(SessionState &session) {
-  session.measurements.clear();
+  const std::vector<session_row_t> &rows = session.sessionData;
+  const bool grouping = groupByThread && !session.threads.empty();
+  const scope_overhead_t &overhead = session.overhead;
+  const bool subtract = subtractOverhead && overhead.own + overhead.nested > 0;
+  size_t firstRow = session.processedRows > rows.size()
+                        ? 0
+                        : session.processedRows;
+  const bool multiProcess =
+      (firstRow != 0 && session.multiProcess) ||
+      std::any_of(rows.begin() + firstRow, rows.end(),
+                  [&](const session_row_t &row) {
+                    return row.pid != rows.front().pid;
+                  });
+  if (firstRow == 0 || grouping != session.processedGrouped ||
+      subtract != session.processedSubtracted ||
+      multiProcess != session.multiProcess) {
+    firstRow = 0;
+    session.measurements.clear();
+    session.counters.clear();
+    session.locks.clear();
+    session.asyncTracks.clear();
+    session.asyncSpans.clear();
+    session.measurementsPerSecond.clear();
+  }
+  session.processedRows = rows.size();
+  session.processedGrouped = grouping;
+  session.processedSubtracted = subtract;
+  session.multiProcess = multiProcess;
+  session.locksByWait.clear();
   session.keysByDuration.clear();
   session.keysByAppearance.clear();
-  session.measurementsPerSecond.resize(session.sessionData.size());
-  std::vector<double> measurementsTimes(session.sessionData.size());
-  std::unordered_map<uint64_t, measurement_element_t *> locationCache;
+  const size_t sortedTimes = session.measurementsPerSecond.size();
+  // Samples of the tracks before the new rows
+  std::map<counter_track_t *, size_t> sortedSamples;
+  std::set<async_track_t *> changedAsyncTracks;
+  // One cache per thread group, group 0 holds every row when not grouping
+  std::vector<std::unordered_map<uint64_t, measurement_element_t *>>
+      locationCaches(1);
+  std::vector<std::string> threadGroups{""};
+  const auto groupPrefix = [&](size_t group) {
+    return group == 0 ? std::string() : "[" + threadGroups[group] + "] ";
+  };
+  std::unordered_map<std::string, size_t> threadGroupByName;
+  std::map<std::pair<uint32_t, uint64_t>, size_t> groupOfThread;
+  std::pair<uint32_t, uint64_t> lastThread{0, UINT64_MAX};
+  size_t lastGroup = 0;
+  const auto threadGroup = [&](const session_row_t &row) -> size_t {
+    if (!grouping) {
+      return 0;
+    }
+    const std::pair<uint32_t, uint64_t> thread{row.pid, row.threadId};
+    if (thread == lastThread) {
+      return lastGroup;
+    }
+    auto [it, inserted] = groupOfThread.try_emplace(thread, 0);
+    if (inserted) {
+      const auto meta = session.threads.find(thread);
+      const std::string name = meta == session.threads.end()
+                                   ? "thread " + std::to_string(row.threadId)
+                                   : meta->second.name;
+      auto [group, added] =
+          threadGroupByName.try_emplace(name, threadGroups.size());
+      if (added) {
+        threadGroups.push_back(name);
+        locationCaches.emplace_back();
+      }
+      it->second = group->second;
+    }
+    lastThread = thread;
+    lastGroup = it->second;
+    return lastGroup;
+  };
+  const auto locationKey = [&](const session_row_t &row) {
+    return session.multiProcess ? processLabel(row.pid) + getLocation(row)
+                                : getLocation(row);
+  };
+  const auto labelPrefix = [&](uint32_t pid) {
+    return session.multiProcess ? processLabel(pid) : std::string();
+  };
   constexpr size_t kProgressStride = 4096;
-  for (size_t i = 0; i < session.sessionData.size(); i++) {
-    const auto &row = session.sessionData[i];
+  for (size_t i = firstRow; i < rows.size(); i++) {
+    const auto &row = rows[i];
+
+    if (row.kind >= session_encoding::RecordKind::AsyncBegin &&
+        row.kind <= session_encoding::RecordKind::AsyncResume) {
+      auto &[track, span] = session.asyncSpans[{row.pid, (uint64_t)row.value}];
+      if (!track) {
+        track = &session.asyncTracks[locationKey(row)];
+        track->name = row.name;
+        track->displayLabel =
+            labelPrefix(row.pid) + std::string(row.name) + "\n" +
+            std::filesystem::path(row.path).filename().string() + ":" +
+            std::to_string(row.line) + "\n" + std::string(row.function);
+        span.id = (uint64_t)row.value;
+      }
+      span.events.push_back({row.time, row.threadId, row.kind});
+      changedAsyncTracks.insert(track);
+      continue;
+    }
+    if (session_encoding::isLock(row.kind)) {
+      // Mutexes sharing a location are told apart by their instance
+      const std::string instance = "#" + std::to_string(row.value);
+      lock_stats_t &lock = session.locks[locationKey(row) + instance];
+      if (lock.name.empty()) {
+        lock.name = row.name;
+        lock.displayLabel =
+            labelPrefix(row.pid) + std::string(row.name) + " " + instance +
+            " (" + std::filesystem::path(row.path).filename().string() + ":" +
+            std::to_string(row.line) + ")";
+      }
+      if (row.kind == session_encoding::RecordKind::LockWait) {
+        lock.acquisitions++;
+        lock.totalWait += row.duration;
+        lock.maxWait = std::max(lock.maxWait, row.duration);
+        auto &thread = lock.threads[row.threadId];
+        thread.acquisitions++;
+        thread.totalWait += row.duration;
+        thread.maxWait = std::max(thread.maxWait, row.duration);
+      } else {
+        lock.totalHold += row.duration;
+        lock.maxHold = std::max(lock.maxHold, row.duration);
+      }
+      continue;
+    }
+    if (row.kind != session_encoding::RecordKind::Scope &&
+        row.kind != session_encoding::RecordKind::Counter &&
+        row.kind != session_encoding::RecordKind::Gauge) {
+      const size_t group = threadGroup(row);
+      auto cached = locationCaches[group].find(row.locationId);
+      measurement_element_t &meas =
+          cached == locationCaches[group].end()
+              ? session.measurements[groupPrefix(group) + locationKey(row)]
+              : *cached->second;
+      if (row.kind == session_encoding::RecordKind::CpuMigration) {
+        meas.migrations.push_back({row.time, row.threadId,
+                                   (int)((uint64_t)row.value >> 32),
+                                   (int)(uint32_t)row.value});
+      } else if (uint64_t *total = scopeMetric(meas, row.kind)) {
+        *total += row.value;
+      }
+      continue;
+    }
+    if (row.kind != session_encoding::RecordKind::Scope) {
+      counter_track_t &track = session.counters[locationKey(row)];
+      if (track.samples.empty()) {
+        track.kind = row.kind;
+        track.name = row.name;
+        track.displayLabel =
+            labelPrefix(row.pid) + std::string(row.name) + "\n" +
+            std::filesystem::path(row.path).filename().string() + ":" +
+            std::to_string(row.line) + "\n" + std::string(row.function);
+      }
+      sortedSamples.try_emplace(&track, track.samples.size());
+      track.samples.push_back({row.time, (double)row.value});
+      continue;
+    }
 
     measurement_element_t *measPtr;
-    auto cached = locationCache.find(row.locationId);
-    if (cached == locationCache.end()) {
-      measurement_element_t &meas = session.measurements[getLocation(row)];
+    const size_t group = threadGroup(row);
+    auto cached = locationCaches[group].find(row.locationId);
+    if (cached == locationCaches[group].end()) {
+      measurement_element_t &meas =
+          session.measurements[groupPrefix(group) + locationKey(row)];
+      meas.pid = row.pid;
+      meas.threadName = threadGroups[group];
       meas.function = row.function;
       meas.line = row.line;
       meas.path = row.path;
       meas.file = std::filesystem::path(row.path).filename();
       meas.name = row.name;
       measPtr = &meas;
-      locationCache.emplace(row.locationId, measPtr);
+      locationCaches[group].emplace(row.locationId, measPtr);
     } else {
       measPtr = cached->second;
     }
     measurement_element_t &meas = *measPtr;
 
-    meas.timeData.push_back({row.time, row.duration, row.threadId});
+    double duration = row.duration;
+    double selfDuration = row.selfDuration;
+    if (subtract) {
+      // Each nested scope costs nested to the enclosing ones, of which own
+      // is already in its own duration
+      duration = std::max(0.0, duration - overhead.own -
+                                   row.descendants * overhead.nested);
+      selfDuration = std::max(
+          0.0, selfDuration - overhead.own -
+                   row.children * (overhead.nested - overhead.own));
+    }
+    meas.timeData.push_back(
+        {row.time, duration, row.threadId, selfDuration, row.depth});
     if (meas.startAndDuration.time == -1) {
       meas.startAndDuration.time = row.time;
     }
-    meas.meanDuration += row.duration;
-    meas.startAndDuration.duration = row.time + row.duration;
+    meas.totalDuration += duration;
+    meas.totalSelfDuration += selfDuration;
+    meas.totalSquaredDuration += duration * duration;
+    meas.startAndDuration.duration = row.time + duration;
 
-    measurementsTimes[i] = row.time;
+    session.measurementsPerSecond.push_back({row.time, row.time});
 
-    if ((i % kProgressStride) == 0 || i + 1 == session.sessionData.size()) {
-      session.progress = (double)(i + 1) / session.sessionData.size();
+    if ((i % kProgressStride) == 0 || i + 1 == rows.size()) {
+      session.progress = (double)(i + 1) / rows.size();
     }
   }
 
-  if (measurementsTimes.empty()) {
-    return;
+  for (auto &[track, sorted] : sortedSamples) {
+    mergeAppendedSamples(*track, sorted);
+  }
+
+  for (async_track_t *track : changedAsyncTracks) {
+    track->spans.clear();
+    track->maxDuration = 0.0;
+  }
+  for (auto &[id, trackAndSpan] : session.asyncSpans) {
+    auto &[track, span] = trackAndSpan;
+    if (!changedAsyncTracks.contains(track)) {
+      continue;
+    }
+    std::sort(span.events.begin(), span.events.end(), byTime);
+    span.begin = span.events.front().time;
+    span.end = span.events.back().time;
+    span.ended =
+        span.events.back().kind == session_encoding::RecordKind::AsyncEnd;
+    span.threadHops = 0;
+    for (size_t i = 1; i < span.events.size(); i++) {
+      if (span.events[i].threadId != span.events[i - 1].threadId) {
+        span.threadHops++;
+      }
+    }
+    track->maxDuration = std::max(track->maxDuration, span.end - span.begin);
+    track->spans.push_back(span);
+  }
+  for (async_track_t *track : changedAsyncTracks) {
+    std::sort(track->spans.begin(), track->spans.end(),
+              [](const auto &a, const auto &b) { return a.begin < b.begin; });
+    // Greedy lane assignment, each span goes on the first free lane
+    std::vector<double> laneEnds;
+    for (auto &span : track->spans) {
+      auto lane = std::find_if(laneEnds.begin(), laneEnds.end(),
+                               [&](double end) { return end <= span.begin; });
+      if (lane == laneEnds.end()) {
+        lane = laneEnds.insert(laneEnds.end(), span.end);
+      } else {
+        *lane = span.end;
+      }
+      span.lane = std::distance(laneEnds.begin(), lane);
+    }
+    track->lanes = laneEnds.size();
   }
 
-  std::sort(measurementsTimes.begin(), measurementsTimes.end());
-  for (size_t i = 1; i < measurementsTimes.size() - 1; i++) {
-    session.measurementsPerSecond[i].time = measurementsTimes[i];
-    session.measurementsPerSecond[i].value =
-        session.measurementsPerSecond[i - 1].value + measurementsTimes[i] -
-        measurementsTimes[i - 1];
+  for (const auto &[loc, lock] : session.locks) {
+    session.locksByWait.push_back(loc);
+  }
+  std::sort(session.locksByWait.begin(), session.locksByWait.end(),
+            [&](const auto &a, const auto &b) {
+              return session.locks[a].totalWait > session.locks[b].totalWait;
+            });
+
+  if (session.measurementsPerSecond.empty()) {
+    return;
   }
+
+  mergeAppended(session.measurementsPerSecond, sortedTimes, byTime);
+  // Allocation records whose scope record was dropped
+  std::erase_if(session.measurements,
+                [](const auto &item) { return item.second.timeData.empty(); });
   session.endTime = 0.0;
   for (auto &[loc, meas] : session.measurements) {
-    std::sort(meas.timeData.begin(), meas.timeData.end(),
-              [](const auto &a, const auto &b) { return a.time < b.time; });
-    meas.displayLabel = meas.name + "\n" + meas.file + ":" +
-                        std::to_string(meas.line) + "\n" + meas.function;
-    meas.standardDeviation = 0.0;
-    meas.meanFrequency = meas.timeData.size() / meas.startAndDuration.duration;
-    meas.meanDuration /= meas.timeData.size();
-    session.endTime = std::max(session.endTime, meas.timeData.back().time);
-
-    std::vector<double> sortedDurations;
-    sortedDurations.reserve(meas.timeData.size());
-    for (const auto &timeData : meas.timeData) {
-      sortedDurations.push_back(timeData.duration);
-    }
-    std::sort(sortedDurations.begin(), sortedDurations.end());
-    meas.minDuration = sortedDurations.front();
-    meas.maxDuration = sortedDurations.back();
-    meas.p50Duration = percentileFromSorted(sortedDurations, 50.0);
-    meas.p90Duration = percentileFromSorted(sortedDurations, 90.0);
-    meas.p99Duration = percentileFromSorted(sortedDurations, 99.0);
-    for (const auto &timeData : meas.timeData) {
-      meas.standardDeviation +=
-          std::pow(timeData.duration - meas.meanDuration, 2.0);
+    if (meas.sortedHits != meas.timeData.size()) {
+      const size_t sortedDurations = meas.sortedDurations.size();
+      for (size_t i = meas.sortedHits; i < meas.timeData.size(); i++) {
+        meas.sortedDurations.push_back(meas.timeData[i].duration);
+      }
+      mergeAppended(meas.sortedDurations, sortedDurations, std::less<>());
+      mergeAppended(meas.timeData, meas.sortedHits, byTime);
+      meas.sortedHits = meas.timeData.size();
     }
+    mergeAppended(meas.migrations, meas.sortedMigrations, byTime);
+    meas.sortedMigrations = meas.migrations.size();
+    meas.displayLabel =
+        labelPrefix(meas.pid) +
+        (meas.threadName.empty() ? "" : "[" + meas.threadName + "] ") +
+        meas.name + "\n" + meas.file + ":" + std::to_string(meas.line) +
+        "\n" + meas.function;
+    const double hits = meas.timeData.size();
+    meas.meanFrequency = hits / meas.startAndDuration.duration;
+    meas.meanDuration = meas.totalDuration / hits;
+    meas.meanSelfDuration = meas.totalSelfDuration / hits;
     meas.standardDeviation =
-        std::sqrt(meas.standardDeviation / meas.timeData.size());
-    std::cout << getLocation(meas) << " => " << meas.meanDuration << " "
-              << meas.standardDeviation << std::endl;
+        std::sqrt(std::max(0.0, meas.totalSquaredDuration / hits -
+                                    meas.meanDuration * meas.meanDuration));
+    meas.allocationsPerHit = meas.allocations / hits;
+    meas.bytesPerHit = meas.allocatedBytes / hits;
+    meas.ipc = meas.cycles ? (double)meas.instructions / meas.cycles : 0.0;
+    meas.cacheMissesPerHit = meas.cacheMisses / hits;
+    meas.branchMissesPerHit = meas.branchMisses / hits;
+    meas.contextSwitchesPerHit = meas.contextSwitches / hits;
+    meas.migrationsPerHit = meas.migrations.size() / hits;
+    session.endTime = std::max(session.endTime, meas.timeData.back().time);
+
+    meas.minDuration = meas.sortedDurations.front();
+    meas.maxDuration = meas.sortedDurations.back();
+    meas.p50Duration = percentileFromSorted(meas.sortedDurations, 50.0);
+    meas.p90Duration = percentileFromSorted(meas.sortedDurations, 90.0);
+    meas.p99Duration = percentileFromSorted(meas.sortedDurations, 99.0);
     session.keysByDuration.push_back(loc);
   }
   session.keysByAppearance = session.keysByDuration;
@@ -362,6 +822,7 @@ void Plotter::processSessionData(SessionState &session) {
 }
 
 void drawElementTooltip(const measurement_element_t &element,
+                        const thread_table_t &threads,
                         ssize_t timeInstanceId = -1, ImU32 borderColor = 0) {
   if (borderColor == 0) {
     borderColor =
@@ -385,6 +846,29 @@ void drawElementTooltip(const measurement_element_t &element,
     ImGui::Separator();
     ImGui::Text("Hits: %ld", element.timeData.size());
     ImGui::Text("Mean duration: %0.9f s", element.meanDuration);
+    ImGui::Text("Mean self time: %0.9f s", element.meanSelfDuration);
+    if (element.allocations != 0) {
+      ImGui::Text("Allocations per hit: %0.3f (%0.1f bytes)",
+                  element.allocationsPerHit, element.bytesPerHit);
+    }
+    if (element.cycles != 0) {
+      ImGui::Text("IPC: %0.3f", element.ipc);
+      ImGui::Text("LLC misses per hit: %0.3f", element.cacheMissesPerHit);
+      ImGui::Text("Branch misses per hit: %0.3f", element.branchMissesPerHit);
+    }
+    if (element.taskClock != 0) {
+      ImGui::Text("Running time per hit: %0.9f s",
+                  element.taskClock * 1e-9 / element.timeData.size());
+      ImGui::Text("Page faults per hit: %0.3f",
+                  (double)element.pageFaults / element.timeData.size());
+    }
+    if (element.contextSwitches != 0) {
+      ImGui::Text("Context switches per hit: %0.3f",
+                  element.contextSwitchesPerHit);
+    }
+    if (!element.migrations.empty()) {
+      ImGui::Text("CPU migrations per hit: %0.3f", element.migrationsPerHit);
+    }
     ImGui::Text("Mean frequency: %0.3f Hz", element.meanFrequency);
     ImGui::Text("Cumulative time: %0.9f s",
                 element.meanDuration * element.timeData.size());
@@ -400,8 +884,33 @@ void drawElementTooltip(const measurement_element_t &element,
       ImGui::Text("Time: %0.9f s", element.timeData[timeInstanceId].time);
       ImGui::Text("Duration: %0.9f s",
                   element.timeData[timeInstanceId].duration);
-      ImGui::Text("Thread: %" PRIu64,
-                  element.timeData[timeInstanceId].threadId);
+      ImGui::Text("Self time: %0.9f s",
+                  element.timeData[timeInstanceId].selfDuration);
+      ImGui::Text("Depth: %u", element.timeData[timeInstanceId].depth);
+      const auto &hit = element.timeData[timeInstanceId];
+      const auto thread = threads.find({element.pid, hit.threadId});
+      if (thread == threads.end()) {
+        ImGui::Text("Thread: %" PRIu64, hit.threadId);
+      } else {
+        ImGui::Text("Thread: %" PRIu64 " (tid %" PRId64 ", %s)", hit.threadId,
+                    thread->second.tid, thread->second.name.c_str());
+      }
+      // Migrations are recorded at the start time of their scope
+      auto migration = std::lower_bound(
+          element.migrations.begin(), element.migrations.end(), hit.time,
+          [](const auto &m, double time) { return m.time < time; });
+      for (; migration != element.migrations.end() &&
+             migration->time == hit.time;
+           ++migration) {
+        if (migration->threadId == hit.threadId) {
+          ImGui::Text("Migrated from CPU %d to CPU %d", migration->fromCpu,
+                      migration->toCpu);
+          break;
+        }
+      }
+      if (element.pid != 0) {
+        ImGui::Text("Process: %u", element.pid);
+      }
     }
     ImGui::EndTooltip();
   }
@@ -411,18 +920,65 @@ void Plotter::drawMenuBar() {
   if (!ImGui::BeginMainMenuBar()) {
     return;
   }
-  ImGui::Text("Session: %s", primary.loadedPath.c_str());
+  if (live) {
+    ImGui::Text("Live: %s (%s, %" PRIu64 " measures dropped)",
+                primary.loadedPath.c_str(),
+                live->connected() ? "connected" : "disconnected",
+                live->dropped());
+    ImGui::Separator();
+    if (ImGui::Button("Disconnect")) {
+      finishLive();
+    }
+  } else {
+    ImGui::Text("Session: %s", primary.loadedPath.c_str());
+    if (primary.droppedMeasures != 0) {
+      ImGui::Text("(%" PRIu64 " measures dropped)", primary.droppedMeasures);
+    }
+    if (!primary.availableSegments.empty()) {
+      const uint64_t last =
+          primary.lastSegment < 0
+              ? primary.availableSegments.back()
+              : std::min<uint64_t>(primary.lastSegment,
+                                   primary.availableSegments.back());
+      ImGui::Text("(segments %" PRIu64 " to %" PRIu64 " of %" PRIu64
+                  " to %" PRIu64 ")",
+                  std::max<uint64_t>(primary.firstSegment,
+                                     primary.availableSegments.front()),
+                  last, primary.availableSegments.front(),
+                  primary.availableSegments.back());
+    }
+    ImGui::Separator();
+    if (ImGui::Button("Close session")) {
+      primary.sessionCsvValid = false;
+    }
+    if (ImGui::Button("Reload")) {
+      primary.shouldStartLoading = true;
+    }
+    if (ImGui::Button("Export")) {
+      exportModalOpen = true;
+    }
+  }
   ImGui::Separator();
-  if (ImGui::Button("Close session")) {
-    primary.sessionCsvValid = false;
+  if (ImGui::Checkbox("Group by thread name", &groupByThread) && !live) {
+    // Live sessions pick it up at their next refresh
+    primary.shouldStartLoading = primary.sessionCsvValid;
+    if (comparison && comparison->sessionCsvValid) {
+      comparison->shouldStartLoading = true;
+    }
   }
-  if (ImGui::Button("Reload")) {
-    primary.shouldStartLoading = true;
+  if (ImGui::Checkbox("Subtract profiler overhead", &subtractOverhead) &&
+      !live) {
+    primary.shouldStartLoading = primary.sessionCsvValid;
+    if (comparison && comparison->sessionCsvValid) {
+      comparison->shouldStartLoading = true;
+    }
   }
-  if (ImGui::Button("Export")) {
-    exportModalOpen = true;
+  if (ImGui::BeginItemTooltip()) {
+    ImGui::Text("Calibrated when the session started: %0.1f ns per scope, "
+                "%0.1f ns per nested scope",
+                primary.overhead.own * 1e9, primary.overhead.nested * 1e9);
+    ImGui::EndTooltip();
   }
-  ImGui::Separator();
   drawSortSelector();
   ImGui::Text("Search:");
   ImGui::SetNextItemWidth(200);
@@ -449,9 +1005,19 @@ void Plotter::plotTimeEvolution() {
   std::string tooltipElement;
   ImU32 tooltipColor = 0;
 
-  float row_ratios[2] = {1.0F / 10, 9.0F / 10};
+  // Counters and async spans get their own subplots below the scope rows
+  const bool haveCounters = !primary.counters.empty();
+  const bool haveAsyncSpans = !primary.asyncTracks.empty();
+  float row_ratios[4] = {1.0F / 10, 9.0F / 10, 0.0F, 0.0F};
+  int subplots = 2;
+  for (bool extra : {haveCounters, haveAsyncSpans}) {
+    if (extra) {
+      row_ratios[1] -= 2.0F / 10;
+      row_ratios[subplots++] = 2.0F / 10;
+    }
+  }
 
-  if (ImPlot::BeginSubplots("time series", 2, 1, size,
+  if (ImPlot::BeginSubplots("time series", subplots, 1, size,
                             ImPlotSubplotFlags_LinkAllX |
                                 ImPlotSubplotFlags_NoTitle,
                             row_ratios)) {
@@ -648,11 +1214,19 @@ void Plotter::plotTimeEvolution() {
 
       ImPlot::EndPlot();
     }
+
+    if (haveCounters) {
+      plotCounters(limits);
+    }
+    if (haveAsyncSpans) {
+      plotAsyncSpans(limits);
+    }
     ImPlot::EndSubplots();
   }
 
   if (showTooltip != -1) {
-    drawElementTooltip(measurements[tooltipElement], showTooltip, tooltipColor);
+    drawElementTooltip(measurements[tooltipElement], primary.threads,
+                       showTooltip, tooltipColor);
   }
 
   static bool modalOpened = false;
@@ -706,6 +1280,153 @@ void Plotter::plotTimeEvolution() {
   }
 }
 
+void Plotter::plotCounters(const ImPlotRect &limits) {
+  if (!ImPlot::BeginPlot("##Counters")) {
+    return;
+  }
+  ImPlot::SetupAxis(ImAxis_X1, "##time", ImPlotAxisFlags_NoDecorations);
+  ImPlot::SetupAxis(ImAxis_Y1, "##value", ImPlotAxisFlags_AutoFit);
+  const size_t maxAllowedSamples{5000};
+  for (const auto &[loc, track] : primary.counters) {
+    if (!searchFilter.empty() &&
+        !containsCaseInsensitive(track.displayLabel, searchFilter)) {
+      continue;
+    }
+    const auto byTime = [](const time_value_pair_t<double> &el, double value) {
+      return el.time < value;
+    };
+    // Keep one sample before and after the visible range so that lines reach
+    // the plot borders
+    auto start = std::lower_bound(track.samples.begin(), track.samples.end(),
+                                  limits.X.Min, byTime);
+    auto end = std::lower_bound(start, track.samples.end(), limits.X.Max,
+                                byTime);
+    if (start != track.samples.begin()) {
+      start--;
+    }
+    if (end != track.samples.end()) {
+      end++;
+    }
+    size_t increment = std::distance(start, end) / maxAllowedSamples;
+    if (increment == 0) {
+      increment++;
+    }
+    std::vector<time_value_pair_t<double>> visible;
+    for (auto itr = start; itr < end; itr += increment) {
+      visible.push_back(*itr);
+    }
+    if (visible.empty()) {
+      continue;
+    }
+    ImPlot::PlotLine(track.name.c_str(), &visible[0].time, &visible[0].value,
+                     visible.size(), 0, 0, sizeof(time_value_pair_t<double>));
+  }
+  ImPlot::EndPlot();
+}
+
+void Plotter::plotAsyncSpans(const ImPlotRect &limits) {
+  if (!ImPlot::BeginPlot("##Async spans")) {
+    return;
+  }
+  ImPlot::SetupAxis(ImAxis_X1, "##time", ImPlotAxisFlags_NoDecorations);
+  ImPlot::SetupAxis(ImAxis_Y1, "##async span",
+                    ImPlotAxisFlags_NoGridLines | ImPlotAxisFlags_AutoFit);
+  const size_t maxAllowedSpans{5000};
+  const auto mousePos = ImPlot::GetPlotMousePos();
+  const async_span_t *hoveredSpan = nullptr;
+  const async_track_t *hoveredTrack = nullptr;
+
+  ImPlot::GetCurrentContext()->CurrentItems->ColormapIdx = 0;
+  ImPlot::PushPlotClipRect();
+  auto *drawList = ImPlot::GetPlotDrawList();
+  const ImU32 hopColor =
+      ImGui::ColorConvertFloat4ToU32(ImGui::GetStyle().Colors[ImGuiCol_Text]);
+  // Track names and the row of their first lane
+  std::vector<std::pair<const char *, double>> labels;
+  double rowBase = 0.0;
+  for (const auto &[loc, track] : primary.asyncTracks) {
+    if (!searchFilter.empty() &&
+        !containsCaseInsensitive(track.displayLabel, searchFilter)) {
+      continue;
+    }
+    const auto col = ImPlot::NextColormapColorU32();
+    const ImU32 suspendedCol = (col & ~IM_COL32_A_MASK) | IM_COL32(0, 0, 0, 80);
+    auto start = std::lower_bound(
+        track.spans.begin(), track.spans.end(),
+        limits.X.Min - track.maxDuration,
+        [](const async_span_t &span, double value) {
+          return span.begin < value;
+        });
+    auto end = std::upper_bound(start, track.spans.end(), limits.X.Max,
+                                [](double value, const async_span_t &span) {
+                                  return value < span.begin;
+                                });
+    size_t increment = std::distance(start, end) / maxAllowedSpans;
+    if (increment == 0) {
+      increment++;
+    }
+    for (auto itr = start; itr < end; itr += increment) {
+      const async_span_t &span = *itr;
+      if (span.end < limits.X.Min) {
+        continue;
+      }
+      const double yMin = rowBase + span.lane;
+      const double yMax = yMin + 0.9;
+      // Running segments are filled, suspended ones are drawn lighter
+      for (size_t i = 0; i + 1 < span.events.size(); i++) {
+        const bool suspended =
+            span.events[i].kind == session_encoding::RecordKind::AsyncSuspend;
+        ImVec2 rmin = ImPlot::PlotToPixels(ImPlotPoint(span.events[i].time, yMin));
+        ImVec2 rmax =
+            ImPlot::PlotToPixels(ImPlotPoint(span.events[i + 1].time, yMax));
+        drawList->AddRectFilled(rmin, rmax, suspended ? suspendedCol : col);
+      }
+      // Thread hops are marked with a vertical line
+      for (size_t i = 1; i < span.events.size(); i++) {
+        if (span.events[i].threadId == span.events[i - 1].threadId) {
+          continue;
+        }
+        ImVec2 top = ImPlot::PlotToPixels(ImPlotPoint(span.events[i].time, yMax));
+        ImVec2 bottom =
+            ImPlot::PlotToPixels(ImPlotPoint(span.events[i].time, yMin));
+        drawList->AddLine(top, bottom, hopColor, 2.0F);
+      }
+      if (mousePos.x > span.begin && mousePos.x < span.end &&
+          mousePos.y > yMin && mousePos.y < yMax) {
+        hoveredSpan = &span;
+        hoveredTrack = &track;
+      }
+    }
+    labels.emplace_back(track.name.c_str(), rowBase + 0.5);
+    rowBase += track.lanes;
+  }
+  ImPlot::PopPlotClipRect();
+  for (const auto &[label, y] : labels) {
+    float sizeX = ImGui::CalcTextSize(label).x;
+    ImPlot::PlotText(label, limits.Min().x, y, ImVec2(sizeX / 2.0F, 0));
+  }
+  ImPlot::EndPlot();
+
+  if (hoveredSpan && ImGui::BeginTooltip()) {
+    ImGui::Text("Name: %s", hoveredTrack->name.c_str());
+    ImGui::Text("Span: %" PRIu64, hoveredSpan->id);
+    ImGui::Text("Start: %0.9f s", hoveredSpan->begin);
+    ImGui::Text("Duration: %0.9f s%s", hoveredSpan->end - hoveredSpan->begin,
+                hoveredSpan->ended ? "" : " (not ended)");
+    ImGui::Text("Thread hops: %zu", hoveredSpan->threadHops);
+    ImGui::Text("Threads:");
+    uint64_t lastThread = UINT64_MAX;
+    for (const auto &event : hoveredSpan->events) {
+      if (event.threadId != lastThread) {
+        ImGui::SameLine();
+        ImGui::Text("%" PRIu64, event.threadId);
+        lastThread = event.threadId;
+      }
+    }
+    ImGui::EndTooltip();
+  }
+}
+
 void Plotter::plotBars() {
   auto &measurements = primary.measurements;
   auto &endTime = primary.endTime;
@@ -714,12 +1435,20 @@ void Plotter::plotBars() {
   ImGui::Text("Plot options:");
   ImGui::SameLine();
   ImGui::SetNextItemWidth(200);
-  const char *plotOptions[] = {"Mean", "Cumulative", "Percentage of total time",
-                               "Counts", "Frequency", "Histogram"};
+  const char *plotOptions[] = {"Mean",           "Cumulative",
+                               "Percentage of total time",
+                               "Counts",         "Frequency",
+                               "Mean self time", "Cumulative self time",
+                               "Allocations per hit", "Bytes per hit",
+                               "IPC",            "LLC misses per hit",
+                               "Branch misses per hit",
+                               "Context switches per hit",
+                               "CPU migrations per hit",
+                               "Histogram"};
   ImGui::Combo("##Plot options", &opts, plotOptions, IM_ARRAYSIZE(plotOptions));
   ImGui::Separator();
 
-  constexpr int kHistogramOption = 5;
+  constexpr int kHistogramOption = 14;
   if (opts == kHistogramOption) {
     static std::string selectedLocation;
     if (!measurements.empty() &&
@@ -807,6 +1536,24 @@ void Plotter::plotBars() {
         bar[row] = meas.timeData.size();
       } else if (opts == 4) {
         bar[row] = meas.meanFrequency;
+      } else if (opts == 5) {
+        bar[row] = meas.meanSelfDuration;
+      } else if (opts == 6) {
+        bar[row] = meas.meanSelfDuration * meas.timeData.size();
+      } else if (opts == 7) {
+        bar[row] = meas.allocationsPerHit;
+      } else if (opts == 8) {
+        bar[row] = meas.bytesPerHit;
+      } else if (opts == 9) {
+        bar[row] = meas.ipc;
+      } else if (opts == 10) {
+        bar[row] = meas.cacheMissesPerHit;
+      } else if (opts == 11) {
+        bar[row] = meas.branchMissesPerHit;
+      } else if (opts == 12) {
+        bar[row] = meas.contextSwitchesPerHit;
+      } else if (opts == 13) {
+        bar[row] = meas.migrationsPerHit;
       } else {
         bar[row] = 0;
       }
@@ -892,11 +1639,16 @@ void Plotter::drawExportModal() {
       if (exportSession && !exportFileName.empty()) {
         std::ofstream out(loadedPath + "/" + exportFileName, std::ios::out);
         if (out.is_open()) {
-          out << "time;duration;thread;path;line;function;name\n";
+          out << "time;duration;thread;path;line;function;name;depth;"
+                 "self duration;process\n";
           for (const auto &row : sessionData) {
+            if (row.kind != session_encoding::RecordKind::Scope) {
+              continue;
+            }
             out << row.time << ";" << row.duration << ";" << row.threadId
                 << ";" << row.path << ";" << row.line << ";" << row.function
-                << ";" << row.name << "\n";
+                << ";" << row.name << ";" << row.depth << ";"
+                << row.selfDuration << ";" << row.pid << "\n";
           }
           out.close();
         } else {
@@ -914,14 +1666,22 @@ void Plotter::drawExportModal() {
         if (out.is_open()) {
           out << "name;function;file;line;mean duration;standard deviation;"
                  "mean frequency;hits;min duration;p50 duration;p90 duration;"
-                 "p99 duration;max duration\n";
+                 "p99 duration;max duration;mean self duration;"
+                 "allocations per hit;bytes per hit;ipc;llc misses per hit;"
+                 "branch misses per hit;context switches per hit;"
+                 "cpu migrations per hit;thread\n";
           for (const auto &[loc, meas] : measurements) {
             out << meas.name << ";" << meas.function << ";" << meas.file << ";"
                 << meas.line << ";" << meas.meanDuration << ";"
                 << meas.standardDeviation << ";" << meas.meanFrequency << ";"
                 << meas.timeData.size() << ";" << meas.minDuration << ";"
                 << meas.p50Duration << ";" << meas.p90Duration << ";"
-                << meas.p99Duration << ";" << meas.maxDuration << "\n";
+                << meas.p99Duration << ";" << meas.maxDuration << ";"
+                << meas.meanSelfDuration << ";" << meas.allocationsPerHit
+                << ";" << meas.bytesPerHit << ";" << meas.ipc << ";"
+                << meas.cacheMissesPerHit << ";" << meas.branchMissesPerHit
+                << ";" << meas.contextSwitchesPerHit << ";"
+                << meas.migrationsPerHit << ";" << meas.threadName << "\n";
           }
           out.close();
         } else {
@@ -945,6 +1705,81 @@ void Plotter::drawExportModal() {
   }
 }
 
+void Plotter::drawContention() {
+  if (primary.locks.empty()) {
+    ImGui::Text("No ProfiledMutex was used in this session.");
+    return;
+  }
+
+  ImGui::Text("Mutexes ranked by total wait time, expand a row to see the "
+              "threads that waited on it.");
+  if (ImGui::BeginTable("contention_table", 6,
+                        ImGuiTableFlags_Borders | ImGuiTableFlags_RowBg |
+                            ImGuiTableFlags_Resizable |
+                            ImGuiTableFlags_ScrollY)) {
+    ImGui::TableSetupColumn("Mutex");
+    ImGui::TableSetupColumn("Acquisitions");
+    ImGui::TableSetupColumn("Total wait [s]");
+    ImGui::TableSetupColumn("Mean wait [s]");
+    ImGui::TableSetupColumn("Max wait [s]");
+    ImGui::TableSetupColumn("Total hold [s]");
+    ImGui::TableHeadersRow();
+
+    for (const auto &loc : primary.locksByWait) {
+      const lock_stats_t &lock = primary.locks.at(loc);
+      if (!searchFilter.empty() &&
+          !containsCaseInsensitive(lock.displayLabel, searchFilter)) {
+        continue;
+      }
+      ImGui::TableNextRow();
+      ImGui::TableNextColumn();
+      const bool open = ImGui::TreeNodeEx(
+          loc.c_str(), ImGuiTreeNodeFlags_SpanFullWidth, "%s",
+          lock.displayLabel.c_str());
+      ImGui::TableNextColumn();
+      ImGui::Text("%" PRIu64, lock.acquisitions);
+      ImGui::TableNextColumn();
+      ImGui::Text("%0.9f", lock.totalWait);
+      ImGui::TableNextColumn();
+      ImGui::Text("%0.9f", lock.acquisitions
+                               ? lock.totalWait / lock.acquisitions
+                               : 0.0);
+      ImGui::TableNextColumn();
+      ImGui::Text("%0.9f", lock.maxWait);
+      ImGui::TableNextColumn();
+      ImGui::Text("%0.9f", lock.totalHold);
+      if (!open) {
+        continue;
+      }
+
+      std::vector<std::pair<uint64_t, lock_stats_t::thread_wait_t>> threads(
+          lock.threads.begin(), lock.threads.end());
+      std::sort(threads.begin(), threads.end(),
+                [](const auto &a, const auto &b) {
+                  return a.second.totalWait > b.second.totalWait;
+                });
+      for (const auto &[threadId, thread] : threads) {
+        ImGui::TableNextRow();
+        ImGui::TableNextColumn();
+        ImGui::Indent();
+        ImGui::Text("Thread %" PRIu64, threadId);
+        ImGui::Unindent();
+        ImGui::TableNextColumn();
+        ImGui::Text("%" PRIu64, thread.acquisitions);
+        ImGui::TableNextColumn();
+        ImGui::Text("%0.9f", thread.totalWait);
+        ImGui::TableNextColumn();
+        ImGui::Text("%0.9f", thread.totalWait / thread.acquisitions);
+        ImGui::TableNextColumn();
+        ImGui::Text("%0.9f", thread.maxWait);
+        ImGui::TableNextColumn();
+      }
+      ImGui::TreePop();
+    }
+    ImGui::EndTable();
+  }
+}
+
 void Plotter::drawCompare() {
   if (comparison && comparison->shouldStartLoading) {
     startLoading(*comparison);
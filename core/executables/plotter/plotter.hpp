@@ -1,6 +1,7 @@
 #pragma once
 
 #include <atomic>
+#include <chrono>
 #include <map>
 #include <optional>
 #include <thread>
@@ -9,6 +10,7 @@
 #include "imgui.hpp"
 #include "app_utils/app.hpp"
 #include "csv.hpp"
+#include "live.hpp"
 
 extern ImFont *h1;
 extern ImFont *h2;
@@ -32,10 +34,13 @@ struct measurement_element_t {
     double time = -1;
     double duration = 0.0;
     uint64_t threadId = 0;
+    double selfDuration = 0.0;
+    uint32_t depth = 0;
   };
   time_and_duration startAndDuration;
   std::vector<time_and_duration> timeData;
   double meanDuration;
+  double meanSelfDuration = 0.0;
   double standardDeviation;
   double meanFrequency;
   double minDuration = 0.0;
@@ -43,6 +48,44 @@ struct measurement_element_t {
   double p50Duration = 0.0;
   double p90Duration = 0.0;
   double p99Duration = 0.0;
+  // Running sums of the hits, the statistics above are derived from them
+  double totalDuration = 0.0;
+  double totalSelfDuration = 0.0;
+  double totalSquaredDuration = 0.0;
+  // Durations of timeData, sorted for the percentiles
+  std::vector<double> sortedDurations;
+  // Hits and migrations already sorted in, a live session only merges the
+  // ones added since
+  size_t sortedHits = 0;
+  size_t sortedMigrations = 0;
+  // Heap allocations made directly inside the scope, only recorded when the
+  // program links profiler_alloc
+  uint64_t allocations = 0;
+  uint64_t allocatedBytes = 0;
+  double allocationsPerHit = 0.0;
+  double bytesPerHit = 0.0;
+  // Performance counter totals, only recorded when the session enabled them
+  uint64_t cycles = 0;
+  uint64_t instructions = 0;
+  uint64_t cacheMisses = 0;
+  uint64_t branchMisses = 0;
+  uint64_t contextSwitches = 0;
+  uint64_t taskClock = 0;
+  uint64_t pageFaults = 0;
+  double ipc = 0.0;
+  double cacheMissesPerHit = 0.0;
+  double branchMissesPerHit = 0.0;
+  double contextSwitchesPerHit = 0.0;
+  // Scope hits that ended on another CPU than they started on, only
+  // recorded when the session enabled SessionConfig::trackCpuMigrations
+  struct cpu_migration_t {
+    double time;
+    uint64_t threadId;
+    int fromCpu;
+    int toCpu;
+  };
+  std::vector<cpu_migration_t> migrations;
+  double migrationsPerHit = 0.0;
 
   std::string path;
   std::string file;
@@ -50,17 +93,79 @@ struct measurement_element_t {
   std::string function;
   std::string name;
   std::string displayLabel;
+  uint32_t pid = 0;
+  // Name of the threads of the hits when grouped by thread name
+  std::string threadName;
 
   size_t durationSortedIndex;
   size_t appearanceSortedIndex;
   size_t lastFrameSamples = 0;
 };
+// Samples of a MEASURE_COUNTER or MEASURE_GAUGE location. Counter samples
+// are accumulated so that both kinds hold the value over time.
+struct counter_track_t {
+  session_encoding::RecordKind kind;
+  std::string name;
+  std::string displayLabel;
+  std::vector<time_value_pair_t<double>> samples;
+};
+
+// Wait and hold times of a ProfiledMutex
+struct lock_stats_t {
+  struct thread_wait_t {
+    uint64_t acquisitions = 0;
+    double totalWait = 0.0;
+    double maxWait = 0.0;
+  };
+  std::string name;
+  std::string displayLabel;
+  uint64_t acquisitions = 0;
+  double totalWait = 0.0;
+  double maxWait = 0.0;
+  double totalHold = 0.0;
+  double maxHold = 0.0;
+  // Waits of every thread that acquired the mutex
+  std::map<uint64_t, thread_wait_t> threads;
+};
+
+// Span recorded with AsyncSpan, its events may come from different threads
+struct async_span_t {
+  struct event_t {
+    double time;
+    uint64_t threadId;
+    session_encoding::RecordKind kind;
+  };
+  uint64_t id = 0;
+  double begin = 0.0;
+  double end = 0.0;
+  // false if the end event is missing, end is then the last event
+  bool ended = false;
+  size_t lane = 0;
+  size_t threadHops = 0;
+  std::vector<event_t> events;
+};
+
+// Spans of one AsyncSpan location, overlapping spans are laid out on
+// separate lanes.
+struct async_track_t {
+  std::string name;
+  std::string displayLabel;
+  std::vector<async_span_t> spans;
+  size_t lanes = 0;
+  double maxDuration = 0.0;
+};
+
 inline std::string getLocation(const measurement_element_t &el) {
   return el.path + "(" + std::to_string(el.line) + "): " + el.function;
 }
 inline std::string getLocation(const session_row_t &el) {
   return std::string(el.path) + "(" + std::to_string(el.line) + "): " + std::string(el.function);
 }
+// Prefix of the keys and labels in sessions merging several processes, so
+// that the rows of each process are kept apart and grouped together
+inline std::string processLabel(uint32_t pid) {
+  return "[pid " + std::to_string(pid) + "] ";
+}
 
 struct SessionState {
   ~SessionState() {
@@ -75,9 +180,38 @@ struct SessionState {
 
   std::vector<session_row_t> sessionData;
   std::unordered_map<uint64_t, id_map> locationIDMap;
+  thread_table_t threads;
+  scope_overhead_t overhead;
+  // Saved in the session info, see ReadDroppedMeasures()
+  uint64_t droppedMeasures = 0;
   std::map<std::string, measurement_element_t> measurements;
+  std::map<std::string, counter_track_t> counters;
+  std::map<std::string, lock_stats_t> locks;
+  std::map<std::string, async_track_t> asyncTracks;
+  // Keys of locks, highest total wait first
+  std::vector<std::string> locksByWait;
   double endTime = 0.0;
   std::string loadedPath;
+  // Rows come from several processes, see processLabel()
+  bool multiProcess = false;
+  // Rows in the results above and the options they were processed with,
+  // processSessionData() only adds the rows after them while the options
+  // stay the same
+  size_t processedRows = 0;
+  bool processedGrouped = false;
+  bool processedSubtracted = false;
+  // Spans of the async tracks by (pid, span id), kept to add the events of
+  // the next rows
+  std::map<std::pair<uint32_t, uint64_t>,
+           std::pair<async_track_t *, async_span_t>>
+      asyncSpans;
+  // Live sessions only, see UpdateSelfDurations()
+  self_durations_t selfDurations;
+  // Segments of a rotated session to load, -1 is the last one
+  int firstSegment = 0;
+  int lastSegment = -1;
+  // Segments found in loadedPath, empty if the session is not rotated
+  std::vector<uint64_t> availableSegments;
 
   std::atomic<float> progress = 0.0f;
   std::unique_ptr<std::thread> loadingThread;
@@ -99,13 +233,19 @@ protected:
 private:
 	void startLoading(SessionState &session);
   void processSessionData(SessionState &session);
+  void connectLive(const std::string &path);
+  void updateLive();
+  void finishLive();
   bool drawPathPicker(const char *idLabel, std::string &path);
 
   void drawMenuBar();
   void plotTimeEvolution();
+  void plotCounters(const ImPlotRect &limits);
+  void plotAsyncSpans(const ImPlotRect &limits);
   void plotBars();
 	void drawExportModal();
   void drawCompare();
+  void drawContention();
 
 	void drawSortSelector();
 
@@ -114,10 +254,24 @@ private:
   SessionState primary;
   std::optional<SessionState> comparison;
 
+  // Connect to live process mode: rows accumulate in liveSession, which is
+  // processed in the background and its results swapped into primary. Each
+  // set of results is brought up to date with the rows it misses.
+  std::unique_ptr<LiveConnection> live;
+  SessionState liveSession;
+  std::atomic<bool> liveResultsReady = false;
+  std::chrono::steady_clock::time_point lastLiveUpdate;
+  std::string liveError;
+
   int previewFileLine;
   std::string previewFileName;
   std::vector<std::string> previewFileLines;
 
 	int sortBy = (int)SortBy::None;
+  // Scopes get a timeline row per thread name they ran on
+  bool groupByThread = true;
+  // Durations exclude the calibrated cost of the profiler, see
+  // scope_overhead_t
+  bool subtractOverhead = false;
 	std::string searchFilter;
 };
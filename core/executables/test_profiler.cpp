@@ -30,7 +30,7 @@ int main(void) {
   for (int i = 0; i < iterations; i++) {
     start = std::chrono::steady_clock::now();
     {
-      static LocationID locId("loop");
+      PROFILER_LOCATION(locId, "loop");
       MeasureScope scope(locId);
       t0 = std::chrono::steady_clock::now();
       for (int j = 0; j < 10000; j++) {
@@ -58,6 +58,10 @@ int main(void) {
   mean /= iterations;
   printf("Mean: %0.9f s \n", mean / 1e9);
   std::cout << "Mean: " << mean / 1e9 << std::endl;
+  printf("Calibrated at initialize: %0.1f ns recorded by each scope, "
+         "%0.1f ns added by each nested scope\n",
+         ProfilingSession::getGlobalInstace().scopeOverheadNs(),
+         ProfilingSession::getGlobalInstace().nestedScopeOverheadNs());
 
   return EXIT_SUCCESS;
 }
@@ -0,0 +1,106 @@
+// Replacements of the global allocation functions, built as the profiler_alloc
+// library. Linking it attributes every operator new to the innermost active
+// MeasureScope of the calling thread. Deallocations are not tracked.
+#include "profiler.hpp"
+
+#include <cstdlib>
+#include <new>
+
+static void *alignedMalloc(size_t size, size_t alignment) noexcept {
+#if defined(_WIN32)
+  return _aligned_malloc(size, alignment);
+#else
+  // aligned_alloc requires the size to be a multiple of the alignment
+  return aligned_alloc(alignment, (size + alignment - 1) & ~(alignment - 1));
+#endif
+}
+
+static void alignedFree(void *ptr) noexcept {
+#if defined(_WIN32)
+  _aligned_free(ptr);
+#else
+  free(ptr);
+#endif
+}
+
+static void *allocate(size_t size, size_t alignment) {
+  if (size == 0) {
+    size = 1;
+  }
+  while (true) {
+    void *ptr = alignment <= __STDCPP_DEFAULT_NEW_ALIGNMENT__
+                    ? malloc(size)
+                    : alignedMalloc(size, alignment);
+    if (ptr) [[likely]] {
+      MeasureScope::countAllocation(size);
+      return ptr;
+    }
+    std::new_handler handler = std::get_new_handler();
+    if (!handler) {
+      throw std::bad_alloc();
+    }
+    handler();
+  }
+}
+
+static void *allocateNoThrow(size_t size, size_t alignment) noexcept {
+  try {
+    return allocate(size, alignment);
+  } catch (...) {
+    return nullptr;
+  }
+}
+
+static constexpr size_t kDefaultAlignment = __STDCPP_DEFAULT_NEW_ALIGNMENT__;
+
+void *operator new(size_t size) { return allocate(size, kDefaultAlignment); }
+void *operator new[](size_t size) { return allocate(size, kDefaultAlignment); }
+void *operator new(size_t size, const std::nothrow_t &) noexcept {
+  return allocateNoThrow(size, kDefaultAlignment);
+}
+void *operator new[](size_t size, const std::nothrow_t &) noexcept {
+  return allocateNoThrow(size, kDefaultAlignment);
+}
+void *operator new(size_t size, std::align_val_t alignment) {
+  return allocate(size, (size_t)alignment);
+}
+void *operator new[](size_t size, std::align_val_t alignment) {
+  return allocate(size, (size_t)alignment);
+}
+void *operator new(size_t size, std::align_val_t alignment,
+                   const std::nothrow_t &) noexcept {
+  return allocateNoThrow(size, (size_t)alignment);
+}
+void *operator new[](size_t size, std::align_val_t alignment,
+                     const std::nothrow_t &) noexcept {
+  return allocateNoThrow(size, (size_t)alignment);
+}
+
+void operator delete(void *ptr) noexcept { free(ptr); }
+void operator delete[](void *ptr) noexcept { free(ptr); }
+void operator delete(void *ptr, size_t) noexcept { free(ptr); }
+void operator delete[](void *ptr, size_t) noexcept { free(ptr); }
+void operator delete(void *ptr, const std::nothrow_t &) noexcept { free(ptr); }
+void operator delete[](void *ptr, const std::nothrow_t &) noexcept {
+  free(ptr);
+}
+void operator delete(void *ptr, std::align_val_t) noexcept {
+  alignedFree(ptr);
+}
+void operator delete[](void *ptr, std::align_val_t) noexcept {
+  alignedFree(ptr);
+}
+void operator delete(void *ptr, size_t, std::align_val_t) noexcept {
+  alignedFree(ptr);
+}
+void operator delete[](void *ptr, size_t, std::align_val_t) noexcept {
+  alignedFree(ptr);
+}
+void operator delete(void *ptr, std::align_val_t,
+                     const std::nothrow_t &) noexcept {
+  alignedFree(ptr);
+}
+void operator delete[](void *ptr, std::align_val_t,
+                       const std::nothrow_t &) noexcept {
+  alignedFree(ptr);
+}
@@ -0,0 +1,61 @@
+#include "async_span.hpp"
+
+// Span ids are handed out to threads in blocks, so that beginning a span
+// doesn't touch a shared cache line every time.
+static constexpr uint64_t kSpanIdBlock = 1024;
+
+static std::atomic<uint64_t> nextSpanIdBlock{1};
+
+struct span_ids_t {
+  uint64_t next = 0;
+  uint64_t limit = 0;
+};
+static thread_local span_ids_t tlsSpanIds;
+
+static uint64_t allocateSpanId() noexcept {
+  if (tlsSpanIds.next == tlsSpanIds.limit) [[unlikely]] {
+    tlsSpanIds.next =
+        nextSpanIdBlock.fetch_add(kSpanIdBlock, std::memory_order_relaxed);
+    tlsSpanIds.limit = tlsSpanIds.next + kSpanIdBlock;
+  }
+  return tlsSpanIds.next++;
+}
+
+async_token_t AsyncSpan::begin(const LocationID &loc) noexcept {
+  if (!ProfilingSession::isRecorded(loc)) {
+    return {};
+  }
+  auto &sessionInst = ProfilingSession::getGlobalInstace();
+  const async_token_t token{.id = allocateSpanId(),
+                            .location = loc.locationID()};
+  sessionInst.addSample(session_encoding::RecordKind::AsyncBegin,
+                        token.location, (int64_t)token.id);
+  return token;
+}
+
+void AsyncSpan::end(const async_token_t &token) noexcept {
+  if (token.id == 0) {
+    return;
+  }
+  ProfilingSession::getGlobalInstace().addSample(
+      session_encoding::RecordKind::AsyncEnd, token.location,
+      (int64_t)token.id);
+}
+
+void AsyncSpan::suspend(const async_token_t &token) noexcept {
+  if (token.id == 0) {
+    return;
+  }
+  ProfilingSession::getGlobalInstace().addSample(
+      session_encoding::RecordKind::AsyncSuspend, token.location,
+      (int64_t)token.id);
+}
+
+void AsyncSpan::resume(const async_token_t &token) noexcept {
+  if (token.id == 0) {
+    return;
+  }
+  ProfilingSession::getGlobalInstace().addSample(
+      session_encoding::RecordKind::AsyncResume, token.location,
+      (int64_t)token.id);
+}
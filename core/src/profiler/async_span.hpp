@@ -0,0 +1,103 @@
+#pragma once
+
+#include <coroutine>
+#include <utility>
+
+#include "profiler.hpp"
+
+// Handle of a span started with AsyncSpan::begin, id 0 if the span is not
+// being recorded.
+struct async_token_t {
+  uint64_t id = 0;
+  uint32_t location = 0;
+};
+
+// Spans that are not bound to a thread, e.g. a request moving between I/O
+// threads and a worker pool. Every call records an event tagged with the
+// calling thread, so the plotter can show where the span hopped.
+class AsyncSpan {
+public:
+  static async_token_t begin(const LocationID &loc) noexcept;
+  // May be called from any thread, once per token
+  static void end(const async_token_t &token) noexcept;
+
+  // The span stops running on the calling thread, until resume() is called
+  // by the thread that picks it up again.
+  static void suspend(const async_token_t &token) noexcept;
+  static void resume(const async_token_t &token) noexcept;
+};
+
+// Ends the span when destroyed, on whatever thread that happens. Meant to be
+// placed in coroutine frames.
+class AsyncSpanGuard {
+public:
+  explicit AsyncSpanGuard(const LocationID &loc) noexcept
+      : spanToken(AsyncSpan::begin(loc)) {}
+  AsyncSpanGuard(const AsyncSpanGuard &) = delete;
+  AsyncSpanGuard &operator=(const AsyncSpanGuard &) = delete;
+  ~AsyncSpanGuard() noexcept { AsyncSpan::end(spanToken); }
+
+  const async_token_t &token() const noexcept { return spanToken; }
+
+private:
+  async_token_t spanToken;
+};
+
+// Wraps an awaiter so that the span is suspended when the coroutine suspends
+// and resumed by the thread that resumes it.
+template <typename Awaiter> class AsyncSpanAwaiter {
+public:
+  AsyncSpanAwaiter(const async_token_t &_token, Awaiter &&awaiter)
+      : token(_token), inner(std::forward<Awaiter>(awaiter)) {}
+
+  bool await_ready() { return inner.await_ready(); }
+
+  template <typename Promise>
+  decltype(auto) await_suspend(std::coroutine_handle<Promise> handle) {
+    // Recorded before handing the coroutine over, another thread may resume
+    // it before await_suspend returns
+    AsyncSpan::suspend(token);
+    suspended = true;
+    return inner.await_suspend(handle);
+  }
+
+  decltype(auto) await_resume() {
+    if (suspended) {
+      AsyncSpan::resume(token);
+    }
+    return inner.await_resume();
+  }
+
+private:
+  async_token_t token;
+  Awaiter inner;
+  bool suspended = false;
+};
+
+namespace async_span_detail {
+
+template <typename Awaitable> decltype(auto) getAwaiter(Awaitable &&awaitable) {
+  if constexpr (requires {
+                  std::forward<Awaitable>(awaitable).operator co_await();
+                }) {
+    return std::forward<Awaitable>(awaitable).operator co_await();
+  } else if constexpr (requires {
+                         operator co_await(std::forward<Awaitable>(awaitable));
+                       }) {
+    return operator co_await(std::forward<Awaitable>(awaitable));
+  } else {
+    return std::forward<Awaitable>(awaitable);
+  }
+}
+
+} // namespace async_span_detail
+
+// co_await traceAwait(span.token(), pool.schedule());
+template <typename Awaitable>
+auto traceAwait(const async_token_t &token, Awaitable &&awaitable) {
+  using Awaiter = decltype(async_span_detail::getAwaiter(
+      std::forward<Awaitable>(awaitable)));
+  return AsyncSpanAwaiter<Awaiter>(
+      token,
+      async_span_detail::getAwaiter(std::forward<Awaitable>(awaitable)));
+}
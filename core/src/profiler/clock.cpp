@@ -0,0 +1,61 @@
+#include "clock.hpp"
+
+#include <thread>
+
+#if defined(__x86_64__) || defined(__i386__)
+#include <cpuid.h>
+#endif
+
+static constexpr auto kCalibrationPeriod = std::chrono::milliseconds(20);
+
+namespace profiler_clock {
+
+bool isSupported(ClockSource source) noexcept {
+  if (source == ClockSource::SteadyClock) {
+    return true;
+  }
+#if defined(__x86_64__) || defined(__i386__)
+  // CPUID.80000007H:EDX[8] reports an invariant TSC
+  unsigned int eax, ebx, ecx, edx;
+  if (!__get_cpuid(0x80000007, &eax, &ebx, &ecx, &edx)) {
+    return false;
+  }
+  return (edx & (1u << 8)) != 0;
+#elif defined(__aarch64__)
+  // The generic timer is architecturally guaranteed to be constant rate
+  return true;
+#else
+  return false;
+#endif
+}
+
+double calibrateTicksPerNs(ClockSource source) noexcept {
+  if (source == ClockSource::SteadyClock) {
+    return 1.0;
+  }
+#if defined(__aarch64__)
+  uint64_t frequency;
+  asm volatile("mrs %0, cntfrq_el0" : "=r"(frequency));
+  return frequency / 1e9;
+#else
+  const int64_t steadyStart = steadyTicks();
+  const int64_t ticksStart = now(source);
+  std::this_thread::sleep_for(kCalibrationPeriod);
+  const int64_t steadyEnd = steadyTicks();
+  const int64_t ticksEnd = now(source);
+  return (double)(ticksEnd - ticksStart) / (steadyEnd - steadyStart);
+#endif
+}
+
+const char *name(ClockSource source) noexcept {
+  switch (source) {
+  case ClockSource::Tsc:
+    return "tsc";
+  case ClockSource::TscOrdered:
+    return "tsc_ordered";
+  default:
+    return "steady_clock";
+  }
+}
+
+} // namespace profiler_clock
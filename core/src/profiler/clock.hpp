@@ -0,0 +1,77 @@
+#pragma once
+
+#include <chrono>
+#include <cstdint>
+
+#if defined(__x86_64__) || defined(__i386__)
+#include <x86intrin.h>
+#endif
+
+// Clock backends usable by MeasureScope. Timestamps are stored as raw ticks
+// of the selected clock, the session records the tick rate so that readers
+// can convert them back to nanoseconds.
+enum class ClockSource : uint8_t {
+  // std::chrono::steady_clock, one tick per nanosecond.
+  SteadyClock = 0,
+  // rdtsc on x86, cntvct_el0 on ARM64. Requires an invariant counter, falls
+  // back to SteadyClock otherwise.
+  Tsc = 1,
+  // Same counter as Tsc but ordered with respect to preceding instructions
+  // (rdtscp on x86, isb + cntvct_el0 on ARM64).
+  TscOrdered = 2,
+};
+
+namespace profiler_clock {
+
+inline int64_t steadyTicks() noexcept {
+  return std::chrono::duration_cast<std::chrono::nanoseconds>(
+             std::chrono::steady_clock::now().time_since_epoch())
+      .count();
+}
+
+inline int64_t tscTicks() noexcept {
+#if defined(__x86_64__) || defined(__i386__)
+  return (int64_t)__rdtsc();
+#elif defined(__aarch64__)
+  uint64_t ticks;
+  asm volatile("mrs %0, cntvct_el0" : "=r"(ticks));
+  return (int64_t)ticks;
+#else
+  return steadyTicks();
+#endif
+}
+
+inline int64_t tscOrderedTicks() noexcept {
+#if defined(__x86_64__) || defined(__i386__)
+  unsigned int aux;
+  return (int64_t)__rdtscp(&aux);
+#elif defined(__aarch64__)
+  uint64_t ticks;
+  asm volatile("isb; mrs %0, cntvct_el0" : "=r"(ticks)::"memory");
+  return (int64_t)ticks;
+#else
+  return steadyTicks();
+#endif
+}
+
+inline int64_t now(ClockSource source) noexcept {
+  switch (source) {
+  case ClockSource::Tsc:
+    return tscTicks();
+  case ClockSource::TscOrdered:
+    return tscOrderedTicks();
+  default:
+    return steadyTicks();
+  }
+}
+
+// Returns false if the requested source can not be used reliably on this
+// machine (missing or non invariant counter).
+bool isSupported(ClockSource source) noexcept;
+
+// Measures the tick rate of source against steady_clock.
+double calibrateTicksPerNs(ClockSource source) noexcept;
+
+const char *name(ClockSource source) noexcept;
+
+} // namespace profiler_clock
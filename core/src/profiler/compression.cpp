@@ -0,0 +1,271 @@
+#include "compression.hpp"
+
+#include <algorithm>
+#include <cstring>
+
+#if defined(PROFILER_HAVE_ZSTD)
+#include <memory>
+#include <zstd.h>
+#endif
+
+namespace block_compression {
+
+// Lz codec: greedy LZ77 with a single hash table probe per position, written
+// in the LZ4 block format. A sequence is
+//   token | literal length bytes | literals | offset (uint16 LE) | match
+//   length bytes
+// where the token holds the literal length and the match length minus
+// kMinMatch in its high and low nibbles, 15 meaning that length bytes follow
+// (added up until one is not 255). The last sequence only holds literals.
+namespace lz {
+
+static constexpr size_t kMinMatch = 4;
+// The last bytes are always literals, and the last match starts before
+// kMatchFindLimit bytes from the end
+static constexpr size_t kLastLiterals = 5;
+static constexpr size_t kMatchFindLimit = 12;
+static constexpr size_t kMaxOffset = 65535;
+static constexpr unsigned kHashBits = 13;
+// Positions searched without finding a match before the step grows, so that
+// incompressible data is skipped quickly
+static constexpr unsigned kSkipTrigger = 6;
+
+static size_t compressBound(size_t size) noexcept {
+  return size + size / 255 + 16;
+}
+
+static uint32_t read32(const uint8_t *p) noexcept {
+  uint32_t value;
+  memcpy(&value, p, sizeof(value));
+  return value;
+}
+
+static uint32_t hash(uint32_t value) noexcept {
+  return (value * 2654435761u) >> (32 - kHashBits);
+}
+
+static uint8_t *putLength(uint8_t *out, size_t length) noexcept {
+  for (; length >= 255; length -= 255) {
+    *out++ = 255;
+  }
+  *out++ = (uint8_t)length;
+  return out;
+}
+
+// matchLength 0 writes the last sequence
+static uint8_t *putSequence(uint8_t *out, const uint8_t *literals,
+                            size_t literalCount, size_t offset,
+                            size_t matchLength) noexcept {
+  uint8_t *const token = out++;
+  *token = (uint8_t)(std::min<size_t>(literalCount, 15) << 4);
+  if (literalCount >= 15) {
+    out = putLength(out, literalCount - 15);
+  }
+  memcpy(out, literals, literalCount);
+  out += literalCount;
+  if (matchLength == 0) {
+    return out;
+  }
+  *out++ = (uint8_t)offset;
+  *out++ = (uint8_t)(offset >> 8);
+  const size_t length = matchLength - kMinMatch;
+  *token |= (uint8_t)std::min<size_t>(length, 15);
+  if (length >= 15) {
+    out = putLength(out, length - 15);
+  }
+  return out;
+}
+
+static size_t compress(const uint8_t *in, size_t size, uint8_t *out) noexcept {
+  uint8_t *const outBegin = out;
+  const uint8_t *anchor = in;
+  if (size > kMatchFindLimit) {
+    uint32_t table[1 << kHashBits] = {};
+    const uint8_t *const searchEnd = in + size - kMatchFindLimit;
+    const uint8_t *const matchEnd = in + size - kLastLiterals;
+    const uint8_t *ip = in;
+    unsigned misses = 0;
+    while (ip < searchEnd) {
+      const uint32_t value = read32(ip);
+      uint32_t &entry = table[hash(value)];
+      const uint8_t *match = in + entry;
+      entry = (uint32_t)(ip - in);
+      if (match >= ip || (size_t)(ip - match) > kMaxOffset ||
+          read32(match) != value) {
+        ip += 1 + (misses++ >> kSkipTrigger);
+        continue;
+      }
+      misses = 0;
+      while (ip > anchor && match > in && ip[-1] == match[-1]) {
+        ip--;
+        match--;
+      }
+      const uint8_t *end = ip + kMinMatch;
+      for (const uint8_t *ref = match + kMinMatch;
+           end < matchEnd && *end == *ref; ref++) {
+        end++;
+      }
+      out = putSequence(out, anchor, ip - anchor, ip - match, end - ip);
+      ip = anchor = end;
+    }
+  }
+  out = putSequence(out, anchor, in + size - anchor, 0, 0);
+  return out - outBegin;
+}
+
+static bool decompress(const uint8_t *in, size_t size, uint8_t *out,
+                       size_t rawSize) noexcept {
+  const uint8_t *const inEnd = in + size;
+  uint8_t *const outBegin = out;
+  uint8_t *const outEnd = out + rawSize;
+  const auto getLength = [&](size_t &length) {
+    if (length != 15) {
+      return true;
+    }
+    uint8_t byte;
+    do {
+      if (in == inEnd) {
+        return false;
+      }
+      byte = *in++;
+      length += byte;
+    } while (byte == 255);
+    return true;
+  };
+  while (in < inEnd) {
+    const uint8_t token = *in++;
+    size_t literals = token >> 4;
+    if (!getLength(literals) || literals > (size_t)(inEnd - in) ||
+        literals > (size_t)(outEnd - out)) {
+      return false;
+    }
+    memcpy(out, in, literals);
+    in += literals;
+    out += literals;
+    if (in == inEnd) {
+      break;
+    }
+    if (inEnd - in < 2) {
+      return false;
+    }
+    const size_t offset = in[0] | (size_t)in[1] << 8;
+    in += 2;
+    size_t length = token & 15;
+    if (!getLength(length)) {
+      return false;
+    }
+    length += kMinMatch;
+    if (offset == 0 || offset > (size_t)(out - outBegin) ||
+        length > (size_t)(outEnd - out)) {
+      return false;
+    }
+    const uint8_t *ref = out - offset;
+    if (offset >= length) {
+      memcpy(out, ref, length);
+    } else {
+      // Overlapping match, repeats the last offset bytes
+      for (size_t i = 0; i < length; i++) {
+        out[i] = ref[i];
+      }
+    }
+    out += length;
+  }
+  return out == outEnd;
+}
+
+} // namespace lz
+
+#if defined(PROFILER_HAVE_ZSTD)
+namespace zstd {
+
+static constexpr int kLevel = 1;
+
+struct ContextDeleter {
+  void operator()(ZSTD_CCtx *context) const { ZSTD_freeCCtx(context); }
+  void operator()(ZSTD_DCtx *context) const { ZSTD_freeDCtx(context); }
+};
+
+static size_t compress(const uint8_t *in, size_t size, uint8_t *out) noexcept {
+  static thread_local std::unique_ptr<ZSTD_CCtx, ContextDeleter> context(
+      ZSTD_createCCtx());
+  if (!context) {
+    return 0;
+  }
+  const size_t res = ZSTD_compressCCtx(context.get(), out,
+                                       ZSTD_compressBound(size), in, size,
+                                       kLevel);
+  return ZSTD_isError(res) ? 0 : res;
+}
+
+static bool decompress(const uint8_t *in, size_t size, uint8_t *out,
+                       size_t rawSize) noexcept {
+  static thread_local std::unique_ptr<ZSTD_DCtx, ContextDeleter> context(
+      ZSTD_createDCtx());
+  return context &&
+         ZSTD_decompressDCtx(context.get(), out, rawSize, in, size) == rawSize;
+}
+
+} // namespace zstd
+#endif
+
+bool isAvailable(BlockCodec codec) noexcept {
+  switch (codec) {
+  case BlockCodec::None:
+  case BlockCodec::Lz:
+    return true;
+  case BlockCodec::Zstd:
+#if defined(PROFILER_HAVE_ZSTD)
+    return true;
+#else
+    return false;
+#endif
+  }
+  return false;
+}
+
+size_t compressBound(BlockCodec codec, size_t size) noexcept {
+#if defined(PROFILER_HAVE_ZSTD)
+  if (codec == BlockCodec::Zstd) {
+    return ZSTD_compressBound(size);
+  }
+#endif
+  (void)codec;
+  return lz::compressBound(size);
+}
+
+size_t compress(BlockCodec codec, const uint8_t *in, size_t size,
+                uint8_t *out) noexcept {
+  size_t compressed = 0;
+  if (codec == BlockCodec::Lz) {
+    compressed = lz::compress(in, size, out);
+  }
+#if defined(PROFILER_HAVE_ZSTD)
+  if (codec == BlockCodec::Zstd) {
+    compressed = zstd::compress(in, size, out);
+  }
+#endif
+  return compressed < size ? compressed : 0;
+}
+
+bool decompress(BlockCodec codec, const uint8_t *in, size_t size,
+                uint8_t *out, size_t rawSize) noexcept {
+  switch (codec) {
+  case BlockCodec::None:
+    if (size != rawSize) {
+      return false;
+    }
+    memcpy(out, in, size);
+    return true;
+  case BlockCodec::Lz:
+    return lz::decompress(in, size, out, rawSize);
+  case BlockCodec::Zstd:
+#if defined(PROFILER_HAVE_ZSTD)
+    return zstd::decompress(in, size, out, rawSize);
+#else
+    return false;
+#endif
+  }
+  return false;
+}
+
+} // namespace block_compression
@@ -0,0 +1,32 @@
+#pragma once
+
+#include "encoding.hpp"
+
+#include <cstddef>
+#include <cstdint>
+
+// Compression of the session blocks, see block_header_t. The Lz codec is
+// built in, Zstd is only available when the profiler is built with zstd
+// (PROFILER_HAVE_ZSTD).
+namespace block_compression {
+
+using session_encoding::BlockCodec;
+
+bool isAvailable(BlockCodec codec) noexcept;
+
+// Bytes compress() may write for size bytes of input
+size_t compressBound(BlockCodec codec, size_t size) noexcept;
+
+// Compresses size bytes of in to out, which must hold compressBound() bytes.
+// Returns the compressed size, or 0 if the codec is not available or the
+// data doesn't shrink (the block is then written as it is). Only used by the
+// session writer thread.
+size_t compress(BlockCodec codec, const uint8_t *in, size_t size,
+                uint8_t *out) noexcept;
+
+// Returns false unless in is a valid compressed block of exactly rawSize
+// bytes. Thread safe.
+bool decompress(BlockCodec codec, const uint8_t *in, size_t size,
+                uint8_t *out, size_t rawSize) noexcept;
+
+} // namespace block_compression
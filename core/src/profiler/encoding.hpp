@@ -0,0 +1,340 @@
+#pragma once
+
+#include <cstddef>
+#include <cstdint>
+#include <cstring>
+
+// Session file layout:
+//   preamble | header | blocks... | sections... | index | trailer
+// The preamble is the magic (4 bytes) followed by the format version (uint32,
+// little endian), and the session header is
+//   varint size | size bytes of fields (see session_header_t)
+// Every block holds the measures drained from one thread ring, its header is
+//   varint (threadId << 1) | compressed | zigzag baseTime | varint count |
+//   varint payloadSize
+// continued for compressed blocks by
+//   varint BlockCodec | varint rawSize
+// and followed by payloadSize bytes of records, decompressing to rawSize
+// bytes if compressed. Every block is compressed on its own, so blocks can
+// be decoded in any order. Every record starts with
+//   zigzag (time - previous time) | varint tag
+// where the previous time of the first record is baseTime and tag is
+// (location << 1) | extended. Scope records (extended = 0) continue with
+//   zigzag duration | varint depth | varint (parent location + 1, 0 if none)
+// while extended records continue with
+//   varint RecordKind | zigzag value
+// and lock records (see isLock) then with
+//   varint instance
+//
+// The blocks of thread kDefinitionsThreadId define locations instead of
+// holding records, every file defines a location before the first block
+// that uses it. Their count is the number of definitions, each being
+//   varint location | varint line | 3 * (varint size | size bytes)
+// with the file, function and name of the location.
+//
+// A closed session file ends with sections describing its blocks. The index
+// is
+//   varint count | count * (varint SectionKind | varint offset | varint size)
+// with offsets from the start of the file, and the trailer is the offset of
+// the index (uint64, little endian) followed by SESSION_TRAILER_MAGIC. Files
+// without a trailer (being written, or left by a crash) hold blocks up to
+// their end.
+//
+// Files without a preamble (format version 0) are legacy sessions, a flat
+// array of the plotter's session_row_binary_t.
+#define SESSION_MAGIC "PRFB"
+#define SESSION_TRAILER_MAGIC "PRFE"
+
+namespace session_encoding {
+
+static constexpr uint32_t kFormatVersion = 1;
+static constexpr size_t kMagicSize = 4;
+static constexpr size_t kPreambleSize = kMagicSize + sizeof(uint32_t);
+static constexpr size_t kMaxVarintSize = 10;
+static constexpr size_t kMaxBlockHeaderSize = 6 * kMaxVarintSize;
+static constexpr size_t kMaxRecordSize = 5 * kMaxVarintSize;
+static constexpr size_t kTrailerSize = sizeof(uint64_t) + kMagicSize;
+
+enum class RecordKind : uint8_t {
+  Scope = 0,
+  // Increment of a counter, readers accumulate the samples
+  Counter = 1,
+  // Absolute value of a gauge
+  Gauge = 2,
+  // Heap allocations made directly inside a scope (see profiler_alloc),
+  // written right after the scope record with its location and start time
+  Allocations = 3,
+  AllocatedBytes = 4,
+  // Performance counter deltas of a scope (see PerfCounterMode), written
+  // like the allocations
+  Cycles = 5,
+  Instructions = 6,
+  CacheMisses = 7,
+  BranchMisses = 8,
+  // See SessionConfig::trackContextSwitches
+  ContextSwitches = 9,
+  // Nanoseconds the thread was running
+  TaskClock = 10,
+  PageFaults = 11,
+  // Time spent waiting for and holding a ProfiledMutex, the location is the
+  // one of the mutex and the value the duration. The instance field tells
+  // apart the mutexes sharing the location. The hold record of an acquisition
+  // starts when the wait record of the same thread ends.
+  LockWait = 12,
+  LockHold = 13,
+  // Events of an AsyncSpan, the value is the span id. Each event is written
+  // by the thread that emits it, so a span may appear in blocks of different
+  // threads.
+  AsyncBegin = 14,
+  AsyncEnd = 15,
+  AsyncSuspend = 16,
+  AsyncResume = 17,
+  // Scope that ended on another CPU than the one it started on (see
+  // SessionConfig::trackCpuMigrations), written like the allocations with
+  // the value (start CPU << 32) | end CPU
+  CpuMigration = 18,
+};
+
+// Number of RecordKind values, readers skip the records of kinds they don't
+// know
+static constexpr uint64_t kRecordKinds = (uint64_t)RecordKind::CpuMigration + 1;
+
+// Kinds whose value is a duration in clock ticks
+inline bool isInterval(RecordKind kind) noexcept {
+  return kind == RecordKind::Scope || kind == RecordKind::LockWait ||
+         kind == RecordKind::LockHold;
+}
+
+inline bool isLock(RecordKind kind) noexcept {
+  return kind == RecordKind::LockWait || kind == RecordKind::LockHold;
+}
+
+// Thread ids are allocated from 0, this one is never reached
+static constexpr uint64_t kDefinitionsThreadId = UINT32_MAX;
+
+// Codec of a compressed block, see compression.hpp
+enum class BlockCodec : uint8_t {
+  None = 0,
+  // LZ4 block format, built in
+  Lz = 1,
+  // zstd frame, only when the profiler is built with zstd
+  Zstd = 2,
+};
+
+struct block_header_t {
+  uint64_t threadId;
+  int64_t baseTime;
+  uint64_t count;
+  uint64_t payloadSize;
+  BlockCodec codec = BlockCodec::None;
+  // Size of the records once decompressed
+  uint64_t rawSize = 0;
+};
+
+enum class ByteOrder : uint8_t {
+  LittleEndian = 1,
+  BigEndian = 2,
+};
+
+// Fields of the session header, in this order:
+//   uint8 ByteOrder | varint clock | ticksPerNs (IEEE double, little endian)
+//   | zigzag startWallNs | varint recordKinds
+// Readers ignore the bytes following the fields they know.
+struct session_header_t {
+  // Of the machine that recorded the session. The encoding doesn't depend on
+  // it, readers only use it to validate the header.
+  ByteOrder byteOrder;
+  // ClockSource of the record times
+  uint8_t clock;
+  double ticksPerNs;
+  // Wall clock time of record time 0, in nanoseconds since the Unix epoch
+  int64_t startWallNs;
+  // kRecordKinds of the writer
+  uint64_t recordKinds;
+};
+static constexpr size_t kMaxSessionHeaderSize = 1 + 1 + 3 * kMaxVarintSize + 8;
+
+// Sections of a closed session file
+enum class SectionKind : uint8_t {
+  // Every block of the file
+  Blocks = 0,
+  // varint count | count * (varint size | size bytes), the strings of the
+  // other sections are indices in this table
+  Strings = 1,
+  // varint count | count * (varint id | varint line | varint file
+  //   | varint function | varint name)
+  Locations = 2,
+  // varint count | count * (varint threadId | zigzag tid | varint name), a
+  // thread may appear several times, the last one wins
+  Threads = 3,
+  // Content of the session info file
+  Info = 4,
+};
+
+struct section_t {
+  SectionKind kind;
+  uint64_t offset;
+  uint64_t size;
+};
+
+inline uint64_t zigzag(int64_t value) noexcept {
+  return ((uint64_t)value << 1) ^ (uint64_t)(value >> 63);
+}
+inline int64_t unzigzag(uint64_t value) noexcept {
+  return (int64_t)(value >> 1) ^ -(int64_t)(value & 1);
+}
+
+inline uint8_t *putVarint(uint8_t *out, uint64_t value) noexcept {
+  while (value >= 0x80) {
+    *out++ = (uint8_t)(value | 0x80);
+    value >>= 7;
+  }
+  *out++ = (uint8_t)value;
+  return out;
+}
+
+// Returns false if the varint is truncated or malformed.
+inline bool getVarint(const uint8_t *&in, const uint8_t *end,
+                      uint64_t &value) noexcept {
+  value = 0;
+  for (unsigned shift = 0; shift < 64 && in < end; shift += 7) {
+    const uint8_t byte = *in++;
+    value |= (uint64_t)(byte & 0x7f) << shift;
+    if (!(byte & 0x80)) {
+      return true;
+    }
+  }
+  return false;
+}
+
+inline uint8_t *putPreamble(uint8_t *out) noexcept {
+  memcpy(out, SESSION_MAGIC, kMagicSize);
+  const uint32_t version = kFormatVersion;
+  for (size_t i = 0; i < sizeof(version); i++) {
+    out[kMagicSize + i] = (uint8_t)(version >> (8 * i));
+  }
+  return out + kPreambleSize;
+}
+
+// Returns the format version, or 0 if data does not start with a preamble.
+inline uint32_t getPreamble(const uint8_t *data, size_t size) noexcept {
+  if (size < kPreambleSize || memcmp(data, SESSION_MAGIC, kMagicSize) != 0) {
+    return 0;
+  }
+  uint32_t version = 0;
+  for (size_t i = 0; i < sizeof(version); i++) {
+    version |= (uint32_t)data[kMagicSize + i] << (8 * i);
+  }
+  return version;
+}
+
+inline uint8_t *putSessionHeader(uint8_t *out,
+                                 const session_header_t &header) noexcept {
+  uint8_t fields[kMaxSessionHeaderSize];
+  uint8_t *field = fields;
+  *field++ = (uint8_t)header.byteOrder;
+  field = putVarint(field, header.clock);
+  uint64_t ticksPerNs;
+  memcpy(&ticksPerNs, &header.ticksPerNs, sizeof(ticksPerNs));
+  for (size_t i = 0; i < sizeof(ticksPerNs); i++) {
+    *field++ = (uint8_t)(ticksPerNs >> (8 * i));
+  }
+  field = putVarint(field, zigzag(header.startWallNs));
+  field = putVarint(field, header.recordKinds);
+  out = putVarint(out, field - fields);
+  memcpy(out, fields, field - fields);
+  return out + (field - fields);
+}
+
+// Moves in past the header. Returns false if it is truncated or invalid.
+inline bool getSessionHeader(const uint8_t *&in, const uint8_t *end,
+                             session_header_t &header) noexcept {
+  uint64_t size;
+  if (!getVarint(in, end, size) || size > (uint64_t)(end - in)) {
+    return false;
+  }
+  const uint8_t *field = in;
+  const uint8_t *const fieldsEnd = in + size;
+  uint64_t clock, startWallNs, ticksPerNs = 0;
+  if (field == fieldsEnd) {
+    return false;
+  }
+  header.byteOrder = (ByteOrder)*field++;
+  if (!getVarint(field, fieldsEnd, clock) ||
+      fieldsEnd - field < (ptrdiff_t)sizeof(ticksPerNs)) {
+    return false;
+  }
+  for (size_t i = 0; i < sizeof(ticksPerNs); i++) {
+    ticksPerNs |= (uint64_t)*field++ << (8 * i);
+  }
+  if (!getVarint(field, fieldsEnd, startWallNs) ||
+      !getVarint(field, fieldsEnd, header.recordKinds)) {
+    return false;
+  }
+  header.clock = (uint8_t)clock;
+  memcpy(&header.ticksPerNs, &ticksPerNs, sizeof(ticksPerNs));
+  header.startWallNs = unzigzag(startWallNs);
+  in = fieldsEnd;
+  return header.byteOrder == ByteOrder::LittleEndian ||
+         header.byteOrder == ByteOrder::BigEndian;
+}
+
+inline uint8_t *putTrailer(uint8_t *out, uint64_t indexOffset) noexcept {
+  for (size_t i = 0; i < sizeof(indexOffset); i++) {
+    *out++ = (uint8_t)(indexOffset >> (8 * i));
+  }
+  memcpy(out, SESSION_TRAILER_MAGIC, kMagicSize);
+  return out + kMagicSize;
+}
+
+// Offset of the index of a file of size bytes ending with trailer, false if
+// the file has no valid trailer
+inline bool getTrailer(const uint8_t *trailer, uint64_t size,
+                       uint64_t &indexOffset) noexcept {
+  if (size < kPreambleSize + kTrailerSize ||
+      memcmp(trailer + sizeof(uint64_t), SESSION_TRAILER_MAGIC, kMagicSize) !=
+          0) {
+    return false;
+  }
+  indexOffset = 0;
+  for (size_t i = 0; i < sizeof(indexOffset); i++) {
+    indexOffset |= (uint64_t)trailer[i] << (8 * i);
+  }
+  return indexOffset >= kPreambleSize && indexOffset <= size - kTrailerSize;
+}
+
+inline uint8_t *putBlockHeader(uint8_t *out,
+                               const block_header_t &header) noexcept {
+  const bool compressed = header.codec != BlockCodec::None;
+  out = putVarint(out, (header.threadId << 1) | compressed);
+  out = putVarint(out, zigzag(header.baseTime));
+  out = putVarint(out, header.count);
+  out = putVarint(out, header.payloadSize);
+  if (compressed) {
+    out = putVarint(out, (uint64_t)header.codec);
+    out = putVarint(out, header.rawSize);
+  }
+  return out;
+}
+
+// Reads the header of a block, returns false if it is truncated.
+inline bool getBlockHeader(const uint8_t *&in, const uint8_t *end,
+                           block_header_t &header) noexcept {
+  uint64_t threadId, baseTime, codec = 0;
+  if (!getVarint(in, end, threadId) || !getVarint(in, end, baseTime) ||
+      !getVarint(in, end, header.count) ||
+      !getVarint(in, end, header.payloadSize)) {
+    return false;
+  }
+  header.threadId = threadId >> 1;
+  header.rawSize = header.payloadSize;
+  if ((threadId & 1) && (!getVarint(in, end, codec) ||
+                         !getVarint(in, end, header.rawSize))) {
+    return false;
+  }
+  header.codec = (BlockCodec)codec;
+  header.baseTime = unzigzag(baseTime);
+  return header.payloadSize <= (uint64_t)(end - in);
+}
+
+} // namespace session_encoding
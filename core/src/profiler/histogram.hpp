@@ -0,0 +1,128 @@
+#pragma once
+
+#include <algorithm>
+#include <array>
+#include <atomic>
+#include <cstddef>
+#include <cstdint>
+
+// Log-linear histogram of durations in clock ticks, in the style of HDR
+// histograms: every power of two range is split in kSubBuckets linear
+// buckets, so values are kept with a relative error below 1 / kSubBuckets.
+namespace log_histogram {
+
+static constexpr unsigned kSubBucketBits = 4;
+static constexpr uint64_t kSubBuckets = 1 << kSubBucketBits;
+// Values above 2^(kMaxExponent + 1) ticks are counted in the last bucket
+static constexpr unsigned kMaxExponent = 47;
+static constexpr size_t kBuckets =
+    (kMaxExponent - kSubBucketBits + 2) * kSubBuckets;
+
+inline size_t bucketIndex(uint64_t value) noexcept {
+  if (value < kSubBuckets) {
+    return value;
+  }
+  const unsigned exponent =
+      std::min<unsigned>(63 - __builtin_clzll(value), kMaxExponent);
+  if (exponent == kMaxExponent && (value >> (kMaxExponent + 1)) != 0) {
+    return kBuckets - 1;
+  }
+  const uint64_t mantissa =
+      (value >> (exponent - kSubBucketBits)) & (kSubBuckets - 1);
+  return (exponent - kSubBucketBits + 1) * kSubBuckets + mantissa;
+}
+
+// Lowest value counted in bucket index
+inline uint64_t bucketLowerBound(size_t index) noexcept {
+  if (index < kSubBuckets) {
+    return index;
+  }
+  const unsigned exponent = index / kSubBuckets + kSubBucketBits - 1;
+  const uint64_t mantissa = index % kSubBuckets;
+  return (kSubBuckets + mantissa) << (exponent - kSubBucketBits);
+}
+
+// Value reported for the samples of bucket index
+inline uint64_t bucketMidpoint(size_t index) noexcept {
+  if (index < kSubBuckets) {
+    return index;
+  }
+  const unsigned exponent = index / kSubBuckets + kSubBucketBits - 1;
+  return bucketLowerBound(index) +
+         ((uint64_t)1 << (exponent - kSubBucketBits)) / 2;
+}
+
+// Histogram written by a single thread and read concurrently by snapshots.
+// Updates are plain relaxed loads and stores, no read-modify-write.
+struct concurrent_t {
+  void add(uint64_t value) noexcept {
+    bump(count, 1);
+    bump(sum, value);
+    if (value < min.load(std::memory_order_relaxed)) {
+      min.store(value, std::memory_order_relaxed);
+    }
+    if (value > max.load(std::memory_order_relaxed)) {
+      max.store(value, std::memory_order_relaxed);
+    }
+    bump(buckets[bucketIndex(value)], 1);
+  }
+
+  std::atomic<uint64_t> count{0};
+  std::atomic<uint64_t> sum{0};
+  std::atomic<uint64_t> min{UINT64_MAX};
+  std::atomic<uint64_t> max{0};
+  std::array<std::atomic<uint64_t>, kBuckets> buckets{};
+
+private:
+  static void bump(std::atomic<uint64_t> &value, uint64_t amount) noexcept {
+    value.store(value.load(std::memory_order_relaxed) + amount,
+                std::memory_order_relaxed);
+  }
+};
+
+// Plain histogram used to merge the ones of every thread.
+struct merged_t {
+  void merge(const concurrent_t &other) noexcept {
+    count += other.count.load(std::memory_order_relaxed);
+    sum += other.sum.load(std::memory_order_relaxed);
+    min = std::min(min, other.min.load(std::memory_order_relaxed));
+    max = std::max(max, other.max.load(std::memory_order_relaxed));
+    for (size_t i = 0; i < kBuckets; i++) {
+      buckets[i] += other.buckets[i].load(std::memory_order_relaxed);
+    }
+  }
+
+  void merge(const merged_t &other) noexcept {
+    count += other.count;
+    sum += other.sum;
+    min = std::min(min, other.min);
+    max = std::max(max, other.max);
+    for (size_t i = 0; i < kBuckets; i++) {
+      buckets[i] += other.buckets[i];
+    }
+  }
+
+  // Value below which a fraction quantile of the samples falls
+  uint64_t percentile(double quantile) const noexcept {
+    if (count == 0) {
+      return 0;
+    }
+    const uint64_t rank = std::max<uint64_t>(1, quantile * count + 0.5);
+    uint64_t seen = 0;
+    for (size_t i = 0; i < kBuckets; i++) {
+      seen += buckets[i];
+      if (seen >= rank) {
+        return std::clamp(bucketMidpoint(i), min, max);
+      }
+    }
+    return max;
+  }
+
+  uint64_t count = 0;
+  uint64_t sum = 0;
+  uint64_t min = UINT64_MAX;
+  uint64_t max = 0;
+  std::array<uint64_t, kBuckets> buckets{};
+};
+
+} // namespace log_histogram
@@ -0,0 +1,192 @@
+#include "live_stream.hpp"
+
+#include "encoding.hpp"
+
+#include <algorithm>
+#include <cerrno>
+#include <cstring>
+
+#if defined(__linux__)
+#include <fcntl.h>
+#include <sys/socket.h>
+#include <sys/un.h>
+#include <unistd.h>
+#endif
+
+using live_protocol::LiveMessage;
+
+#if defined(__linux__)
+
+std::unique_ptr<LiveStream> LiveStream::open(const std::string &path,
+                                             size_t clientQueueSize,
+                                             const std::vector<uint8_t> &head) {
+  sockaddr_un address{};
+  if (path.empty() || path.size() >= sizeof(address.sun_path)) {
+    return nullptr;
+  }
+  address.sun_family = AF_UNIX;
+  memcpy(address.sun_path, path.c_str(), path.size());
+
+  const int fd = socket(AF_UNIX, SOCK_STREAM | SOCK_NONBLOCK | SOCK_CLOEXEC, 0);
+  if (fd < 0) {
+    return nullptr;
+  }
+  // Left over by a previous run
+  unlink(path.c_str());
+  if (bind(fd, (const sockaddr *)&address, sizeof(address)) != 0 ||
+      listen(fd, 8) != 0) {
+    ::close(fd);
+    return nullptr;
+  }
+  return std::unique_ptr<LiveStream>(
+      new LiveStream(fd, path, clientQueueSize, head));
+}
+
+LiveStream::~LiveStream() {
+  if (fd < 0) {
+    return;
+  }
+  for (client_t &client : clients) {
+    // The session is closing, instrumented threads are done: give each
+    // client a bounded time to receive what is queued
+    const timeval timeout{.tv_sec = 1, .tv_usec = 0};
+    setsockopt(client.fd, SOL_SOCKET, SO_SNDTIMEO, &timeout, sizeof(timeout));
+    fcntl(client.fd, F_SETFL, fcntl(client.fd, F_GETFL) & ~O_NONBLOCK);
+    flush(client);
+    ::close(client.fd);
+  }
+  ::close(fd);
+  unlink(path.c_str());
+}
+
+void LiveStream::abandon() noexcept {
+  for (const client_t &client : clients) {
+    ::close(client.fd);
+  }
+  clients.clear();
+  ::close(fd);
+  fd = -1;
+}
+
+void LiveStream::poll(const std::string &info, const std::string &locations,
+                      const std::string &threads) noexcept {
+  for (;;) {
+    const int clientFd = accept4(fd, nullptr, nullptr,
+                                 SOCK_NONBLOCK | SOCK_CLOEXEC);
+    if (clientFd < 0) {
+      break;
+    }
+    client_t &client = clients.emplace_back();
+    client.fd = clientFd;
+    client.queue = head;
+    enqueue(client, LiveMessage::Info, info.data(), info.size());
+    if (!locations.empty()) {
+      enqueue(client, LiveMessage::Locations, locations.data(),
+              locations.size());
+    }
+    if (!threads.empty()) {
+      enqueue(client, LiveMessage::Threads, threads.data(), threads.size());
+    }
+  }
+  for (client_t &client : clients) {
+    flush(client);
+  }
+  removeFailedClients();
+}
+
+void LiveStream::publishLocations(const std::string &lines) noexcept {
+  publishLines(LiveMessage::Locations, lines);
+}
+
+void LiveStream::publishThreads(const std::string &lines) noexcept {
+  publishLines(LiveMessage::Threads, lines);
+}
+
+// Tables are never dropped, blocks can't be decoded without them
+void LiveStream::publishLines(LiveMessage type,
+                              const std::string &lines) noexcept {
+  for (client_t &client : clients) {
+    enqueue(client, type, lines.data(), lines.size());
+    flush(client);
+  }
+  removeFailedClients();
+}
+
+void LiveStream::publishBlock(const uint8_t *block, size_t size,
+                              size_t measures) noexcept {
+  for (client_t &client : clients) {
+    flush(client);
+    if (client.queue.size() + live_protocol::kMaxMessageHeaderSize + size >
+        clientQueueSize) {
+      client.dropped += measures;
+      client.droppedChanged = true;
+      continue;
+    }
+    if (client.droppedChanged) {
+      uint8_t dropped[session_encoding::kMaxVarintSize];
+      const size_t droppedSize =
+          session_encoding::putVarint(dropped, client.dropped) - dropped;
+      enqueue(client, LiveMessage::Dropped, dropped, droppedSize);
+      client.droppedChanged = false;
+    }
+    enqueue(client, LiveMessage::Block, block, size);
+    flush(client);
+  }
+  removeFailedClients();
+}
+
+void LiveStream::enqueue(client_t &client, LiveMessage type, const void *data,
+                         size_t size) {
+  uint8_t header[live_protocol::kMaxMessageHeaderSize];
+  header[0] = (uint8_t)type;
+  const size_t headerSize = session_encoding::putVarint(header + 1, size) -
+                            header;
+  client.queue.insert(client.queue.end(), header, header + headerSize);
+  const uint8_t *bytes = static_cast<const uint8_t *>(data);
+  client.queue.insert(client.queue.end(), bytes, bytes + size);
+}
+
+void LiveStream::flush(client_t &client) noexcept {
+  size_t sent = 0;
+  while (sent < client.queue.size()) {
+    const ssize_t res = send(client.fd, client.queue.data() + sent,
+                             client.queue.size() - sent, MSG_NOSIGNAL);
+    if (res < 0) {
+      if (errno == EINTR) {
+        continue;
+      }
+      client.failed = errno != EAGAIN && errno != EWOULDBLOCK;
+      break;
+    }
+    sent += res;
+  }
+  client.queue.erase(client.queue.begin(), client.queue.begin() + sent);
+}
+
+void LiveStream::removeFailedClients() noexcept {
+  std::erase_if(clients, [](const client_t &client) {
+    if (client.failed) {
+      ::close(client.fd);
+    }
+    return client.failed;
+  });
+}
+
+#else
+
+std::unique_ptr<LiveStream> LiveStream::open(const std::string &, size_t,
+                                             const std::vector<uint8_t> &) {
+  return nullptr;
+}
+
+LiveStream::~LiveStream() {}
+
+void LiveStream::abandon() noexcept {}
+void LiveStream::poll(const std::string &, const std::string &,
+                      const std::string &) noexcept {}
+void LiveStream::publishLocations(const std::string &) noexcept {}
+void LiveStream::publishThreads(const std::string &) noexcept {}
+void LiveStream::publishLines(LiveMessage, const std::string &) noexcept {}
+void LiveStream::publishBlock(const uint8_t *, size_t, size_t) noexcept {}
+
+#endif
@@ -0,0 +1,87 @@
+#pragma once
+
+#include <cstddef>
+#include <cstdint>
+#include <memory>
+#include <string>
+#include <vector>
+
+// Live stream protocol, see SessionConfig::liveSocket. A client connecting
+// to the socket first receives the session preamble and header (see
+// encoding.hpp), then messages made of
+//   uint8 LiveMessage | varint size | size bytes of payload
+namespace live_protocol {
+
+enum class LiveMessage : uint8_t {
+  // Content of the session info file, sent once
+  Info = 0,
+  // New lines of the location table, always sent before the blocks that use
+  // them
+  Locations = 1,
+  // One encoded block of measures
+  Block = 2,
+  // Varint total of the measures dropped for this client so far
+  Dropped = 3,
+  // New lines of the thread table, see SESSION_THREADS_FILENAME
+  Threads = 4,
+};
+
+static constexpr size_t kMaxMessageHeaderSize = 1 + 10;
+
+} // namespace live_protocol
+
+// Unix domain socket server publishing the session stream to any number of
+// clients, used by the session writer thread only. Sockets are non blocking:
+// blocks that don't fit in the send queue of a slow client are dropped for
+// that client and counted, the writer never waits on a client.
+class LiveStream {
+public:
+  // Returns nullptr if the socket can't be created. head is the preamble and
+  // session header sent first to every client.
+  static std::unique_ptr<LiveStream> open(const std::string &path,
+                                          size_t clientQueueSize,
+                                          const std::vector<uint8_t> &head);
+  ~LiveStream();
+
+  // Accepts new clients, sending them info and the locations and threads
+  // published so far, and flushes the send queues.
+  void poll(const std::string &info, const std::string &locations,
+            const std::string &threads) noexcept;
+  void publishLocations(const std::string &lines) noexcept;
+  void publishThreads(const std::string &lines) noexcept;
+  void publishBlock(const uint8_t *block, size_t size,
+                    size_t measures) noexcept;
+
+  size_t clientCount() const noexcept { return clients.size(); }
+
+  // Called in a forked child: closes the inherited sockets without sending
+  // anything or removing the socket file, which belong to the parent.
+  void abandon() noexcept;
+
+private:
+  struct client_t {
+    int fd = -1;
+    std::vector<uint8_t> queue;
+    uint64_t dropped = 0;
+    bool droppedChanged = false;
+    bool failed = false;
+  };
+
+  LiveStream(int _fd, const std::string &_path, size_t _clientQueueSize,
+             const std::vector<uint8_t> &_head)
+      : fd(_fd), path(_path), clientQueueSize(_clientQueueSize),
+        head(_head) {}
+
+  void publishLines(live_protocol::LiveMessage type,
+                    const std::string &lines) noexcept;
+  static void enqueue(client_t &client, live_protocol::LiveMessage type,
+                      const void *data, size_t size);
+  void flush(client_t &client) noexcept;
+  void removeFailedClients() noexcept;
+
+  int fd;
+  std::string path;
+  size_t clientQueueSize;
+  std::vector<uint8_t> head;
+  std::vector<client_t> clients;
+};
@@ -0,0 +1,113 @@
+#include "location_filter.hpp"
+
+#include <string_view>
+#include <utility>
+
+namespace location_filter {
+
+static std::string_view trim(std::string_view text) {
+  const size_t first = text.find_first_not_of(" \t\r");
+  if (first == std::string_view::npos) {
+    return {};
+  }
+  return text.substr(first, text.find_last_not_of(" \t\r") - first + 1);
+}
+
+static bool parseRule(std::string_view text, rule_t &rule) {
+  rule.enable = true;
+  if (text.front() == '+' || text.front() == '-') {
+    rule.enable = text.front() == '+';
+    text = trim(text.substr(1));
+  }
+  rule.field = Field::Name;
+  // Anything else before a colon is part of the pattern, function names
+  // hold colons
+  static constexpr std::pair<std::string_view, Field> kFields[] = {
+      {"name:", Field::Name},
+      {"file:", Field::File},
+      {"function:", Field::Function},
+  };
+  for (const auto &[prefix, field] : kFields) {
+    if (text.starts_with(prefix)) {
+      rule.field = field;
+      text.remove_prefix(prefix.size());
+      break;
+    }
+  }
+  rule.pattern = trim(text);
+  return !rule.pattern.empty();
+}
+
+bool parse(const std::string &spec, std::vector<rule_t> &rules) {
+  std::vector<rule_t> parsed;
+  std::string_view rest = spec;
+  while (!rest.empty()) {
+    const size_t lineEnd = rest.find('\n');
+    const std::string_view line = trim(rest.substr(0, lineEnd));
+    rest = lineEnd == std::string_view::npos ? std::string_view()
+                                             : rest.substr(lineEnd + 1);
+    if (line.empty() || line.front() == '#') {
+      continue;
+    }
+    std::string_view lineRules = line;
+    while (!lineRules.empty()) {
+      const size_t ruleEnd = lineRules.find(',');
+      const std::string_view text = trim(lineRules.substr(0, ruleEnd));
+      lineRules = ruleEnd == std::string_view::npos
+                      ? std::string_view()
+                      : lineRules.substr(ruleEnd + 1);
+      if (text.empty()) {
+        continue;
+      }
+      if (!parseRule(text, parsed.emplace_back())) {
+        return false;
+      }
+    }
+  }
+  rules = std::move(parsed);
+  return true;
+}
+
+bool isEnabled(const std::vector<rule_t> &rules, const char *name,
+               const char *file, const char *function) noexcept {
+  if (rules.empty()) {
+    return true;
+  }
+  bool enabled = !rules.front().enable;
+  for (const rule_t &rule : rules) {
+    const char *text = rule.field == Field::File       ? file
+                       : rule.field == Field::Function ? function
+                                                       : name;
+    if (globMatch(rule.pattern.c_str(), text ? text : "")) {
+      enabled = rule.enable;
+    }
+  }
+  return enabled;
+}
+
+// Backtracks to the last * only: a later * can match anything an earlier
+// one would have
+bool globMatch(const char *pattern, const char *text) noexcept {
+  const char *starPattern = nullptr;
+  const char *starText = nullptr;
+  while (*text) {
+    if (*pattern == '*') {
+      starPattern = ++pattern;
+      starText = text;
+    } else if (*pattern == '?' || *pattern == *text) {
+      pattern++;
+      text++;
+    } else if (starPattern) {
+      pattern = starPattern;
+      text = ++starText;
+    } else {
+      return false;
+    }
+  }
+  while (*pattern == '*') {
+    pattern++;
+  }
+  return *pattern == '\0';
+}
+
+} // namespace location_filter
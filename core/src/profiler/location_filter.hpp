@@ -0,0 +1,36 @@
+#pragma once
+
+#include <string>
+#include <vector>
+
+// Rules enabling or disabling locations at runtime, see
+// ProfilingSession::setLocationFilter(). A filter is a list of rules
+// separated by commas or new lines
+//   [+|-][name:|file:|function:]pattern
+// where + (the default) enables and - disables the locations whose name,
+// file or function (name if not given) matches the glob pattern, * matching
+// any sequence of characters and ? any single one. The last matching rule
+// wins. Locations matching no rule are disabled if the first rule enables,
+// enabled otherwise, so "parser*" records the parser scopes only and
+// "-*lock*" everything but the lock scopes. Blank lines and lines starting
+// with # are ignored.
+namespace location_filter {
+
+enum class Field { Name, File, Function };
+
+struct rule_t {
+  bool enable;
+  Field field;
+  std::string pattern;
+};
+
+// Returns false, leaving rules unchanged, if a rule has an empty pattern.
+// A prefix before a colon that is not a field is part of the pattern.
+bool parse(const std::string &spec, std::vector<rule_t> &rules);
+
+bool isEnabled(const std::vector<rule_t> &rules, const char *name,
+               const char *file, const char *function) noexcept;
+
+bool globMatch(const char *pattern, const char *text) noexcept;
+
+} // namespace location_filter
@@ -0,0 +1,260 @@
+#include "perf_counters.hpp"
+
+#include <array>
+
+#if defined(__linux__)
+#include <linux/perf_event.h>
+#include <sys/mman.h>
+#include <sys/resource.h>
+#include <sys/syscall.h>
+#include <unistd.h>
+#endif
+
+#if defined(__x86_64__) || defined(__i386__)
+#include <x86intrin.h>
+#endif
+
+using session_encoding::RecordKind;
+
+static constexpr std::array<RecordKind, perf_counters::kMaxCounters>
+    kHardwareKinds = {RecordKind::Cycles, RecordKind::Instructions,
+                      RecordKind::CacheMisses, RecordKind::BranchMisses};
+static constexpr std::array<RecordKind, 2> kSoftwareKinds = {
+    RecordKind::TaskClock, RecordKind::PageFaults};
+
+#if defined(__linux__)
+
+// Events of each mode
+struct event_t {
+  uint32_t type;
+  uint64_t config;
+};
+static constexpr std::array<event_t, 4> kHardwareEvents = {{
+    {PERF_TYPE_HARDWARE, PERF_COUNT_HW_CPU_CYCLES},
+    {PERF_TYPE_HARDWARE, PERF_COUNT_HW_INSTRUCTIONS},
+    {PERF_TYPE_HARDWARE, PERF_COUNT_HW_CACHE_MISSES},
+    {PERF_TYPE_HARDWARE, PERF_COUNT_HW_BRANCH_MISSES},
+}};
+static constexpr std::array<event_t, 2> kSoftwareEvents = {{
+    {PERF_TYPE_SOFTWARE, PERF_COUNT_SW_TASK_CLOCK},
+    {PERF_TYPE_SOFTWARE, PERF_COUNT_SW_PAGE_FAULTS},
+}};
+static constexpr size_t kMaxEvents = kHardwareEvents.size();
+
+static int openEvent(const event_t &event, int groupFd) noexcept {
+  perf_event_attr attr{};
+  attr.size = sizeof(attr);
+  attr.type = event.type;
+  attr.config = event.config;
+  attr.exclude_kernel = 1;
+  attr.exclude_hv = 1;
+  attr.read_format = groupFd == -1 ? PERF_FORMAT_GROUP : 0;
+  // pid 0, cpu -1: the calling thread on any cpu
+  return (int)syscall(SYS_perf_event_open, &attr, 0, -1, groupFd, 0);
+}
+
+// Counters of one thread, opened as a single group so that they are
+// scheduled together.
+class ThreadCounters {
+public:
+  ~ThreadCounters() noexcept { closeAll(); }
+
+  bool open(PerfCounterMode _mode) noexcept {
+    closeAll();
+    mode = _mode;
+    const event_t *events = mode == PerfCounterMode::Hardware
+                                ? kHardwareEvents.data()
+                                : kSoftwareEvents.data();
+    eventCount = mode == PerfCounterMode::Hardware ? kHardwareEvents.size()
+                                                   : kSoftwareEvents.size();
+    for (size_t i = 0; i < eventCount; i++) {
+      fds[i] = openEvent(events[i], i == 0 ? -1 : fds[0]);
+      if (fds[i] == -1) {
+        closeAll();
+        return false;
+      }
+    }
+    if (mode == PerfCounterMode::Hardware) {
+      mapUserPages();
+    }
+    return true;
+  }
+
+  bool read(uint64_t *values) noexcept {
+    if (!(userPagesMapped && readUserPages(values))) {
+      // One read of the group leader returns all the counters
+      uint64_t buffer[1 + kMaxEvents];
+      const ssize_t expected = (1 + eventCount) * sizeof(uint64_t);
+      if (::read(fds[0], buffer, expected) != expected) {
+        return false;
+      }
+      for (size_t i = 0; i < eventCount; i++) {
+        values[i] = buffer[1 + i];
+      }
+    }
+    return true;
+  }
+
+  // Opens the counters if the mode changed since the last call
+  bool ensureOpen(PerfCounterMode requested) noexcept {
+    if (requested != requestedMode) [[unlikely]] {
+      requestedMode = requested;
+      openFailed = !open(requested);
+    }
+    return !openFailed;
+  }
+
+private:
+  void mapUserPages() noexcept {
+    const long pageSize = sysconf(_SC_PAGESIZE);
+    for (size_t i = 0; i < eventCount; i++) {
+      void *page = mmap(nullptr, pageSize, PROT_READ, MAP_SHARED, fds[i], 0);
+      if (page == MAP_FAILED) {
+        unmapUserPages();
+        return;
+      }
+      pages[i] = (perf_event_mmap_page *)page;
+      if (!pages[i]->cap_user_rdpmc) {
+        unmapUserPages();
+        return;
+      }
+    }
+    userPagesMapped = true;
+  }
+
+  void unmapUserPages() noexcept {
+    const long pageSize = sysconf(_SC_PAGESIZE);
+    for (auto &page : pages) {
+      if (page) {
+        munmap(page, pageSize);
+        page = nullptr;
+      }
+    }
+    userPagesMapped = false;
+  }
+
+  // Reads the counters with rdpmc following the protocol documented in
+  // linux/perf_event.h. Returns false if any counter is not currently
+  // scheduled on the PMU.
+  bool readUserPages(uint64_t *values) noexcept {
+#if defined(__x86_64__) || defined(__i386__)
+    for (size_t i = 0; i < eventCount; i++) {
+      const volatile perf_event_mmap_page *page = pages[i];
+      uint32_t sequence;
+      int64_t count;
+      do {
+        sequence = page->lock;
+        asm volatile("" ::: "memory");
+        const uint32_t index = page->index;
+        if (!page->cap_user_rdpmc || index == 0) {
+          return false;
+        }
+        count = page->offset;
+        const uint16_t width = page->pmc_width;
+        int64_t pmc = (int64_t)__rdpmc(index - 1);
+        pmc <<= 64 - width;
+        pmc >>= 64 - width;
+        count += pmc;
+        asm volatile("" ::: "memory");
+      } while (page->lock != sequence);
+      values[i] = (uint64_t)count;
+    }
+    return true;
+#else
+    (void)values;
+    return false;
+#endif
+  }
+
+  void closeAll() noexcept {
+    unmapUserPages();
+    for (size_t i = 0; i < eventCount; i++) {
+      if (fds[i] != -1) {
+        close(fds[i]);
+      }
+      fds[i] = -1;
+    }
+    eventCount = 0;
+    mode = PerfCounterMode::Disabled;
+  }
+
+  PerfCounterMode requestedMode = PerfCounterMode::Disabled;
+  bool openFailed = false;
+  PerfCounterMode mode = PerfCounterMode::Disabled;
+  size_t eventCount = 0;
+  std::array<int, kMaxEvents> fds{-1, -1, -1, -1};
+  std::array<perf_event_mmap_page *, kMaxEvents> pages{};
+  bool userPagesMapped = false;
+};
+
+static thread_local ThreadCounters tlsCounters;
+
+#endif
+
+namespace perf_counters {
+
+PerfCounterMode probe() noexcept {
+#if defined(__linux__)
+  for (PerfCounterMode mode :
+       {PerfCounterMode::Hardware, PerfCounterMode::Software}) {
+    ThreadCounters counters;
+    if (counters.open(mode)) {
+      return mode;
+    }
+  }
+#endif
+  return PerfCounterMode::Disabled;
+}
+
+size_t count(PerfCounterMode mode) noexcept {
+  switch (mode) {
+  case PerfCounterMode::Hardware:
+    return kHardwareKinds.size();
+  case PerfCounterMode::Software:
+    return kSoftwareKinds.size();
+  default:
+    return 0;
+  }
+}
+
+RecordKind kind(PerfCounterMode mode, size_t index) noexcept {
+  return mode == PerfCounterMode::Hardware ? kHardwareKinds[index]
+                                           : kSoftwareKinds[index];
+}
+
+bool read(PerfCounterMode mode, sample_t &sample) noexcept {
+#if defined(__linux__)
+  return tlsCounters.ensureOpen(mode) && tlsCounters.read(sample.values);
+#else
+  (void)mode;
+  (void)sample;
+  return false;
+#endif
+}
+
+const char *name(PerfCounterMode mode) noexcept {
+  switch (mode) {
+  case PerfCounterMode::Hardware:
+    return "hardware";
+  case PerfCounterMode::Software:
+    return "software";
+  default:
+    return "disabled";
+  }
+}
+
+// Not a perf event: counting them requires kernel profiling rights, getrusage
+// doesn't
+int64_t contextSwitches() noexcept {
+#if defined(__linux__)
+  rusage usage;
+  if (getrusage(RUSAGE_THREAD, &usage) != 0) {
+    return -1;
+  }
+  return usage.ru_nvcsw + usage.ru_nivcsw;
+#else
+  return -1;
+#endif
+}
+
+} // namespace perf_counters
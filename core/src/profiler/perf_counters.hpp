@@ -0,0 +1,47 @@
+#pragma once
+
+#include <cstddef>
+#include <cstdint>
+
+#include "encoding.hpp"
+
+// Per thread performance counters read by MeasureScope when enabled in
+// SessionConfig. Counters are opened with perf_event_open on the first read of
+// each thread.
+enum class PerfCounterMode : uint8_t {
+  Disabled = 0,
+  // cycles, instructions, LLC misses and branch misses, read with rdpmc when
+  // the kernel allows user space access
+  Hardware = 1,
+  // task-clock and page faults, used when no hardware PMU is accessible
+  // (containers, virtual machines)
+  Software = 2,
+};
+
+namespace perf_counters {
+
+static constexpr size_t kMaxCounters = 4;
+
+struct sample_t {
+  uint64_t values[kMaxCounters];
+};
+
+// Returns the mode that can actually be used on this machine, trying the
+// hardware counters first.
+PerfCounterMode probe() noexcept;
+
+// Number of counters of mode and the record kind written for each of them.
+size_t count(PerfCounterMode mode) noexcept;
+session_encoding::RecordKind kind(PerfCounterMode mode, size_t index) noexcept;
+
+// Reads the counters of the calling thread. Returns false if they can't be
+// opened, in which case the thread won't try again until the mode changes.
+bool read(PerfCounterMode mode, sample_t &sample) noexcept;
+
+const char *name(PerfCounterMode mode) noexcept;
+
+// Voluntary and involuntary context switches of the calling thread so far,
+// -1 if unknown. A system call, unlike the rdpmc reads.
+int64_t contextSwitches() noexcept;
+
+} // namespace perf_counters
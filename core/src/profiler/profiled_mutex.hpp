@@ -0,0 +1,77 @@
+#pragma once
+
+#include <atomic>
+#include <mutex>
+
+#include "profiler.hpp"
+
+#define PROFILER_CONCAT_IMPL(a, b) a##b
+#define PROFILER_CONCAT(a, b) PROFILER_CONCAT_IMPL(a, b)
+
+// Defines a ProfiledMutex together with its location.
+#define PROFILER_MUTEX(mutex_name)                                             \
+  PROFILER_LOCATION(mutex_name##Location, #mutex_name);                        \
+  ProfiledMutex mutex_name(mutex_name##Location)
+
+// Locks mutex until the end of the enclosing scope. The mutex is locked even
+// when profiling is compiled out.
+#define MEASURE_LOCK(mutex)                                                    \
+  std::lock_guard<ProfiledMutex> PROFILER_CONCAT(profilerLockGuard,            \
+                                                 __LINE__)(mutex)
+
+// std::mutex that records, for every acquisition, the time spent waiting for
+// the lock and the time it was held. Both records carry the location of the
+// mutex and an instance number, which identify it in the plotter contention
+// view even when several mutexes share the location.
+class ProfiledMutex {
+public:
+  explicit ProfiledMutex(const LocationID &loc) noexcept
+      : location(loc),
+        instance(nextInstance.fetch_add(1, std::memory_order_relaxed)) {}
+  ProfiledMutex(const ProfiledMutex &) = delete;
+  ProfiledMutex &operator=(const ProfiledMutex &) = delete;
+
+  void lock() {
+    if (!ProfilingSession::isRecorded(location)) {
+      mtx.lock();
+      holdStart = kUntimed;
+      return;
+    }
+    const int64_t waitStart = ProfilingSession::now();
+    mtx.lock();
+    holdStart = ProfilingSession::now();
+    ProfilingSession::recordLockWait(location, instance, waitStart, holdStart);
+  }
+
+  bool try_lock() {
+    if (!mtx.try_lock()) {
+      return false;
+    }
+    holdStart = ProfilingSession::isRecorded(location) ? ProfilingSession::now()
+                                                       : kUntimed;
+    return true;
+  }
+
+  void unlock() {
+    // Only the owner writes holdStart, read it before releasing the lock
+    const int64_t start = holdStart;
+    if (start == kUntimed) {
+      mtx.unlock();
+      return;
+    }
+    const int64_t end = ProfilingSession::now();
+    mtx.unlock();
+    ProfilingSession::recordLockHold(location, instance, start, end);
+  }
+
+  std::mutex &native() noexcept { return mtx; }
+
+private:
+  static constexpr int64_t kUntimed = INT64_MIN;
+  inline static std::atomic<uint32_t> nextInstance{0};
+
+  std::mutex mtx;
+  const LocationID &location;
+  const uint32_t instance;
+  int64_t holdStart = kUntimed;
+};
@@ -1,30 +1,259 @@
 #include "profiler.hpp"
+#include "compression.hpp"
+#include "live_stream.hpp"
 
 #include <algorithm>
+#include <bit>
 #include <cstdint>
 #include <inttypes.h>
 
+#include <cerrno>
 #include <cmath>
 #include <cstdio>
-#include <map>
+#include <cstring>
+#include <ctime>
+#include <filesystem>
 #include <memory>
+#include <new>
+#include <string_view>
+#include <unordered_map>
 
-static constexpr size_t kSessionBufferSize = 1 << 20;
+#if defined(__unix__)
+#include <fcntl.h>
+#include <pthread.h>
+#include <unistd.h>
+#endif
+#if defined(__linux__)
+#include <sys/syscall.h>
+#endif
 
-static inline constexpr int64_t getDeltaNanos(const auto &delta_t) {
-  return std::chrono::duration_cast<std::chrono::nanoseconds>(delta_t)
-      .count();
-}
+static constexpr auto kWriterMinIdlePeriod = std::chrono::microseconds(500);
+static constexpr auto kWriterMaxIdlePeriod = std::chrono::milliseconds(20);
+// Longest wait of close() for the location filter watcher
+static constexpr auto kFilterWatcherStep = std::chrono::milliseconds(50);
+
+// Records of the blocks written by the crash handler and by dump(), bounds
+// the crash buffer
+static constexpr size_t kDumpBlockRecords = 1 << 14;
 
 static thread_local MeasureBuffer tlsMeasureBuffer;
 
-MeasureScope::~MeasureScope() noexcept {
-  ProfilingSession::getGlobalInstace().addMeasure(loc, start, std::chrono::steady_clock::now());
+#if defined(__ELF__)
+// Provided by the linker for the registry section, weak so that programs
+// without any PROFILER_LOCATION still link
+extern "C" {
+extern LocationID __start_profiler_locations[] __attribute__((weak));
+extern LocationID __stop_profiler_locations[] __attribute__((weak));
+}
+
+static LocationID *registryBegin() noexcept {
+  return __start_profiler_locations;
+}
+static LocationID *registryEnd() noexcept { return __stop_profiler_locations; }
+#else
+static LocationID *registryBegin() noexcept { return nullptr; }
+static LocationID *registryEnd() noexcept { return nullptr; }
+#endif
+
+static size_t registrySize() noexcept {
+  return registryBegin() ? registryEnd() - registryBegin() : 0;
+}
+
+#if defined(__unix__)
+// The dump signal handler only writes a byte to this pipe, the dump itself
+// runs on a regular thread reading it.
+static int dumpPipe[2] = {-1, -1};
+static int dumpSignal = 0;
+static struct sigaction previousDumpAction;
+
+enum DumpRequest : char { DumpNow = 0, StopDumpThread = 1 };
+
+static bool forkHandlersInstalled = false;
+
+static bool openDumpPipe() noexcept {
+  if (pipe(dumpPipe) != 0) {
+    return false;
+  }
+  // Never block in the signal handler, a dump is already pending anyway
+  fcntl(dumpPipe[1], F_SETFL, O_NONBLOCK);
+  return true;
+}
+
+static void onDumpSignal(int) {
+  const int savedErrno = errno;
+  const char request = DumpNow;
+  [[maybe_unused]] const ssize_t written = ::write(dumpPipe[1], &request, 1);
+  errno = savedErrno;
+}
+
+static constexpr int kCrashSignals[] = {SIGSEGV, SIGBUS, SIGFPE, SIGILL,
+                                        SIGABRT};
+static struct sigaction previousCrashActions[std::size(kCrashSignals)];
+static bool crashHandlerInstalled = false;
+// Alternate signal stack of the thread calling initialize(), so that a stack
+// overflow of that thread is still handled
+alignas(16) static char crashStack[1 << 16];
+
+static void writeAll(int fd, const void *data, size_t size) noexcept {
+  const char *in = static_cast<const char *>(data);
+  while (size > 0) {
+    const ssize_t res = ::write(fd, in, size);
+    if (res < 0 && errno == EINTR) {
+      continue;
+    }
+    if (res <= 0) {
+      return;
+    }
+    in += res;
+    size -= res;
+  }
+}
+
+// Buffered text output of the crash handler, printf is not
+// async-signal-safe
+struct crash_writer_t {
+  explicit crash_writer_t(int _fd) noexcept : fd(_fd) {}
+
+  int fd;
+  size_t used = 0;
+  char buffer[4096];
+
+  void put(char c) noexcept {
+    if (used == sizeof(buffer)) {
+      flush();
+    }
+    buffer[used++] = c;
+  }
+  void put(const char *text) noexcept {
+    while (*text) {
+      put(*text++);
+    }
+  }
+  void put(uint64_t value) noexcept {
+    char digits[20];
+    size_t count = 0;
+    do {
+      digits[count++] = (char)('0' + value % 10);
+      value /= 10;
+    } while (value != 0);
+    while (count > 0) {
+      put(digits[--count]);
+    }
+  }
+  void flush() noexcept {
+    writeAll(fd, buffer, used);
+    used = 0;
+  }
+};
+#endif
+
+// Set by the crash handler, and while a thread uses the sink or frees rings
+static std::atomic<bool> crashing{false};
+static std::atomic<bool> sinkBusy{false};
+// Whether the calling thread set sinkBusy, for the crash handler
+static thread_local bool tlsInSink = false;
+
+// Called under mtx before using the sink or freeing rings. The crash handler
+// sets crashing before waiting for sinkBusy to clear, so either it waits for
+// this thread or this thread sees crashing and leaves the sink alone.
+static bool enterSink() noexcept {
+  sinkBusy.store(true, std::memory_order_seq_cst);
+  if (crashing.load(std::memory_order_seq_cst)) {
+    sinkBusy.store(false, std::memory_order_release);
+    return false;
+  }
+  tlsInSink = true;
+  return true;
+}
+
+static void leaveSink() noexcept {
+  tlsInSink = false;
+  sinkBusy.store(false, std::memory_order_release);
+}
+
+// Holds the sink for its lifetime, entered is false once the crash handler
+// runs. Sections nested in one of the same thread share it.
+struct sink_section_t {
+  sink_section_t() noexcept
+      : nested(tlsInSink), entered(nested || enterSink()) {}
+  ~sink_section_t() {
+    if (entered && !nested) {
+      leaveSink();
+    }
+  }
+  sink_section_t(const sink_section_t &) = delete;
+  sink_section_t &operator=(const sink_section_t &) = delete;
+
+  const bool nested;
+  const bool entered;
+};
+
+void MeasureScope::record() noexcept {
+  const int64_t end = ProfilingSession::now();
+  perf_counters::sample_t perfEnd;
+  const bool perfRead = perfMode != PerfCounterMode::Disabled &&
+                        perfMode == ProfilingSession::activePerfMode &&
+                        perf_counters::read(perfMode, perfEnd);
+  const uint64_t allocations = tlsScopeStack.allocations;
+  const uint64_t allocatedBytes = tlsScopeStack.allocatedBytes;
+  tlsScopeStack.current = parent;
+  tlsScopeStack.depth = depth;
+  tlsScopeStack.allocations = parentAllocations;
+  tlsScopeStack.allocatedBytes = parentAllocatedBytes;
+  auto &sessionInst = ProfilingSession::getGlobalInstace();
+  sessionInst.addMeasure(location, start, end, parent, depth);
+  if (allocations != 0) {
+    sessionInst.addScopeAllocations(location, start, allocations,
+                                    allocatedBytes);
+  }
+  if (perfRead) {
+    sessionInst.addScopePerfCounters(location, start, perfMode, perfStart,
+                                     perfEnd);
+  }
+  if (startCpu >= 0) [[unlikely]] {
+    const int endCpu = currentCpu();
+    if (endCpu >= 0 && endCpu != startCpu) {
+      sessionInst.addScopeMigration(location, start, startCpu, endCpu);
+    }
+  }
+  if (startSwitches >= 0) [[unlikely]] {
+    const int64_t endSwitches = perf_counters::contextSwitches();
+    if (endSwitches > startSwitches) {
+      sessionInst.addScopeContextSwitches(location, start,
+                                          endSwitches - startSwitches);
+    }
+  }
+}
+
+void ProfilingSession::addMeasure(uint32_t location, int64_t start,
+                                  int64_t end, uint32_t parent,
+                                  uint32_t depth) noexcept {
+  if (!isThreadEnabled()) [[unlikely]] {
+    return;
+  }
+  if (!initialized) [[unlikely]] {
+    return;
+  }
+
+  if (aggregateMode) {
+    tlsMeasureBuffer.aggregate(location, end - start);
+    return;
+  }
+
+  const measure_t serializer{
+    .time = start - initializationTicks,
+    .value = end - start,
+    .location = location,
+    .parent = parent,
+    .depth = depth,
+    .kind = session_encoding::RecordKind::Scope,
+  };
+  tlsMeasureBuffer.push(serializer);
 }
 
-void ProfilingSession::addMeasure(const LocationID &loc, const time_point &start,
-                                  const time_point &end) noexcept {
-  if (!enabled()) [[unlikely]] {
+void ProfilingSession::addSample(session_encoding::RecordKind kind,
+                                 uint32_t location, int64_t value) noexcept {
+  if (!isThreadEnabled()) [[unlikely]] {
     return;
   }
   if (!initialized) [[unlikely]] {
@@ -32,56 +261,1635 @@ void ProfilingSession::addMeasure(const LocationID &loc, const time_point &start
   }
 
   const measure_t serializer{
-    .time = getDeltaNanos(start - initializationTime),
-    .id = loc.locationID,
-    .duration = getDeltaNanos(end - start),
+    .time = now() - initializationTicks,
+    .value = value,
+    .location = location,
+    .parent = measure_t::kNoParent,
+    .depth = 0,
+    .kind = kind,
   };
   tlsMeasureBuffer.push(serializer);
 }
 
-void MeasureBuffer::push(measure_t m) noexcept {
+void ProfilingSession::addScopeAllocations(uint32_t location, int64_t start,
+                                           uint64_t count,
+                                           uint64_t bytes) noexcept {
+  if (!isThreadEnabled()) [[unlikely]] {
+    return;
+  }
+  if (!initialized) [[unlikely]] {
+    return;
+  }
+
+  measure_t serializer{
+    .time = start - initializationTicks,
+    .value = (int64_t)count,
+    .location = location,
+    .parent = measure_t::kNoParent,
+    .depth = 0,
+    .kind = session_encoding::RecordKind::Allocations,
+  };
+  tlsMeasureBuffer.push(serializer);
+  serializer.value = (int64_t)bytes;
+  serializer.kind = session_encoding::RecordKind::AllocatedBytes;
+  tlsMeasureBuffer.push(serializer);
+}
+
+void ProfilingSession::addScopePerfCounters(
+    uint32_t location, int64_t start, PerfCounterMode mode,
+    const perf_counters::sample_t &begin,
+    const perf_counters::sample_t &end) noexcept {
+  if (!isThreadEnabled()) [[unlikely]] {
+    return;
+  }
+  if (!initialized) [[unlikely]] {
+    return;
+  }
+
+  for (size_t i = 0; i < perf_counters::count(mode); i++) {
+    const int64_t delta = (int64_t)(end.values[i] - begin.values[i]);
+    if (delta == 0) {
+      continue;
+    }
+    tlsMeasureBuffer.push({
+      .time = start - initializationTicks,
+      .value = delta,
+      .location = location,
+      .parent = measure_t::kNoParent,
+      .depth = 0,
+      .kind = perf_counters::kind(mode, i),
+    });
+  }
+}
+
+void ProfilingSession::addScopeMigration(uint32_t location, int64_t start,
+                                         int startCpu, int endCpu) noexcept {
+  if (!isThreadEnabled()) [[unlikely]] {
+    return;
+  }
+  if (!initialized) [[unlikely]] {
+    return;
+  }
+
+  tlsMeasureBuffer.push({
+    .time = start - initializationTicks,
+    .value = (int64_t)(((uint64_t)startCpu << 32) | (uint32_t)endCpu),
+    .location = location,
+    .parent = measure_t::kNoParent,
+    .depth = 0,
+    .kind = session_encoding::RecordKind::CpuMigration,
+  });
+}
+
+void ProfilingSession::addScopeContextSwitches(uint32_t location,
+                                               int64_t start,
+                                               int64_t count) noexcept {
+  if (!isThreadEnabled()) [[unlikely]] {
+    return;
+  }
+  if (!initialized) [[unlikely]] {
+    return;
+  }
+
+  tlsMeasureBuffer.push({
+    .time = start - initializationTicks,
+    .value = count,
+    .location = location,
+    .parent = measure_t::kNoParent,
+    .depth = 0,
+    .kind = session_encoding::RecordKind::ContextSwitches,
+  });
+}
+
+void ProfilingSession::addLockInterval(session_encoding::RecordKind kind,
+                                       uint32_t location, uint32_t instance,
+                                       int64_t start, int64_t end) noexcept {
+  if (!isThreadEnabled()) [[unlikely]] {
+    return;
+  }
+  if (!initialized) [[unlikely]] {
+    return;
+  }
+
+  const measure_t serializer{
+    .time = start - initializationTicks,
+    .value = end - start,
+    .location = location,
+    .parent = measure_t::kNoParent,
+    .instance = instance,
+    .kind = kind,
+  };
+  tlsMeasureBuffer.push(serializer);
+}
+
+void ProfilingSession::recordCounter(const LocationID &loc,
+                                     int64_t increment) noexcept {
+  if (!isRecorded(loc)) {
+    return;
+  }
+  getGlobalInstace().addSample(session_encoding::RecordKind::Counter,
+                               loc.locationID(), increment);
+}
+
+void ProfilingSession::recordGauge(const LocationID &loc,
+                                   int64_t value) noexcept {
+  if (!isRecorded(loc)) {
+    return;
+  }
+  getGlobalInstace().addSample(session_encoding::RecordKind::Gauge,
+                               loc.locationID(), value);
+}
+
+void ProfilingSession::recordLockWait(const LocationID &loc, uint32_t instance,
+                                      int64_t start, int64_t end) noexcept {
+  getGlobalInstace().addLockInterval(session_encoding::RecordKind::LockWait,
+                                     loc.locationID(), instance, start, end);
+}
+
+void ProfilingSession::recordLockHold(const LocationID &loc, uint32_t instance,
+                                      int64_t start, int64_t end) noexcept {
+  getGlobalInstace().addLockInterval(session_encoding::RecordKind::LockHold,
+                                     loc.locationID(), instance, start, end);
+}
+
+void MeasureBuffer::push(const measure_t &m) noexcept {
+  // Nothing drains the rings in aggregate mode
+  if (ProfilingSession::aggregateMode) [[unlikely]] {
+    return;
+  }
+  if (!ring && !acquireRing()) [[unlikely]] {
+    ProfilingSession::getGlobalInstace().dropped.fetch_add(
+        1, std::memory_order_relaxed);
+    return;
+  }
+  if (ProfilingSession::flightRecorderMode) {
+    ring->overwrite(m);
+    return;
+  }
+  // The writer may be backing off, see writerLoop()
+  if (ring->push(m) && ring->unreadEstimate() == ring->capacity() / 2)
+      [[unlikely]] {
+    ProfilingSession::getGlobalInstace().wakeWriter();
+  }
+}
+
+void MeasureBuffer::aggregate(uint32_t location, uint64_t duration) noexcept {
+  if (!ring && !acquireRing()) [[unlikely]] {
+    ProfilingSession::getGlobalInstace().dropped.fetch_add(
+        1, std::memory_order_relaxed);
+    return;
+  }
+  ring->aggregate(location, duration);
+}
+
+bool MeasureBuffer::acquireRing() noexcept {
+  if (registrationFailed) {
+    return false;
+  }
   auto &sessionInst = ProfilingSession::getGlobalInstace();
-  if (!registered) {
-    threadId = sessionInst.allocateThreadId();
-    sessionInst.registerBuffer(this);
-    registered = true;
+  if (sessionInst.forkedSessionPending.load(std::memory_order_acquire))
+      [[unlikely]] {
+    sessionInst.startForkedSession();
+  }
+  const size_t capacity = sessionInst.ringCapacity();
+  if (!sessionInst.reserveRingMemory(capacity * sizeof(measure_t))) {
+    registrationFailed = true;
+    return false;
+  }
+  // The ring is not an allocation of the scope being measured
+  const scope_stack_t scopeStack = MeasureScope::tlsScopeStack;
+  ring = new MeasureRing(capacity);
+  ring->threadId = sessionInst.allocateThreadId();
+  if (!sessionInst.registerRing(ring)) {
+    sessionInst.releaseRingMemory(capacity * sizeof(measure_t));
+    delete ring;
+    ring = nullptr;
+    registrationFailed = true;
+    MeasureScope::tlsScopeStack = scopeStack;
+    return false;
+  }
+  std::string name = threadName;
+#if defined(__linux__)
+  char systemName[16];
+  if (name.empty() &&
+      pthread_getname_np(pthread_self(), systemName, sizeof(systemName)) == 0) {
+    name = systemName;
+  }
+#endif
+  sessionInst.registerThread(*ring, name);
+  MeasureScope::tlsScopeStack = scopeStack;
+  return true;
+}
+
+MeasureRing::~MeasureRing() noexcept {
+  for (auto &chunkSlot : histogramChunks) {
+    histogram_chunk_t *chunk = chunkSlot.load(std::memory_order_acquire);
+    if (!chunk) {
+      continue;
+    }
+    for (auto &histogram : chunk->histograms) {
+      delete histogram.load(std::memory_order_acquire);
+    }
+    delete chunk;
+  }
+}
+
+log_histogram::concurrent_t *
+MeasureRing::createHistogram(uint32_t location) noexcept {
+  if (location >= kHistogramChunkSize * kHistogramChunks) {
+    return nullptr;
+  }
+  // Same as the ring, histograms are not allocations of the measured scope
+  const scope_stack_t scopeStack = MeasureScope::tlsScopeStack;
+  auto &chunkSlot = histogramChunks[location / kHistogramChunkSize];
+  histogram_chunk_t *chunk = chunkSlot.load(std::memory_order_relaxed);
+  if (!chunk) {
+    chunk = new (std::nothrow) histogram_chunk_t();
+    chunkSlot.store(chunk, std::memory_order_release);
   }
-  m.threadId = threadId;
-  data[count++] = m;
-  if (count == kCapacity) {
-    sessionInst.flushBuffer(*this);
+  log_histogram::concurrent_t *histogram = nullptr;
+  if (chunk) {
+    histogram = new (std::nothrow) log_histogram::concurrent_t();
+    chunk->histograms[location % kHistogramChunkSize].store(
+        histogram, std::memory_order_release);
+  }
+  MeasureScope::tlsScopeStack = scopeStack;
+  return histogram;
+}
+
+const log_histogram::concurrent_t *
+MeasureRing::histogramAt(size_t location) const noexcept {
+  const histogram_chunk_t *chunk =
+      histogramChunks[location / kHistogramChunkSize].load(
+          std::memory_order_acquire);
+  return chunk ? chunk->histograms[location % kHistogramChunkSize].load(
+                     std::memory_order_acquire)
+               : nullptr;
+}
+
+void MeasureRing::copyRecent(std::vector<measure_t> &out) const {
+  const size_t h = head.load(std::memory_order_acquire);
+  const size_t first = h > capacity() ? h - capacity() : 0;
+  const size_t begin = out.size();
+  for (size_t i = first; i < h; i++) {
+    out.push_back(data[i & mask]);
+  }
+  // The owner may have overwritten the oldest slots while they were copied:
+  // with head at after, the slot of after - capacity() is being written.
+  std::atomic_thread_fence(std::memory_order_acquire);
+  const size_t after = head.load(std::memory_order_relaxed);
+  const size_t valid = after >= capacity() ? after - capacity() + 1 : 0;
+  if (valid > first) {
+    out.erase(out.begin() + begin,
+              out.begin() + begin + std::min(valid - first, h - first));
   }
 }
 
 MeasureBuffer::~MeasureBuffer() noexcept {
-  ProfilingSession::getGlobalInstace().retireBuffer(this);
+  if (ring) {
+    ring->retired.store(true, std::memory_order_release);
+    ring = nullptr;
+  }
 }
 
-void ProfilingSession::registerBuffer(MeasureBuffer *buf) noexcept {
-  std::scoped_lock lck(mtx);
-  buffers.push_back(buf);
+uint32_t ProfilingSession::registerLocation(const LocationID &loc) noexcept {
+  LocationID *const begin = registryBegin();
+  if (&loc >= begin && &loc < registryEnd()) {
+    const uint32_t id = (uint32_t)(&loc - begin);
+    loc.index.store(id, std::memory_order_relaxed);
+    return id;
+  }
+  std::scoped_lock lck(locationsMtx);
+  // Another thread may have registered it while waiting for the lock
+  uint32_t id = loc.index.load(std::memory_order_relaxed);
+  if (id != LocationID::kUnregistered) {
+    return id;
+  }
+  const size_t dynamicIndex =
+      dynamicLocationCount.load(std::memory_order_relaxed);
+  if (dynamicIndex == kDynamicLocationChunkSize * kDynamicLocationChunks) {
+    return LocationID::kUnregistered;
+  }
+  auto &chunkSlot = dynamicLocationChunks[dynamicIndex /
+                                          kDynamicLocationChunkSize];
+  dynamic_location_chunk_t *chunk = chunkSlot.load(std::memory_order_relaxed);
+  if (!chunk) {
+    chunk = new (std::nothrow) dynamic_location_chunk_t();
+    if (!chunk) {
+      return LocationID::kUnregistered;
+    }
+    chunkSlot.store(chunk, std::memory_order_release);
+  }
+  (*chunk)[dynamicIndex % kDynamicLocationChunkSize].store(
+      &loc, std::memory_order_relaxed);
+  dynamicLocationCount.store(dynamicIndex + 1, std::memory_order_release);
+  id = (uint32_t)(registrySize() + dynamicIndex);
+  applyLocationFilterLocked(id, loc);
+  loc.index.store(id, std::memory_order_relaxed);
+  return id;
+}
+
+const LocationID *ProfilingSession::locationAt(uint32_t index) noexcept {
+  const size_t registryCount = registrySize();
+  if (index < registryCount) {
+    return registryBegin() + index;
+  }
+  return dynamicLocationAt(index - registryCount);
+}
+
+// Lock free, nullptr past the locations registered so far
+const LocationID *
+ProfilingSession::dynamicLocationAt(size_t index) const noexcept {
+  if (index >= dynamicLocationCount.load(std::memory_order_acquire)) {
+    return nullptr;
+  }
+  const dynamic_location_chunk_t *chunk =
+      dynamicLocationChunks[index / kDynamicLocationChunkSize].load(
+          std::memory_order_acquire);
+  return (*chunk)[index % kDynamicLocationChunkSize].load(
+      std::memory_order_relaxed);
+}
+
+void ProfilingSession::assignRegistryIndices() noexcept {
+  LocationID *const begin = registryBegin();
+  for (size_t id = 0; id < registrySize(); id++) {
+    begin[id].index.store((uint32_t)id, std::memory_order_relaxed);
+  }
+}
+
+bool ProfilingSession::setLocationFilter(const std::string &filter) {
+  std::vector<location_filter::rule_t> rules;
+  if (!location_filter::parse(filter, rules)) {
+    return false;
+  }
+  std::scoped_lock lck(locationsMtx);
+  filterRules = std::move(rules);
+  // Whole words are stored, no location is briefly enabled or disabled by
+  // the update of another one
+  const size_t registryCount = registrySize();
+  const size_t count = std::min(
+      registryCount + dynamicLocationCount.load(std::memory_order_relaxed),
+      kFilteredLocations);
+  for (size_t first = 0; first < count; first += 64) {
+    uint64_t bits = 0;
+    for (size_t id = first; id < std::min(first + 64, count); id++) {
+      const LocationID *loc = id < registryCount
+                                  ? registryBegin() + id
+                                  : dynamicLocationAt(id - registryCount);
+      if (!location_filter::isEnabled(filterRules, loc->name, loc->file,
+                                      loc->function)) {
+        bits |= uint64_t(1) << (id % 64);
+      }
+    }
+    disabledLocations[first / 64].store(bits, std::memory_order_relaxed);
+  }
+  locationFiltering.store(!filterRules.empty(), std::memory_order_relaxed);
+  return true;
+}
+
+void ProfilingSession::applyLocationFilterLocked(
+    uint32_t id, const LocationID &loc) noexcept {
+  if (id >= kFilteredLocations) {
+    return;
+  }
+  const uint64_t bit = uint64_t(1) << (id % 64);
+  if (location_filter::isEnabled(filterRules, loc.name, loc.file,
+                                 loc.function)) {
+    disabledLocations[id / 64].fetch_and(~bit, std::memory_order_relaxed);
+  } else {
+    disabledLocations[id / 64].fetch_or(bit, std::memory_order_relaxed);
+  }
+}
+
+// Reads the control file now, so that its filter applies from the first
+// scope, then every filterPeriod on a thread of its own
+void ProfilingSession::startFilterWatcher() noexcept {
+  if (filterFile.empty()) {
+    return;
+  }
+  filterFilePresent = false;
+  filterFileContent.clear();
+  reloadFilterFile();
+  filterWatcherRunning.store(true, std::memory_order_release);
+  filterWatcher = std::thread(&ProfilingSession::filterWatcherLoop, this);
+}
+
+void ProfilingSession::stopFilterWatcher() noexcept {
+  filterWatcherRunning.store(false, std::memory_order_release);
+  if (filterWatcher.joinable()) {
+    filterWatcher.join();
+  }
+}
+
+// Files are compared by content, modification times are too coarse on some
+// file systems to see quick edits. A missing file restores the filter given
+// to initialize(), an invalid one keeps the current filter.
+void ProfilingSession::reloadFilterFile() noexcept {
+  std::string content;
+  std::unique_ptr<FILE, FileCloser> file(fopen(filterFile.c_str(), "r"));
+  if (file) {
+    char buffer[4096];
+    size_t size;
+    while ((size = fread(buffer, 1, sizeof(buffer), file.get())) > 0) {
+      content.append(buffer, size);
+    }
+  }
+  if (bool(file) == filterFilePresent && content == filterFileContent) {
+    return;
+  }
+  filterFilePresent = bool(file);
+  filterFileContent = content;
+  if (!setLocationFilter(filterFilePresent ? content : initialFilter)) {
+    fprintf(stderr, "profiler: invalid location filter in %s\n",
+            filterFile.c_str());
+  }
+}
+
+void ProfilingSession::filterWatcherLoop() noexcept {
+  auto lastCheck = std::chrono::steady_clock::now();
+  while (filterWatcherRunning.load(std::memory_order_acquire)) {
+    const auto checkTime = std::chrono::steady_clock::now();
+    if (checkTime - lastCheck >= filterPeriod) {
+      lastCheck = checkTime;
+      reloadFilterFile();
+    }
+    std::this_thread::sleep_for(
+        std::min<std::chrono::steady_clock::duration>(filterPeriod,
+                                                      kFilterWatcherStep));
+  }
+}
+
+void ProfilingSession::writeLocationTable(const std::string &folder,
+                                          const std::string &filename) noexcept {
+  std::unique_ptr<FILE, FileCloser> outIDMap(
+      fopen((folder + "/" + filename).c_str(), "w"));
+  if (!outIDMap) {
+    return;
+  }
+  std::string table;
+  appendLocationLines(table, 0, locationCount());
+  fputs(table.c_str(), outIDMap.get());
+}
+
+size_t ProfilingSession::locationCount() noexcept {
+  return registrySize() + dynamicLocationCount.load(std::memory_order_acquire);
+}
+
+// Lines of the location table for the indices in [first, last)
+void ProfilingSession::appendLocationLines(std::string &out, size_t first,
+                                           size_t last) noexcept {
+  for (size_t id = first; id < last; id++) {
+    const LocationID *loc = locationAt((uint32_t)id);
+    if (!loc) {
+      continue;
+    }
+    out += loc->file;
+    out += ';';
+    out += std::to_string(loc->line);
+    out += ';';
+    out += loc->function;
+    out += ';';
+    out += loc->name;
+    out += ';';
+    out += std::to_string(id);
+    out += '\n';
+  }
+}
+
+void ProfilingSession::publishLiveLocationsLocked() noexcept {
+  const size_t count = locationCount();
+  if (count == liveLocationCount) {
+    return;
+  }
+  std::string lines;
+  appendLocationLines(lines, liveLocationCount, count);
+  liveLocationCount = count;
+  liveLocations += lines;
+  liveStream->publishLocations(lines);
+}
+
+// Values of the ';' separated tables are kept on one line
+static std::string tableField(std::string value) {
+  std::replace_if(
+      value.begin(), value.end(),
+      [](char c) { return c == ';' || c == '\n' || c == '\r'; }, ' ');
+  return value;
+}
+
+void ProfilingSession::registerThread(MeasureRing &ring,
+                                      const std::string &name) {
+#if defined(__linux__)
+  const long tid = syscall(SYS_gettid);
+#else
+  const long tid = 0;
+#endif
+  ring.tid = tid;
+  const std::string field = tableField(name);
+  for (size_t i = 0; i < ring.name.size(); i++) {
+    ring.name[i].store(i < field.size() && i + 1 < ring.name.size() ? field[i]
+                                                                    : '\0',
+                       std::memory_order_relaxed);
+  }
+  std::scoped_lock lck(threadsMtx);
+  pendingThreads.push_back({ring.threadId, tid, name});
+}
+
+void ProfilingSession::setThreadName(const std::string &name) {
+  tlsMeasureBuffer.threadName = name;
+  if (tlsMeasureBuffer.ring) {
+    getGlobalInstace().registerThread(*tlsMeasureBuffer.ring, name);
+  }
+}
+
+// Appends the lines of the threads registered since the last call to the
+// thread table file and publishes them
+void ProfilingSession::writeThreadTableLocked() noexcept {
+  std::vector<thread_entry_t> registered;
+  {
+    std::scoped_lock lck(threadsMtx);
+    if (pendingThreads.empty()) {
+      return;
+    }
+    registered.swap(pendingThreads);
+  }
+  std::string lines;
+  for (thread_entry_t &thread : registered) {
+    lines += std::to_string(thread.threadId) + ";" +
+             std::to_string(thread.tid) + ";" + tableField(thread.name) + "\n";
+    threadEntries.push_back(std::move(thread));
+  }
+  threadLines += lines;
+  if (threadsFile) {
+    fputs(lines.c_str(), threadsFile.get());
+    // Complete on disk if the process crashes
+    fflush(threadsFile.get());
+  }
+  if (liveStream) {
+    liveStream->publishThreads(lines);
+  }
+}
+
+// Threads that registered in a previous session keep their ring and id, the
+// new file starts with all the lines known so far
+void ProfilingSession::openThreadsFileLocked() noexcept {
+  threadsFile.reset(
+      fopen((outFolder + "/" SESSION_THREADS_FILENAME).c_str(), "w"));
+  if (threadsFile) {
+    fputs(threadLines.c_str(), threadsFile.get());
+    fflush(threadsFile.get());
+  }
+}
+
+bool ProfilingSession::registerRing(MeasureRing *ring) noexcept {
+  for (size_t i = 0; i < kMaxThreads; i++) {
+    MeasureRing *expected = nullptr;
+    if (!rings[i].compare_exchange_strong(expected, ring,
+                                          std::memory_order_acq_rel)) {
+      continue;
+    }
+    size_t highWater = ringsHighWater.load(std::memory_order_relaxed);
+    while (highWater < i + 1 &&
+           !ringsHighWater.compare_exchange_weak(highWater, i + 1,
+                                                 std::memory_order_release)) {
+    }
+    return true;
+  }
+  return false;
+}
+
+size_t ProfilingSession::drainRingsLocked() noexcept {
+  size_t drained = 0;
+  const size_t highWater = ringsHighWater.load(std::memory_order_acquire);
+  for (size_t i = 0; i < highWater; i++) {
+    MeasureRing *ring = rings[i].load(std::memory_order_acquire);
+    if (!ring) {
+      continue;
+    }
+    // Read the retired flag before head so that a retired ring found empty
+    // is guaranteed to stay empty.
+    const bool retired = ring->retired.load(std::memory_order_acquire);
+    size_t t = ring->tail.load(std::memory_order_relaxed);
+    const size_t h = ring->head.load(std::memory_order_acquire);
+    // Flight recorder rings are only read by dump()
+    if (flightRecorderMode) {
+      t = h;
+    }
+    while (t != h) {
+      const size_t offset = t & ring->mask;
+      const size_t chunk = std::min(h - t, ring->capacity() - offset);
+      writeBlockLocked(ring->threadId, ring->data.get() + offset, chunk);
+      t += chunk;
+      drained += chunk;
+      // Published per block, the crash handler writes from tail on
+      ring->tail.store(t, std::memory_order_release);
+    }
+    const uint64_t ringDropped = ring->dropped.load(std::memory_order_relaxed);
+    dropped.fetch_add(ringDropped - ring->droppedReported,
+                      std::memory_order_relaxed);
+    ring->droppedReported = ringDropped;
+    if (retired) {
+      rings[i].store(nullptr, std::memory_order_release);
+      mergeRetiredHistogramsLocked(*ring);
+      ringBytes.fetch_sub(ring->capacity() * sizeof(measure_t),
+                          std::memory_order_relaxed);
+      delete ring;
+    }
+  }
+  return drained;
+}
+
+void ProfilingSession::mergeRetiredHistogramsLocked(const MeasureRing &ring) {
+  for (size_t c = 0; c < MeasureRing::kHistogramChunks; c++) {
+    if (!ring.histogramChunks[c].load(std::memory_order_acquire)) {
+      continue;
+    }
+    for (size_t j = 0; j < MeasureRing::kHistogramChunkSize; j++) {
+      const size_t location = c * MeasureRing::kHistogramChunkSize + j;
+      const log_histogram::concurrent_t *histogram = ring.histogramAt(location);
+      if (!histogram) {
+        continue;
+      }
+      if (retiredHistograms.size() <= location) {
+        retiredHistograms.resize(location + 1);
+      }
+      retiredHistograms[location].merge(*histogram);
+    }
+  }
+}
+
+std::vector<location_stats_t> ProfilingSession::snapshot() {
+  std::vector<log_histogram::merged_t> merged;
+  {
+    std::scoped_lock lck(mtx);
+    // Without a writer thread retired rings are only reaped here
+    if (!writer.joinable()) {
+      const sink_section_t section;
+      if (section.entered) {
+        drainRingsLocked();
+      }
+    }
+    merged = retiredHistograms;
+    merged.resize(std::max(merged.size(), locationCount()));
+    const size_t highWater = ringsHighWater.load(std::memory_order_acquire);
+    for (size_t i = 0; i < highWater; i++) {
+      const MeasureRing *ring = rings[i].load(std::memory_order_acquire);
+      if (!ring) {
+        continue;
+      }
+      for (size_t location = 0; location < merged.size(); location++) {
+        if (const auto *histogram = ring->histogramAt(location)) {
+          merged[location].merge(*histogram);
+        }
+      }
+    }
+  }
+
+  std::vector<location_stats_t> stats;
+  const double nsPerTick = 1.0 / clockTicksPerNs;
+  for (size_t location = 0; location < merged.size(); location++) {
+    const log_histogram::merged_t &histogram = merged[location];
+    const LocationID *loc = locationAt((uint32_t)location);
+    if (histogram.count == 0 || !loc) {
+      continue;
+    }
+    stats.push_back({
+        .location = loc,
+        .count = histogram.count,
+        .total = histogram.sum * nsPerTick,
+        .min = histogram.min * nsPerTick,
+        .max = histogram.max * nsPerTick,
+        .mean = (double)histogram.sum / histogram.count * nsPerTick,
+        .p50 = histogram.percentile(0.50) * nsPerTick,
+        .p90 = histogram.percentile(0.90) * nsPerTick,
+        .p99 = histogram.percentile(0.99) * nsPerTick,
+        .p999 = histogram.percentile(0.999) * nsPerTick,
+    });
+  }
+  return stats;
+}
+
+void ProfilingSession::wakeWriter() noexcept {
+  if (!writerSleeping.load(std::memory_order_seq_cst)) {
+    return;
+  }
+  std::scoped_lock lck(writerWakeMtx);
+  writerWakeRequested = true;
+  writerWake.notify_one();
+}
+
+// The writer backs off while the rings stay empty, up to kWriterMaxIdlePeriod.
+// A ring filling up wakes it early, see MeasureBuffer::push().
+void ProfilingSession::writerLoop() noexcept {
+  std::chrono::microseconds idlePeriod = kWriterMinIdlePeriod;
+  while (writerRunning.load(std::memory_order_acquire)) {
+    size_t drained;
+    {
+      std::scoped_lock lck(mtx);
+      const sink_section_t section;
+      if (!section.entered) {
+        return;
+      }
+      if (liveStream) {
+        liveStream->poll(liveInfo, liveLocations, threadLines);
+      }
+      writeThreadTableLocked();
+      drained = drainRingsLocked();
+    }
+    if (drained != 0) {
+      idlePeriod = kWriterMinIdlePeriod;
+      continue;
+    }
+    std::unique_lock lck(writerWakeMtx);
+    writerSleeping.store(true, std::memory_order_seq_cst);
+    writerWake.wait_for(lck, idlePeriod, [this] {
+      return writerWakeRequested ||
+             !writerRunning.load(std::memory_order_acquire);
+    });
+    writerSleeping.store(false, std::memory_order_relaxed);
+    idlePeriod = writerWakeRequested
+                     ? kWriterMinIdlePeriod
+                     : std::min<std::chrono::microseconds>(
+                           idlePeriod * 2, kWriterMaxIdlePeriod);
+    writerWakeRequested = false;
+  }
+}
+
+static void appendVarints(std::vector<uint8_t> &buffer,
+                          std::initializer_list<uint64_t> values) {
+  uint8_t encoded[5 * session_encoding::kMaxVarintSize];
+  uint8_t *end = encoded;
+  for (uint64_t value : values) {
+    end = session_encoding::putVarint(end, value);
+  }
+  buffer.insert(buffer.end(), encoded, end);
+}
+
+// Encodes the records of count measures at out, which must hold
+// count * kMaxRecordSize bytes. Returns the end of the records.
+static uint8_t *encodeRecords(const measure_t *data, size_t count,
+                              uint8_t *out) noexcept {
+  using namespace session_encoding;
+  int64_t previousTime = data[0].time;
+  for (size_t i = 0; i < count; i++) {
+    const measure_t &m = data[i];
+    out = putVarint(out, zigzag(m.time - previousTime));
+    previousTime = m.time;
+    if (m.kind != RecordKind::Scope) {
+      out = putVarint(out, ((uint64_t)m.location << 1) | 1);
+      out = putVarint(out, (uint64_t)m.kind);
+      out = putVarint(out, zigzag(m.value));
+      if (isLock(m.kind)) {
+        out = putVarint(out, m.instance);
+      }
+      continue;
+    }
+    out = putVarint(out, (uint64_t)m.location << 1);
+    out = putVarint(out, zigzag(m.value));
+    out = putVarint(out, m.depth);
+    out = putVarint(out, m.parent == measure_t::kNoParent
+                             ? 0
+                             : (uint64_t)m.parent + 1);
+  }
+  return out;
+}
+
+// The header is encoded in front of the payload, which must follow at least
+// kMaxBlockHeaderSize bytes of its buffer, so that the block can be written
+// with a single call. Returns the start of the block.
+static uint8_t *prependBlockHeader(const session_encoding::block_header_t &header,
+                                   uint8_t *payload) noexcept {
+  uint8_t encoded[session_encoding::kMaxBlockHeaderSize];
+  const size_t size = putBlockHeader(encoded, header) - encoded;
+  memcpy(payload - size, encoded, size);
+  return payload - size;
+}
+
+// Encodes count measures as one uncompressed block in buffer, which must
+// hold kMaxBlockHeaderSize + count * kMaxRecordSize bytes. Returns the size
+// of the block, starting at block. Doesn't allocate, so the crash handler can
+// use it.
+static size_t encodeBlock(uint64_t threadId, const measure_t *data,
+                          size_t count, uint8_t *buffer,
+                          uint8_t *&block) noexcept {
+  using namespace session_encoding;
+  uint8_t *const payload = buffer + kMaxBlockHeaderSize;
+  const uint8_t *const end = encodeRecords(data, count, payload);
+  block = prependBlockHeader({.threadId = threadId,
+                              .baseTime = data[0].time,
+                              .count = count,
+                              .payloadSize = (uint64_t)(end - payload)},
+                             payload);
+  return end - block;
+}
+
+// A block that would take the segment past maxSegmentBytes starts a new one,
+// and is split if it doesn't fit in an empty segment either. A single record
+// is written anyway.
+void ProfilingSession::writeBlockLocked(uint64_t threadId,
+                                        const measure_t *data,
+                                        size_t count) noexcept {
+  using namespace session_encoding;
+  if (!session || count == 0) {
+    return;
+  }
+  if (rotation.enabled() && segmentExpiredLocked()) {
+    rotateLocked();
+  }
+  blockBuffer.resize(kMaxBlockHeaderSize + count * kMaxRecordSize);
+  uint8_t *payload = blockBuffer.data() + kMaxBlockHeaderSize;
+  block_header_t header{.threadId = threadId,
+                        .baseTime = data[0].time,
+                        .count = count,
+                        .payloadSize = (uint64_t)(
+                            encodeRecords(data, count, payload) - payload)};
+  if (blockCodec != BlockCodec::None) {
+    compressedBuffer.resize(
+        kMaxBlockHeaderSize +
+        block_compression::compressBound(blockCodec, header.payloadSize));
+    uint8_t *const compressed = compressedBuffer.data() + kMaxBlockHeaderSize;
+    const size_t compressedSize = block_compression::compress(
+        blockCodec, payload, header.payloadSize, compressed);
+    // Blocks that don't shrink are written as they are
+    if (compressedSize != 0) {
+      header.codec = blockCodec;
+      header.rawSize = header.payloadSize;
+      header.payloadSize = compressedSize;
+      payload = compressed;
+    }
+  }
+  uint8_t *const block = prependBlockHeader(header, payload);
+  const size_t size = payload + header.payloadSize - block;
+
+  const size_t locations = locationCount();
+  if (rotation.maxSegmentBytes != 0 && !segmentFitsLocked(locations, size)) {
+    if (segmentBytes > sessionHead.size()) {
+      rotateLocked();
+    }
+    if (count > 1 && !segmentFitsLocked(locations, size)) {
+      writeBlockLocked(threadId, data, count / 2);
+      writeBlockLocked(threadId, data + count / 2, count - count / 2);
+      return;
+    }
+  }
+  writeLocationDefinitionsLocked(locations);
+  if (liveStream) {
+    // Locations go out before the blocks that use them, table messages are
+    // never dropped
+    publishLiveLocationsLocked();
+  }
+  writeLocked(block, size);
+  if (liveStream) {
+    liveStream->publishBlock(block, size, count);
+  }
+}
+
+// Encodes the block defining the locations [definedLocationCount, count) in
+// block, empty if there is none
+void ProfilingSession::encodeLocationDefinitionsLocked(
+    size_t count, std::vector<uint8_t> &block) noexcept {
+  using namespace session_encoding;
+  block.clear();
+  if (count == definedLocationCount) {
+    return;
+  }
+  std::vector<uint8_t> payload;
+  uint64_t defined = 0;
+  for (size_t id = definedLocationCount; id < count; id++) {
+    const LocationID *loc = locationAt((uint32_t)id);
+    if (!loc) {
+      continue;
+    }
+    appendVarints(payload, {id, loc->line});
+    for (std::string_view value : {std::string_view(loc->file),
+                                   std::string_view(loc->function),
+                                   std::string_view(loc->name)}) {
+      appendVarints(payload, {value.size()});
+      payload.insert(payload.end(), value.begin(), value.end());
+    }
+    defined++;
+  }
+  block.resize(kMaxBlockHeaderSize);
+  block.resize(putBlockHeader(block.data(),
+                              {.threadId = kDefinitionsThreadId,
+                               .baseTime = 0,
+                               .count = defined,
+                               .payloadSize = payload.size()}) -
+               block.data());
+  block.insert(block.end(), payload.begin(), payload.end());
+}
+
+// Defines the locations registered before count in the session file, so
+// that any prefix of it can be decoded. Live clients get them as table lines
+// instead, see publishLiveLocationsLocked().
+void ProfilingSession::writeLocationDefinitionsLocked(size_t count) noexcept {
+  encodeLocationDefinitionsLocked(count, definitionsBuffer);
+  writeLocked(definitionsBuffer.data(), definitionsBuffer.size());
+  definedLocationCount = count;
+}
+
+void ProfilingSession::writeLocked(const void *data, size_t size) noexcept {
+  if (!session || size == 0) {
+    return;
+  }
+  session->write(data, size);
+  segmentBytes += size;
+}
+
+// Opens the session file, or the current segment of a rotated session, and
+// writes the preamble
+bool ProfilingSession::openSessionFileLocked() noexcept {
+  const std::string filename = rotation.enabled()
+                                   ? sessionSegmentFilename(segmentIndex)
+                                   : SESSION_FILENAME;
+  session = openSessionSink(sinkType, outFolder + "/" + filename, sinkOptions);
+  if (!session) {
+    return false;
+  }
+  segmentStart = std::chrono::steady_clock::now();
+  if (rotation.enabled()) {
+    segments.push_back(segmentIndex);
+  }
+  startSessionFileLocked();
+  return true;
 }
 
-void ProfilingSession::retireBuffer(MeasureBuffer *buf) noexcept {
+// Every file starts with the preamble and header and defines its own
+// locations
+void ProfilingSession::startSessionFileLocked() noexcept {
+  segmentBytes = 0;
+  definedLocationCount = 0;
+  writeLocked(sessionHead.data(), sessionHead.size());
+}
+
+// Appends the sections and the trailer (see encoding.hpp): the location and
+// thread tables and the session info, so that the file can be read on its
+// own
+void ProfilingSession::finishSessionFileLocked(
+    const std::string &dumpReason) noexcept {
+  using namespace session_encoding;
+  if (!session) {
+    return;
+  }
+  const uint64_t blocksEnd = segmentBytes;
+  std::vector<section_t> sections{{SectionKind::Blocks, sessionHead.size(),
+                                   blocksEnd - sessionHead.size()}};
+  std::vector<uint8_t> out;
+  appendTableSectionsLocked(blocksEnd, locationCount(), out, sections);
+  const std::string info = sessionInfo(dumpReason);
+  sections.push_back({SectionKind::Info, blocksEnd + out.size(), info.size()});
+  out.insert(out.end(), info.begin(), info.end());
+
+  const uint64_t indexOffset = blocksEnd + out.size();
+  appendVarints(out, {sections.size()});
+  for (const section_t &section : sections) {
+    appendVarints(out, {(uint64_t)section.kind, section.offset, section.size});
+  }
+  uint8_t trailer[kTrailerSize];
+  putTrailer(trailer, indexOffset);
+  out.insert(out.end(), trailer, trailer + sizeof(trailer));
+  writeLocked(out.data(), out.size());
+}
+
+// Appends the string, location and thread tables to out, which starts at
+// offset in the file, and their sections to sections
+void ProfilingSession::appendTableSectionsLocked(
+    uint64_t offset, size_t locationsEnd, std::vector<uint8_t> &out,
+    std::vector<session_encoding::section_t> &sections) noexcept {
+  using namespace session_encoding;
+  const auto appendSection = [&](SectionKind kind, uint64_t count,
+                                 const std::vector<uint8_t> &entries) {
+    const uint64_t start = offset + out.size();
+    appendVarints(out, {count});
+    out.insert(out.end(), entries.begin(), entries.end());
+    sections.push_back({kind, start, offset + out.size() - start});
+  };
+
+  // Every distinct string is stored once
+  std::vector<std::string_view> strings;
+  std::unordered_map<std::string_view, uint64_t> stringIndices;
+  const auto stringIndex = [&](std::string_view value) {
+    const auto [it, inserted] =
+        stringIndices.try_emplace(value, strings.size());
+    if (inserted) {
+      strings.push_back(value);
+    }
+    return it->second;
+  };
+  std::vector<uint8_t> locations;
+  uint64_t locationEntries = 0;
+  for (size_t id = 0; id < locationsEnd; id++) {
+    const LocationID *loc = locationAt((uint32_t)id);
+    if (!loc) {
+      continue;
+    }
+    appendVarints(locations, {id, loc->line, stringIndex(loc->file),
+                           stringIndex(loc->function), stringIndex(loc->name)});
+    locationEntries++;
+  }
+  std::vector<uint8_t> threads;
+  for (const thread_entry_t &thread : threadEntries) {
+    appendVarints(threads, {thread.threadId, zigzag(thread.tid),
+                         stringIndex(thread.name)});
+  }
+  std::vector<uint8_t> stringTable;
+  for (std::string_view value : strings) {
+    appendVarints(stringTable, {value.size()});
+    stringTable.insert(stringTable.end(), value.begin(), value.end());
+  }
+  appendSection(SectionKind::Strings, strings.size(), stringTable);
+  appendSection(SectionKind::Locations, locationEntries, locations);
+  appendSection(SectionKind::Threads, threadEntries.size(), threads);
+}
+
+bool ProfilingSession::segmentExpiredLocked() const noexcept {
+  return rotation.maxSegmentAge.count() != 0 &&
+         std::chrono::steady_clock::now() - segmentStart >=
+             rotation.maxSegmentAge;
+}
+
+// Whether the definitions of the locations before locationsEnd and a block
+// of blockSize bytes fit in the segment, along with the sections closing it.
+// The tables are only encoded again when locations or threads were added.
+bool ProfilingSession::segmentFitsLocked(size_t locationsEnd,
+                                         size_t blockSize) noexcept {
+  using namespace session_encoding;
+  // Threads registered since the last drain are in the closing sections too
+  writeThreadTableLocked();
+  if (locationsEnd != tablesLocationCount ||
+      threadEntries.size() != tablesThreadCount) {
+    std::vector<uint8_t> tables;
+    std::vector<section_t> sections;
+    appendTableSectionsLocked(0, locationsEnd, tables, sections);
+    tablesSize = tables.size();
+    tablesLocationCount = locationsEnd;
+    tablesThreadCount = threadEntries.size();
+  }
+  encodeLocationDefinitionsLocked(locationsEnd, definitionsBuffer);
+  // Index of the blocks, the tables and the info sections
+  constexpr size_t kMaxIndexSize = (1 + 5 * 3) * kMaxVarintSize;
+  // The count of dropped measures in the info may grow until the segment is
+  // closed
+  constexpr size_t kMaxDroppedInfoSize = sizeof("dropped_measures;\n") + 20;
+  const uint64_t closingSize = tablesSize + sessionInfo().size() +
+                               kMaxDroppedInfoSize + kMaxIndexSize +
+                               kTrailerSize;
+  return segmentBytes + definitionsBuffer.size() + blockSize + closingSize <=
+         rotation.maxSegmentBytes;
+}
+
+void ProfilingSession::rotateLocked() noexcept {
+  writeThreadTableLocked();
+  finishSessionFileLocked();
+  session.reset();
+  writeLocationTable(outFolder, segmentLocationsFilename(segmentIndex));
+  segmentIndex++;
+  if (!openSessionFileLocked()) {
+    perror("profiler: session segment");
+    return;
+  }
+  while (rotation.maxSegments != 0 && segments.size() > rotation.maxSegments) {
+    const uint64_t oldest = segments.front();
+    segments.pop_front();
+    std::remove((outFolder + "/" + sessionSegmentFilename(oldest)).c_str());
+    std::remove((outFolder + "/" + segmentLocationsFilename(oldest)).c_str());
+  }
+}
+
+// Removes the segments a previous session left in folder
+static void removeSessionSegments(const std::string &folder) {
+  std::error_code error;
+  for (const auto &entry :
+       std::filesystem::directory_iterator(folder, error)) {
+    const std::string name = entry.path().filename().string();
+    // The names are rebuilt from the parsed index to match them exactly
+    uint64_t index;
+    if ((sscanf(name.c_str(), "profiler_session.%" SCNu64, &index) == 1 &&
+         name == sessionSegmentFilename(index)) ||
+        (sscanf(name.c_str(), "measures_id_map.%" SCNu64, &index) == 1 &&
+         name == segmentLocationsFilename(index))) {
+      std::filesystem::remove(entry.path(), error);
+    }
+  }
+}
+
+// Aggregate mode only folds durations into the histograms of the rings,
+// nothing is pushed to them
+size_t ProfilingSession::ringCapacity() const noexcept {
+  if (aggregateMode) {
+    return 1;
+  }
+  return flightRecorderMode ? flightRingCapacity : recordingRingCapacity;
+}
+
+bool ProfilingSession::reserveRingMemory(size_t bytes) noexcept {
+  if (!flightRecorderMode) {
+    // Not bounded, and mtx may be held by the writer during I/O
+    ringBytes.fetch_add(bytes, std::memory_order_relaxed);
+    return true;
+  }
   std::scoped_lock lck(mtx);
-  writeLocked(buf->data.data(), buf->count);
-  buf->count = 0;
-  buffers.erase(std::remove(buffers.begin(), buffers.end(), buf),
-               buffers.end());
+  if (ringBytes.load(std::memory_order_relaxed) + bytes > flightBudget) {
+    // Rings of exited threads are kept for dump() until their memory is
+    // needed
+    const sink_section_t section;
+    if (!section.entered) {
+      return false;
+    }
+    drainRingsLocked();
+    if (ringBytes.load(std::memory_order_relaxed) + bytes > flightBudget) {
+      return false;
+    }
+  }
+  ringBytes.fetch_add(bytes, std::memory_order_relaxed);
+  return true;
+}
+
+void ProfilingSession::releaseRingMemory(size_t bytes) noexcept {
+  ringBytes.fetch_sub(bytes, std::memory_order_relaxed);
 }
 
-void ProfilingSession::flushBuffer(MeasureBuffer &buf) noexcept {
+std::string ProfilingSession::dump(const std::string &reason) {
   std::scoped_lock lck(mtx);
-  writeLocked(buf.data.data(), buf.count);
-  buf.count = 0;
+  const sink_section_t section;
+  if (!initialized || !flightRecorderMode || !section.entered) {
+    return {};
+  }
+  const int64_t dumpTicks = now() - initializationTicks;
+
+  char stamp[32];
+  const time_t wallTime = time(nullptr);
+  tm localTime;
+  localtime_r(&wallTime, &localTime);
+  strftime(stamp, sizeof(stamp), "%Y%m%d_%H%M%S", &localTime);
+  const std::string folder = outFolder + "/flight_" + stamp + "_" +
+                             std::to_string(dumpCount++);
+  std::error_code error;
+  std::filesystem::create_directories(folder, error);
+  if (error) {
+    return {};
+  }
+
+  // Dumps are small and written once, the default sink is enough
+  session = openSessionSink(SinkType::Stdio, folder + "/" SESSION_FILENAME,
+                            SinkOptions());
+  if (!session) {
+    return {};
+  }
+  startSessionFileLocked();
+
+  std::vector<measure_t> recent;
+  const size_t highWater = ringsHighWater.load(std::memory_order_acquire);
+  for (size_t i = 0; i < highWater; i++) {
+    const MeasureRing *ring = rings[i].load(std::memory_order_acquire);
+    if (!ring) {
+      continue;
+    }
+    recent.clear();
+    ring->copyRecent(recent);
+    if (flightWindowTicks > 0) {
+      std::erase_if(recent, [&](const measure_t &m) {
+        const int64_t end = session_encoding::isInterval(m.kind)
+                                ? m.time + m.value
+                                : m.time;
+        return end < dumpTicks - flightWindowTicks;
+      });
+    }
+    for (size_t offset = 0; offset < recent.size();
+         offset += kDumpBlockRecords) {
+      writeBlockLocked(ring->threadId, recent.data() + offset,
+                       std::min(recent.size() - offset, kDumpBlockRecords));
+    }
+  }
+  writeThreadTableLocked();
+  finishSessionFileLocked(reason);
+  session.reset();
+
+  writeSessionInfo(folder, reason);
+  writeLocationTable(folder);
+  std::unique_ptr<FILE, FileCloser> threads(
+      fopen((folder + "/" SESSION_THREADS_FILENAME).c_str(), "w"));
+  if (threads) {
+    fputs(threadLines.c_str(), threads.get());
+  }
+  return folder;
 }
 
-void ProfilingSession::writeLocked(const measure_t *data,
-                                   size_t count) noexcept {
-  if (!session || count == 0) {
+void ProfilingSession::startDumpThread(int signal) noexcept {
+#if defined(__unix__)
+  if (!openDumpPipe()) {
+    return;
+  }
+  struct sigaction action {};
+  action.sa_handler = onDumpSignal;
+  sigemptyset(&action.sa_mask);
+  action.sa_flags = SA_RESTART;
+  if (sigaction(signal, &action, &previousDumpAction) != 0) {
+    ::close(dumpPipe[0]);
+    ::close(dumpPipe[1]);
+    dumpPipe[0] = dumpPipe[1] = -1;
+    return;
+  }
+  dumpSignal = signal;
+  runDumpThread();
+#else
+  (void)signal;
+#endif
+}
+
+void ProfilingSession::runDumpThread() noexcept {
+#if defined(__unix__)
+  dumpThread = std::thread([this] {
+    char request;
+    for (;;) {
+      const ssize_t size = ::read(dumpPipe[0], &request, 1);
+      if (size == -1 && errno == EINTR) {
+        continue;
+      }
+      if (size != 1 || request != DumpNow) {
+        return;
+      }
+      dump("signal");
+    }
+  });
+#endif
+}
+
+void ProfilingSession::stopDumpThread() noexcept {
+#if defined(__unix__)
+  if (!dumpThread.joinable()) {
+    return;
+  }
+  sigaction(dumpSignal, &previousDumpAction, nullptr);
+  const char request = StopDumpThread;
+  [[maybe_unused]] const ssize_t written = ::write(dumpPipe[1], &request, 1);
+  dumpThread.join();
+  ::close(dumpPipe[0]);
+  ::close(dumpPipe[1]);
+  dumpPipe[0] = dumpPipe[1] = -1;
+  dumpSignal = 0;
+#endif
+}
+
+void ProfilingSession::installCrashHandler() noexcept {
+#if defined(__unix__)
+  using namespace session_encoding;
+  crashBuffer.resize(kMaxBlockHeaderSize + kDumpBlockRecords * kMaxRecordSize);
+  updateCrashPaths();
+
+  stack_t currentStack;
+  if (sigaltstack(nullptr, &currentStack) == 0 &&
+      (currentStack.ss_flags & SS_DISABLE)) {
+    stack_t stack{};
+    stack.ss_sp = crashStack;
+    stack.ss_size = sizeof(crashStack);
+    sigaltstack(&stack, nullptr);
+  }
+  struct sigaction action {};
+  action.sa_handler = onCrashSignal;
+  sigemptyset(&action.sa_mask);
+  action.sa_flags = SA_ONSTACK;
+  for (size_t i = 0; i < std::size(kCrashSignals); i++) {
+    sigaction(kCrashSignals[i], &action, &previousCrashActions[i]);
+  }
+  crashing.store(false);
+  crashHandlerInstalled = true;
+#endif
+}
+
+void ProfilingSession::updateCrashPaths() noexcept {
+  crashSessionPath = outFolder + "/" SESSION_CRASH_FILENAME;
+  crashLocationsPath = outFolder + "/" SESSION_ID_MAP_FILENAME;
+  crashInfoPath = outFolder + "/" SESSION_INFO_FILENAME;
+  crashThreadsPath = outFolder + "/" SESSION_THREADS_FILENAME;
+}
+
+void ProfilingSession::uninstallCrashHandler() noexcept {
+#if defined(__unix__)
+  if (!crashHandlerInstalled) {
     return;
   }
-  fwrite(data, sizeof(measure_t), count, session.get());
+  for (size_t i = 0; i < std::size(kCrashSignals); i++) {
+    sigaction(kCrashSignals[i], &previousCrashActions[i], nullptr);
+  }
+  crashHandlerInstalled = false;
+#endif
+}
+
+void ProfilingSession::onCrashSignal(int signal) {
+#if defined(__unix__)
+  const int savedErrno = errno;
+  // A second crash, possibly inside the dump itself, goes straight to the
+  // previous handler
+  if (!crashing.exchange(true)) {
+    getGlobalInstace().writeCrashDump(signal);
+  }
+  for (size_t i = 0; i < std::size(kCrashSignals); i++) {
+    if (kCrashSignals[i] == signal) {
+      sigaction(signal, &previousCrashActions[i], nullptr);
+    }
+  }
+  errno = savedErrno;
+  raise(signal);
+#else
+  (void)signal;
+#endif
+}
+
+// Runs in the signal handler: only async-signal-safe calls, no allocation.
+void ProfilingSession::writeCrashDump(int signal) noexcept {
+#if defined(__unix__)
+  using namespace session_encoding;
+  // crashing is already set, the other threads stop at their next
+  // enterSink() and no longer free rings or use the sink under us. The
+  // crashing thread may be the one holding the sink: no ring is freed then,
+  // but the sink may be in the middle of a write and is left alone.
+  writerRunning.store(false, std::memory_order_release);
+  const bool crashedInSink = tlsInSink;
+  bool sinkIdle = false;
+  for (int attempt = 0;
+       attempt < 100 && !crashedInSink &&
+       !(sinkIdle = !sinkBusy.load(std::memory_order_seq_cst));
+       attempt++) {
+    const timespec pause{.tv_sec = 0, .tv_nsec = 1000000};
+    nanosleep(&pause, nullptr);
+  }
+  // Otherwise a thread still holding the sink may free rings under us
+  const bool ringsStable = sinkIdle || crashedInSink;
+  if (sinkIdle && session) {
+    session->crashFlush();
+    // Drops what the sink allocated ahead, e.g. the tail of the Mmap sink
+    if (session->fd() >= 0) {
+      [[maybe_unused]] const int res =
+          ftruncate(session->fd(), session->committedSize());
+    }
+  }
+
+  const int sessionFd =
+      ringsStable ? open(crashSessionPath.c_str(),
+                         O_WRONLY | O_CREAT | O_TRUNC | O_CLOEXEC, 0644)
+                  : -1;
+  if (sessionFd >= 0) {
+    writeAll(sessionFd, sessionHead.data(), sessionHead.size());
+    const size_t highWater = ringsHighWater.load(std::memory_order_acquire);
+    for (size_t i = 0; i < highWater; i++) {
+      const MeasureRing *ring = rings[i].load(std::memory_order_acquire);
+      if (!ring) {
+        continue;
+      }
+      size_t t = ring->tail.load(std::memory_order_acquire);
+      const size_t h = ring->head.load(std::memory_order_acquire);
+      while (t != h) {
+        const size_t offset = t & ring->mask;
+        const size_t chunk =
+            std::min({h - t, ring->capacity() - offset, kDumpBlockRecords});
+        uint8_t *block;
+        const size_t size = encodeBlock(ring->threadId, ring->data.get() + offset,
+                                        chunk, crashBuffer.data(), block);
+        writeAll(sessionFd, block, size);
+        t += chunk;
+      }
+    }
+    ::close(sessionFd);
+  }
+
+  // Same content as writeLocationTable(). Locations registered by other
+  // threads during the dump may be missed.
+  crash_writer_t locations(open(crashLocationsPath.c_str(),
+                                O_WRONLY | O_CREAT | O_TRUNC | O_CLOEXEC,
+                                0644));
+  if (locations.fd >= 0) {
+    const auto writeLocation = [&](const LocationID &loc, size_t id) {
+      locations.put(loc.file);
+      locations.put(';');
+      locations.put((uint64_t)loc.line);
+      locations.put(';');
+      locations.put(loc.function);
+      locations.put(';');
+      locations.put(loc.name);
+      locations.put(';');
+      locations.put((uint64_t)id);
+      locations.put('\n');
+    };
+    LocationID *const begin = registryBegin();
+    const size_t registryCount = registrySize();
+    for (size_t id = 0; id < registryCount; id++) {
+      writeLocation(begin[id], id);
+    }
+    const size_t dynamicCount =
+        dynamicLocationCount.load(std::memory_order_acquire);
+    for (size_t i = 0; i < dynamicCount; i++) {
+      writeLocation(*dynamicLocationAt(i), registryCount + i);
+    }
+    locations.flush();
+    ::close(locations.fd);
+  }
+
+  // Appended to the lines already written, so that the threads registered
+  // since the last pass of the writer are known. The last line of a thread
+  // wins.
+  crash_writer_t threads(
+      ringsStable ? open(crashThreadsPath.c_str(),
+                         O_WRONLY | O_CREAT | O_APPEND | O_CLOEXEC, 0644)
+                  : -1);
+  if (threads.fd >= 0) {
+    const size_t highWater = ringsHighWater.load(std::memory_order_acquire);
+    for (size_t i = 0; i < highWater; i++) {
+      const MeasureRing *ring = rings[i].load(std::memory_order_acquire);
+      if (!ring) {
+        continue;
+      }
+      threads.put(ring->threadId);
+      threads.put(';');
+      threads.put((uint64_t)ring->tid);
+      threads.put(';');
+      for (const auto &c : ring->name) {
+        const char value = c.load(std::memory_order_relaxed);
+        if (value == '\0') {
+          break;
+        }
+        threads.put(value);
+      }
+      threads.put('\n');
+    }
+    threads.flush();
+    ::close(threads.fd);
+  }
+
+  crash_writer_t info(
+      open(crashInfoPath.c_str(), O_WRONLY | O_APPEND | O_CLOEXEC));
+  if (info.fd >= 0) {
+    info.put("crash_signal;");
+    info.put((uint64_t)signal);
+    info.put('\n');
+    // Including the drops the writer has not counted yet
+    uint64_t droppedCount = dropped.load(std::memory_order_relaxed);
+    const size_t highWater =
+        ringsStable ? ringsHighWater.load(std::memory_order_acquire) : 0;
+    for (size_t i = 0; i < highWater; i++) {
+      if (const MeasureRing *ring = rings[i].load(std::memory_order_acquire)) {
+        droppedCount += ring->dropped.load(std::memory_order_relaxed) -
+                        ring->droppedReported;
+      }
+    }
+    if (droppedCount != 0) {
+      info.put("dropped_measures;");
+      info.put(droppedCount);
+      info.put('\n');
+    }
+    info.flush();
+    ::close(info.fd);
+  }
+#else
+  (void)signal;
+#endif
+}
+
+// The session lock is held across fork() so that the child inherits the
+// rings, the sink and the location table in a consistent state.
+void ProfilingSession::onForkPrepare() {
+  ProfilingSession &sessionInst = getGlobalInstace();
+  if (!sessionInst.initialized) {
+    return;
+  }
+  sessionInst.mtx.lock();
+  sessionInst.locationsMtx.lock();
+  sessionInst.threadsMtx.lock();
+  sessionInst.forkLocked = true;
+}
+
+void ProfilingSession::onForkParent() {
+  ProfilingSession &sessionInst = getGlobalInstace();
+  if (!sessionInst.forkLocked) {
+    return;
+  }
+  sessionInst.forkLocked = false;
+  sessionInst.threadsMtx.unlock();
+  sessionInst.locationsMtx.unlock();
+  sessionInst.mtx.unlock();
+}
+
+// Only the forking thread exists in the child. Everything inherited from the
+// parent is dropped without being written: the measures in the rings, the
+// buffered session data and the live clients are the parent's. The child's
+// own session is opened in a process folder once it records something, see
+// startForkedSession(), so that a fork followed by exec leaves nothing
+// behind.
+void ProfilingSession::onForkChild() {
+#if defined(__unix__)
+  ProfilingSession &sessionInst = getGlobalInstace();
+  if (!sessionInst.forkLocked) {
+    return;
+  }
+  sessionInst.forkLocked = false;
+  // Only marks the rings and the sink as being freed for a crash of the
+  // child, nothing can be crashing yet
+  const sink_section_t section;
+  // The parent's threads don't exist here, their handles can't be joined
+  new (&sessionInst.writer) std::thread();
+  sessionInst.writerRunning.store(false, std::memory_order_relaxed);
+  // The writer may have been waiting, with the mutex in any state
+  new (&sessionInst.writerWakeMtx) std::mutex();
+  new (&sessionInst.writerWake) std::condition_variable();
+  sessionInst.writerSleeping.store(false, std::memory_order_relaxed);
+  sessionInst.writerWakeRequested = false;
+  if (sessionInst.filterWatcher.joinable()) {
+    new (&sessionInst.filterWatcher) std::thread();
+  }
+  sessionInst.filterWatcherRunning.store(false, std::memory_order_relaxed);
+  if (sessionInst.dumpThread.joinable()) {
+    new (&sessionInst.dumpThread) std::thread();
+    ::close(dumpPipe[0]);
+    ::close(dumpPipe[1]);
+    dumpPipe[0] = dumpPipe[1] = -1;
+  }
+
+  const size_t highWater =
+      sessionInst.ringsHighWater.load(std::memory_order_relaxed);
+  for (size_t i = 0; i < highWater; i++) {
+    delete sessionInst.rings[i].exchange(nullptr, std::memory_order_relaxed);
+  }
+  sessionInst.ringsHighWater.store(0, std::memory_order_relaxed);
+  sessionInst.ringBytes.store(0, std::memory_order_relaxed);
+  sessionInst.dropped.store(0, std::memory_order_relaxed);
+  sessionInst.retiredHistograms.clear();
+  tlsMeasureBuffer.ring = nullptr;
+  tlsMeasureBuffer.registrationFailed = false;
+
+  if (sessionInst.session) {
+    sessionInst.session->abandon();
+    sessionInst.session.reset();
+  }
+  if (sessionInst.liveStream) {
+    sessionInst.liveStream->abandon();
+    sessionInst.liveStream.reset();
+  }
+  sessionInst.liveLocations.clear();
+  sessionInst.liveLocationCount = 0;
+  // Flushed after every write, closing it doesn't write anything
+  sessionInst.threadsFile.reset();
+  sessionInst.threadLines.clear();
+  sessionInst.threadEntries.clear();
+  sessionInst.pendingThreads.clear();
+
+  sessionInst.parentPid = (int)getppid();
+  sessionInst.outFolder =
+      sessionInst.rootFolder + "/" + processFolderName((int)getpid());
+  sessionInst.dumpCount = 0;
+  sessionInst.forkedSessionPending.store(true, std::memory_order_release);
+  sessionInst.threadsMtx.unlock();
+  sessionInst.locationsMtx.unlock();
+  sessionInst.mtx.unlock();
+#endif
+}
+
+// Opens the session of a forked child in its process folder. The child
+// keeps the clock calibration and the time origin of the parent, so the
+// timelines of all the processes share the same time base.
+void ProfilingSession::startForkedSession() noexcept {
+#if defined(__unix__)
+  std::scoped_lock lck(mtx);
+  const sink_section_t section;
+  if (!forkedSessionPending.load(std::memory_order_relaxed) ||
+      !section.entered) {
+    return;
+  }
+  forkedSessionPending.store(false, std::memory_order_relaxed);
+  startFilterWatcher();
+  if (aggregateMode) {
+    return;
+  }
+  std::error_code error;
+  std::filesystem::create_directories(outFolder, error);
+  if (flightRecorderMode) {
+    if (dumpSignal != 0 && openDumpPipe()) {
+      runDumpThread();
+    }
+    return;
+  }
+
+  segmentIndex = 0;
+  segments.clear();
+  if (!openSessionFileLocked()) {
+    perror("profiler: forked session");
+    return;
+  }
+  openThreadsFileLocked();
+  writeSessionInfo(outFolder);
+  if (!liveSocketPath.empty()) {
+    // The parent keeps the socket path
+    liveStream = LiveStream::open(
+        liveSocketPath + "." + std::to_string(getpid()), liveClientQueue,
+        sessionHead);
+    if (liveStream) {
+      liveInfo = sessionInfo();
+    }
+  }
+  if (crashHandlerInstalled) {
+    updateCrashPaths();
+  }
+  writerRunning.store(true, std::memory_order_release);
+  writer = std::thread(&ProfilingSession::writerLoop, this);
+#endif
 }
 
 uint64_t ProfilingSession::allocateThreadId() noexcept {
@@ -92,54 +1900,294 @@ ProfilingSession &ProfilingSession::getGlobalInstace() noexcept {
   static ProfilingSession session;
   return session;
 }
-void ProfilingSession::initialize(const std::string &_outFolder) {
+void ProfilingSession::initialize(const std::string &_outFolder,
+                                  const SessionConfig &config) {
+  if (initialized) {
+    close();
+  }
   outFolder = _outFolder;
+  rootFolder = _outFolder;
+  parentPid = 0;
+  aggregateMode = config.aggregate;
+  flightRecorderMode = config.flightRecorder && !aggregateMode;
+  // Nothing is streamed in these modes
+  const bool recording = !aggregateMode && !flightRecorderMode;
 
-  session = std::unique_ptr<FILE, FileCloser>(
-      fopen((outFolder + "/" SESSION_FILENAME).c_str(), "wb"));
-  if (!session) {
-    return;
+  blockCodec = block_compression::isAvailable(config.compression)
+                   ? config.compression
+                   : session_encoding::BlockCodec::Lz;
+  activeClock = profiler_clock::isSupported(config.clock)
+                    ? config.clock
+                    : ClockSource::SteadyClock;
+  clockTicksPerNs = profiler_clock::calibrateTicksPerNs(activeClock);
+  initializationTicks = now();
+  startWallNs = std::chrono::duration_cast<std::chrono::nanoseconds>(
+                    std::chrono::system_clock::now().time_since_epoch())
+                    .count();
+  sessionHead.resize(session_encoding::kPreambleSize +
+                     session_encoding::kMaxSessionHeaderSize);
+  const uint8_t *const headEnd = session_encoding::putSessionHeader(
+      session_encoding::putPreamble(sessionHead.data()),
+      {.byteOrder = std::endian::native == std::endian::little
+                        ? session_encoding::ByteOrder::LittleEndian
+                        : session_encoding::ByteOrder::BigEndian,
+       .clock = (uint8_t)activeClock,
+       .ticksPerNs = clockTicksPerNs,
+       .startWallNs = startWallNs,
+       .recordKinds = session_encoding::kRecordKinds});
+  sessionHead.resize(headEnd - sessionHead.data());
+
+  if (recording) {
+    // Left over by a previous session that crashed
+    std::remove((outFolder + "/" SESSION_CRASH_FILENAME).c_str());
+    sinkType = config.sink;
+    sinkOptions = config.sinkOptions;
+    rotation = config.rotation;
+    segmentIndex = 0;
+    segments.clear();
+    // Segments of a previous rotated session in the same folder would mix
+    // with this one
+    removeSessionSegments(outFolder);
+    if (rotation.enabled()) {
+      std::remove((outFolder + "/" SESSION_FILENAME).c_str());
+    }
+    if (!openSessionFileLocked()) {
+      return;
+    }
+    openThreadsFileLocked();
+  }
+
+  activePerfMode = config.perfCounters && !aggregateMode
+                       ? perf_counters::probe()
+                       : PerfCounterMode::Disabled;
+  cpuTracking = config.trackCpuMigrations && !aggregateMode;
+  contextSwitchTracking = config.trackContextSwitches && !aggregateMode;
+  assignRegistryIndices();
+
+  const char *filter = getenv("PROFILER_LOCATION_FILTER");
+  initialFilter = filter ? filter : config.locationFilter;
+  if (!setLocationFilter(initialFilter)) {
+    fprintf(stderr, "profiler: invalid location filter \"%s\"\n",
+            initialFilter.c_str());
+    initialFilter.clear();
+    setLocationFilter(initialFilter);
+  }
+  const char *controlFile = getenv("PROFILER_LOCATION_FILTER_FILE");
+  filterFile = controlFile ? controlFile : config.locationFilterFile;
+  filterPeriod = config.locationFilterPeriod;
+
+  recordingRingCapacity =
+      std::bit_ceil(std::max<size_t>(config.recordsPerThread, 2));
+  if (flightRecorderMode) {
+    flightRingCapacity = std::bit_ceil(
+        std::max<size_t>(config.flightRecorderRecordsPerThread, 2));
+    flightBudget = config.flightRecorderBudget;
+    flightWindowTicks =
+        (int64_t)(config.flightRecorderWindow.count() * clockTicksPerNs);
   }
-  setvbuf(session.get(), nullptr, _IOFBF, kSessionBufferSize);
+
   initialized = true;
-  initializationTime = std::chrono::steady_clock::now();
+  ownOverheadNs = 0.0;
+  nestedOverheadNs = 0.0;
+  if (config.calibrateOverhead && !aggregateMode) {
+    calibrateOverhead();
+  }
+  if (recording) {
+    writeSessionInfo(outFolder);
+  }
+
+  if (recording && !config.liveSocket.empty()) {
+    liveSocketPath = config.liveSocket;
+    liveClientQueue = config.liveClientQueue;
+    liveStream = LiveStream::open(config.liveSocket, config.liveClientQueue,
+                                  sessionHead);
+    if (!liveStream) {
+      perror("profiler: live socket");
+    } else {
+      liveInfo = sessionInfo();
+    }
+  }
+  if (recording) {
+    writerRunning.store(true, std::memory_order_release);
+    writer = std::thread(&ProfilingSession::writerLoop, this);
+  }
+  if (flightRecorderMode && config.flightRecorderSignal != 0) {
+    startDumpThread(config.flightRecorderSignal);
+  }
+  startFilterWatcher();
+  if (recording && config.crashHandler) {
+    installCrashHandler();
+  }
+#if defined(__unix__)
+  if (!forkHandlersInstalled) {
+    pthread_atfork(onForkPrepare, onForkParent, onForkChild);
+    forkHandlersInstalled = true;
+  }
+#endif
+}
+
+// Times MeasureScope with the clock and options of the session, on a thread
+// of its own whose measures go to a private ring that is never drained. Only
+// that thread records, the session stays disabled for the others. Every cost
+// is the lowest of several rounds, preemption only slows rounds down.
+void ProfilingSession::calibrateOverhead() {
+  static constexpr size_t kScopes = 1024;
+  static constexpr size_t kChildren = 8;
+  static constexpr int kRounds = 16;
+  // Accepted by MeasureScope, never written to the location table
+  LocationID calibration("profiler_calibration");
+  calibration.index.store(LocationID::kUnregistered - 1,
+                          std::memory_order_relaxed);
+
+  std::thread([&] {
+    // Room for every record of a round, migrations included
+    MeasureRing ring(std::bit_ceil(2 * kScopes * (kChildren + 1)));
+    tlsMeasureBuffer.ring = &ring;
+    MeasureScope::tlsScopeStack.forceEnabled = true;
+    int64_t recorded = INT64_MAX;
+    int64_t scopes = INT64_MAX;
+    int64_t nestedScopes = INT64_MAX;
+    for (int round = 0; round < kRounds; round++) {
+      int64_t start = now();
+      for (size_t i = 0; i < kScopes; i++) {
+        MeasureScope scope(calibration);
+      }
+      scopes = std::min(scopes, now() - start);
+      // What the empty scopes recorded as their own duration
+      int64_t durations = 0;
+      const size_t head = ring.head.load(std::memory_order_relaxed);
+      for (size_t i = ring.tail.load(std::memory_order_relaxed); i != head;
+           i++) {
+        const measure_t &measure = ring.data[i & ring.mask];
+        if (measure.kind == session_encoding::RecordKind::Scope) {
+          durations += measure.value;
+        }
+      }
+      recorded = std::min(recorded, durations);
+      ring.tail.store(head, std::memory_order_relaxed);
+
+      start = now();
+      for (size_t i = 0; i < kScopes; i++) {
+        MeasureScope scope(calibration);
+        for (size_t j = 0; j < kChildren; j++) {
+          MeasureScope child(calibration);
+        }
+      }
+      nestedScopes = std::min(nestedScopes, now() - start);
+      ring.tail.store(ring.head.load(std::memory_order_relaxed),
+                      std::memory_order_relaxed);
+    }
+    tlsMeasureBuffer.ring = nullptr;
+    MeasureScope::tlsScopeStack.forceEnabled = false;
+
+    const double ticksToNs = 1.0 / (clockTicksPerNs * kScopes);
+    ownOverheadNs = recorded * ticksToNs;
+    nestedOverheadNs =
+        std::max<int64_t>(nestedScopes - scopes, 0) * ticksToNs / kChildren;
+  }).join();
 }
 
 ProfilingSession::~ProfilingSession() {
 	close();
+  for (auto &chunkSlot : dynamicLocationChunks) {
+    delete chunkSlot.load(std::memory_order_relaxed);
+  }
 }
 
 void ProfilingSession::close() {
-  if (!session) {
-    return;
-  }
 	if (!initialized) {
 		return;
 	}
+  uninstallCrashHandler();
+  stopDumpThread();
+  stopFilterWatcher();
+  writerRunning.store(false, std::memory_order_release);
+  {
+    std::scoped_lock lck(writerWakeMtx);
+    writerWake.notify_one();
+  }
+  if (writer.joinable()) {
+    writer.join();
+  }
   {
     std::scoped_lock lck(mtx);
-    for (MeasureBuffer *buf : buffers) {
-      writeLocked(buf->data.data(), buf->count);
-      buf->count = 0;
-      buf->registered = false;
+    const sink_section_t section;
+    if (section.entered) {
+      drainRingsLocked();
+      writeThreadTableLocked();
+      finishSessionFileLocked();
     }
-    buffers.clear();
+    threadsFile.reset();
+    liveStream.reset();
+    liveSocketPath.clear();
+    liveInfo.clear();
+    liveLocations.clear();
+    liveLocationCount = 0;
   }
-  std::unique_ptr<FILE, FileCloser> outIDMap(
-      fopen((outFolder + "/" SESSION_ID_MAP_FILENAME).c_str(), "w"));
-  if (!outIDMap) {
-    return;
-  }
-  for (const auto &[location, id] : locationIDMap) {
-    fprintf(outIDMap.get(), "%s;%" PRIu64 "\n", location.c_str(), id);
+  if (session) {
+    // Rewritten with the count of dropped measures
+    writeSessionInfo(outFolder);
+    writeLocationTable(outFolder);
+    if (rotation.enabled()) {
+      writeLocationTable(outFolder, segmentLocationsFilename(segmentIndex));
+    }
   }
+  rotation = RotationPolicy();
 	session.reset();
-	outIDMap.reset();
+	activePerfMode = PerfCounterMode::Disabled;
+	cpuTracking = false;
+	contextSwitchTracking = false;
+	aggregateMode = false;
+	flightRecorderMode = false;
+	forkedSessionPending.store(false, std::memory_order_relaxed);
 	initialized = false;
 	amIEnabled = false;
-	initializationTime = time_point();
+	initializationTicks = 0;
+}
+
+void ProfilingSession::writeSessionInfo(const std::string &folder,
+                                        const std::string &dumpReason) noexcept {
+  std::unique_ptr<FILE, FileCloser> info(
+      fopen((folder + "/" SESSION_INFO_FILENAME).c_str(), "w"));
+  if (!info) {
+    return;
+  }
+  fputs(sessionInfo(dumpReason).c_str(), info.get());
+}
+
+std::string ProfilingSession::sessionInfo(const std::string &dumpReason) const {
+  char ticksPerNs[64];
+  snprintf(ticksPerNs, sizeof(ticksPerNs), "%.12f", clockTicksPerNs);
+  std::string info;
+  info += "clock;" + std::string(profiler_clock::name(activeClock)) + "\n";
+  info += "ticks_per_ns;" + std::string(ticksPerNs) + "\n";
+  info += "perf_counters;" + std::string(perf_counters::name(activePerfMode)) +
+          "\n";
+#if defined(__unix__)
+  info += "pid;" + std::to_string(getpid()) + "\n";
+  if (parentPid != 0) {
+    info += "parent_pid;" + std::to_string(parentPid) + "\n";
+  }
+#endif
+  if (ownOverheadNs != 0.0 || nestedOverheadNs != 0.0) {
+    char overhead[128];
+    snprintf(overhead, sizeof(overhead),
+             "scope_overhead_ns;%.3f\nnested_scope_overhead_ns;%.3f\n",
+             ownOverheadNs, nestedOverheadNs);
+    info += overhead;
+  }
+  if (const uint64_t droppedCount = droppedMeasures()) {
+    info += "dropped_measures;" + std::to_string(droppedCount) + "\n";
+  }
+  if (!dumpReason.empty()) {
+    info += "dump_reason;" + tableField(dumpReason) + "\n";
+  }
+  return info;
 }
 
 void ProfilingSession::enable() { amIEnabled = true; }
+uint64_t ProfilingSession::droppedMeasures() const noexcept {
+  return dropped.load(std::memory_order_relaxed);
+}
 void ProfilingSession::disable() { amIEnabled = false; }
 bool ProfilingSession::enabled() const { return amIEnabled; }
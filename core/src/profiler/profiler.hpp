@@ -1,14 +1,33 @@
 #pragma once
 
+#include <algorithm>
 #include <array>
 #include <atomic>
 #include <chrono>
+#include <condition_variable>
+#include <csignal>
 #include <cstdint>
-#include <map>
+#include <deque>
 #include <memory>
 #include <mutex>
+#include <string>
+#include <string_view>
+#include <thread>
+#include <type_traits>
 #include <vector>
 
+#if defined(__linux__)
+#include <sched.h>
+#endif
+
+#include "clock.hpp"
+#include "encoding.hpp"
+#include "histogram.hpp"
+#include "live_stream.hpp"
+#include "location_filter.hpp"
+#include "perf_counters.hpp"
+#include "session_sink.hpp"
+
 #if __has_include(<experimental/source_location>)
 #include <experimental/source_location>
 namespace std {
@@ -25,6 +44,27 @@ using time_point = std::chrono::steady_clock::time_point;
 
 #define SESSION_FILENAME "profiler_session.bin"
 #define SESSION_ID_MAP_FILENAME "measures_id_map.csv"
+#define SESSION_INFO_FILENAME "session_info.csv"
+// Measures still in the rings when the process crashed, see
+// SessionConfig::crashHandler
+#define SESSION_CRASH_FILENAME "profiler_session.crash.bin"
+// Metadata of the recording threads, one "threadId;tid;name" line per
+// registration or rename, the last line of a thread wins
+#define SESSION_THREADS_FILENAME "threads.csv"
+
+// Files of segment index of a rotated session, see RotationPolicy
+inline std::string sessionSegmentFilename(uint64_t index) {
+  return "profiler_session." + std::to_string(index) + ".bin";
+}
+inline std::string segmentLocationsFilename(uint64_t index) {
+  return "measures_id_map." + std::to_string(index) + ".csv";
+}
+
+// Folder of the session of a child process forked after initialize(),
+// inside the output folder
+inline std::string processFolderName(int pid) {
+  return "process_" + std::to_string(pid);
+}
 
 struct FileCloser {
   void operator()(FILE *file) const {
@@ -34,43 +74,308 @@ struct FileCloser {
   }
 };
 
+#if defined(__ELF__)
+// Locations defined with PROFILER_LOCATION are gathered by the linker in this
+// section and enumerated at initialize() through the __start_/__stop_ symbols.
+#define PROFILER_LOCATION_SECTION                                              \
+  __attribute__((section("profiler_locations"), used))
+#else
+#define PROFILER_LOCATION_SECTION
+#endif
+
+// Defines a constant initialized location, no guard and no registration work
+// at runtime.
+#define PROFILER_LOCATION(var, name)                                           \
+  PROFILER_LOCATION_SECTION static constinit LocationID var(name)
+
+// Categories of MEASURE_SCOPE_CAT removed from the build, separated by
+// commas or semicolons. Set by the PROFILER_DISABLED_CATEGORIES CMake option.
+#ifndef PROFILER_DISABLED_CATEGORIES
+#define PROFILER_DISABLED_CATEGORIES ""
+#endif
+
+namespace profiler_categories {
+
+constexpr bool isEnabled(std::string_view category) noexcept {
+  std::string_view disabled = PROFILER_DISABLED_CATEGORIES;
+  while (!disabled.empty()) {
+    const size_t end = disabled.find_first_of(",;");
+    std::string_view entry = disabled.substr(0, end);
+    entry.remove_prefix(std::min(entry.find_first_not_of(' '), entry.size()));
+    entry = entry.substr(0, entry.find_last_not_of(' ') + 1);
+    if (entry == category) {
+      return false;
+    }
+    disabled = end == std::string_view::npos ? std::string_view()
+                                             : disabled.substr(end + 1);
+  }
+  return true;
+}
+
+} // namespace profiler_categories
+
 #if ENABLE_PROFILING == true
 #define MEASURE_SCOPE(instance_name)                                           \
-  static LocationID locId(#instance_name);                                     \
-  MeasureScope instance_name(locId);
+  PROFILER_LOCATION(instance_name##Location, #instance_name);                  \
+  MeasureScope instance_name(instance_name##Location);
+// MEASURE_SCOPE tagged with a category, an identifier. Scopes of a disabled
+// category (see PROFILER_DISABLED_CATEGORIES) leave nothing in the build: the
+// call site is an empty constant, the location is only defined in the branch
+// of the enabled categories and the scope is an empty object.
+#define MEASURE_SCOPE_CAT(instance_name, category)                             \
+  [[maybe_unused]] constexpr CategorySite<profiler_categories::isEnabled(      \
+      #category)>                                                              \
+      instance_name##Site{};                                                   \
+  [[maybe_unused]] CategoryScope<profiler_categories::isEnabled(#category)>    \
+      instance_name(                                                           \
+          [&instance_name##Site](auto enabled) -> const LocationID * {         \
+            if constexpr (decltype(enabled)::value) {                          \
+              PROFILER_LOCATION_SECTION static constinit LocationID location(  \
+                  #instance_name, instance_name##Site.loc);                    \
+              return &location;                                                \
+            } else {                                                           \
+              return nullptr;                                                  \
+            }                                                                  \
+          }(std::bool_constant<profiler_categories::isEnabled(#category)>()));
+#define MEASURE_COUNTER(counter_name, value)                                   \
+  do {                                                                         \
+    PROFILER_LOCATION(counter_name##Location, #counter_name);                  \
+    ProfilingSession::recordCounter(counter_name##Location, (value));          \
+  } while (0)
+#define MEASURE_GAUGE(gauge_name, value)                                       \
+  do {                                                                         \
+    PROFILER_LOCATION(gauge_name##Location, #gauge_name);                      \
+    ProfilingSession::recordGauge(gauge_name##Location, (value));              \
+  } while (0)
 #else
 #define MEASURE_SCOPE(instance_name)
+#define MEASURE_SCOPE_CAT(instance_name, category)
+#define MEASURE_COUNTER(counter_name, value)
+#define MEASURE_GAUGE(gauge_name, value)
 #endif
 
+class AsyncSpan;
 class LocationID;
 class MeasureBuffer;
+class MeasureRing;
 
+// In memory representation of a measure, see encoding.hpp for the on disk
+// format.
 struct measure_t {
   int64_t time;
-  uint64_t id;
-  int64_t duration;
-  uint64_t threadId;
+  // Duration of scopes, sample of counters and gauges
+  int64_t value;
+  uint32_t location;
+  // Location of the enclosing scope on the same thread, kNoParent if none
+  uint32_t parent;
+  union {
+    // Of scopes
+    uint32_t depth;
+    // Of the ProfiledMutex, for lock records
+    uint32_t instance;
+  };
+  session_encoding::RecordKind kind;
+
+  static constexpr uint32_t kNoParent = UINT32_MAX;
+};
+
+// Splits the session file in numbered segments. Every segment starts with
+// the preamble and defines the locations it uses, so it can be read on its
+// own. Zero disables a limit.
+struct RotationPolicy {
+  // Segments are closed before a block would take them past this size,
+  // blocks that don't fit in an empty segment are split
+  uint64_t maxSegmentBytes = 0;
+  std::chrono::seconds maxSegmentAge{0};
+  // Oldest segments are deleted beyond this count
+  size_t maxSegments = 0;
+
+  bool enabled() const noexcept {
+    return maxSegmentBytes != 0 || maxSegmentAge.count() != 0;
+  }
+};
+
+struct SessionConfig {
+  ClockSource clock = ClockSource::SteadyClock;
+  SinkType sink = SinkType::Stdio;
+  SinkOptions sinkOptions;
+  RotationPolicy rotation;
+  // Records each thread buffers until the writer drains them, rounded up to
+  // a power of two. Measures recorded while the ring of their thread is full
+  // are dropped, and their count is saved in the session info. So are the
+  // measures of the threads left without a ring, past the first 1024 threads
+  // or flightRecorderBudget.
+  size_t recordsPerThread = 1 << 14;
+  // Compress every block of measures on the writer thread, trading its CPU
+  // time for disk bandwidth. Zstd falls back to Lz when the profiler is
+  // built without zstd. Crash dumps are not compressed.
+  session_encoding::BlockCodec compression = session_encoding::BlockCodec::None;
+  // Record performance counter deltas of every scope, using hardware counters
+  // when accessible and software ones otherwise
+  bool perfCounters = false;
+  // Read the CPU at the start and end of every scope and record the scopes
+  // that migrated. Linux only.
+  bool trackCpuMigrations = false;
+  // Record the context switches of every scope, read with getrusage at its
+  // start and end: two system calls per scope, even when perfCounters reads
+  // the hardware counters without any. Linux only.
+  bool trackContextSwitches = false;
+  // Measure the cost of MeasureScope at initialize() (a few milliseconds)
+  // and save it in the session info, so the plotter can subtract it.
+  // Ignored in aggregate mode.
+  bool calibrateOverhead = true;
+  // Instead of recording every scope, keep per thread histograms of the
+  // scope durations, queried with ProfilingSession::snapshot(). Nothing is
+  // written to disk in this mode and the other records are discarded.
+  bool aggregate = false;
+  // Handle SIGSEGV, SIGBUS, SIGFPE, SIGILL and SIGABRT by writing the
+  // measures not drained yet and the location table before handing the
+  // signal to the previous handler. Only in the default recording mode.
+  bool crashHandler = false;
+  // Path of a Unix domain socket publishing the session while it is
+  // recorded, for the plotter "Connect to live process" mode. Empty to
+  // disable. The session file is written as usual.
+  std::string liveSocket;
+  // Bytes queued for each live client, blocks that don't fit are dropped
+  // for that client
+  size_t liveClientQueue = 8 << 20;
+
+  // Flight recorder: every thread keeps only its most recent records in an
+  // overwrite-oldest ring and nothing is written until dump() is called.
+  // Ignored in aggregate mode.
+  bool flightRecorder = false;
+  // Memory of all the flight recorder rings together. Threads registering
+  // once the budget is used up are not recorded.
+  size_t flightRecorderBudget = 64 << 20;
+  // Records kept by each thread, rounded up to a power of two
+  size_t flightRecorderRecordsPerThread = 1 << 15;
+  // Only records that ended within this window before dump() are written,
+  // zero to write whatever the rings hold
+  std::chrono::nanoseconds flightRecorderWindow{0};
+  // Signal that triggers dump("signal"), 0 to not install a handler
+#if defined(SIGUSR2)
+  int flightRecorderSignal = SIGUSR2;
+#else
+  int flightRecorderSignal = 0;
+#endif
+
+  // Locations to record, see location_filter.hpp. Empty to record them all.
+  // Overridden by the PROFILER_LOCATION_FILTER environment variable.
+  std::string locationFilter;
+  // File holding a filter, checked every locationFilterPeriod while the
+  // session is open and applied whenever it changes. Empty to disable.
+  // Overridden by the PROFILER_LOCATION_FILTER_FILE environment variable.
+  std::string locationFilterFile;
+  std::chrono::milliseconds locationFilterPeriod{1000};
+};
+
+// Aggregated durations of one location, in nanoseconds.
+struct location_stats_t {
+  const LocationID *location;
+  uint64_t count;
+  double total;
+  double min;
+  double max;
+  double mean;
+  double p50;
+  double p90;
+  double p99;
+  double p999;
 };
 
 class ProfilingSession {
 private:
-  void addMeasure(const LocationID &loc, const time_point &start,
-                  const time_point &end) noexcept;
-
-  void addLocation(const char *name, const source_loc &loc,
-                   const uint64_t &id) noexcept {
-    const std::string sstr = std::string(loc.file_name()) + ";" +
-                             std::to_string(loc.line()) + ";" +
-                             loc.function_name() + ";" + name;
-    locationIDMap[sstr] = id;
-  }
+  void addMeasure(uint32_t location, int64_t start, int64_t end,
+                  uint32_t parent, uint32_t depth) noexcept;
+  void addSample(session_encoding::RecordKind kind, uint32_t location,
+                 int64_t value) noexcept;
+  void addScopeAllocations(uint32_t location, int64_t start, uint64_t count,
+                           uint64_t bytes) noexcept;
+  void addLockInterval(session_encoding::RecordKind kind, uint32_t location,
+                       uint32_t instance, int64_t start, int64_t end) noexcept;
+  void addScopePerfCounters(uint32_t location, int64_t start,
+                            PerfCounterMode mode,
+                            const perf_counters::sample_t &begin,
+                            const perf_counters::sample_t &end) noexcept;
+  void addScopeMigration(uint32_t location, int64_t start, int startCpu,
+                         int endCpu) noexcept;
+  void addScopeContextSwitches(uint32_t location, int64_t start,
+                               int64_t count) noexcept;
+
+  uint32_t registerLocation(const LocationID &loc) noexcept;
+  const LocationID *locationAt(uint32_t index) noexcept;
+  const LocationID *dynamicLocationAt(size_t index) const noexcept;
+  void assignRegistryIndices() noexcept;
+  void writeLocationTable(
+      const std::string &folder,
+      const std::string &filename = SESSION_ID_MAP_FILENAME) noexcept;
+  size_t locationCount() noexcept;
+  void appendLocationLines(std::string &out, size_t first,
+                           size_t last) noexcept;
+  void publishLiveLocationsLocked() noexcept;
 
-  void registerBuffer(MeasureBuffer *buf) noexcept;
-  void retireBuffer(MeasureBuffer *buf) noexcept;
-  void flushBuffer(MeasureBuffer &buf) noexcept;
-  void writeLocked(const measure_t *data, size_t count) noexcept;
+  bool registerRing(MeasureRing *ring) noexcept;
+  void registerThread(MeasureRing &ring, const std::string &name);
+  void writeThreadTableLocked() noexcept;
+  void openThreadsFileLocked() noexcept;
+  void wakeWriter() noexcept;
+  void writerLoop() noexcept;
+  size_t drainRingsLocked() noexcept;
+  void mergeRetiredHistogramsLocked(const MeasureRing &ring);
+  void writeBlockLocked(uint64_t threadId, const measure_t *data,
+                        size_t count) noexcept;
+  void encodeLocationDefinitionsLocked(size_t count,
+                                       std::vector<uint8_t> &block) noexcept;
+  void writeLocationDefinitionsLocked(size_t count) noexcept;
+  void writeLocked(const void *data, size_t size) noexcept;
+  void startSessionFileLocked() noexcept;
+  bool openSessionFileLocked() noexcept;
+  void finishSessionFileLocked(const std::string &dumpReason = "") noexcept;
+  void appendTableSectionsLocked(
+      uint64_t offset, size_t locationsEnd, std::vector<uint8_t> &out,
+      std::vector<session_encoding::section_t> &sections) noexcept;
+  bool segmentExpiredLocked() const noexcept;
+  bool segmentFitsLocked(size_t locationsEnd, size_t blockSize) noexcept;
+  void rotateLocked() noexcept;
   uint64_t allocateThreadId() noexcept;
+  size_t ringCapacity() const noexcept;
+  bool reserveRingMemory(size_t bytes) noexcept;
+  void releaseRingMemory(size_t bytes) noexcept;
+  void startDumpThread(int signal) noexcept;
+  void stopDumpThread() noexcept;
+  void installCrashHandler() noexcept;
+  void uninstallCrashHandler() noexcept;
+  void writeCrashDump(int signal) noexcept;
+  void updateCrashPaths() noexcept;
+  static void onCrashSignal(int signal);
+  void runDumpThread() noexcept;
+  void applyLocationFilterLocked(uint32_t id, const LocationID &loc) noexcept;
+  void startFilterWatcher() noexcept;
+  void stopFilterWatcher() noexcept;
+  void reloadFilterFile() noexcept;
+  void filterWatcherLoop() noexcept;
 
+  // The session flag, or the override of the calling thread set by
+  // calibrateOverhead()
+  static bool isThreadEnabled() noexcept;
+  static bool isLocationEnabled(uint32_t location) noexcept {
+    if (!locationFiltering.load(std::memory_order_relaxed)) [[likely]] {
+      return true;
+    }
+    return location >= kFilteredLocations ||
+           !((disabledLocations[location / 64].load(
+                  std::memory_order_relaxed) >>
+              (location % 64)) &
+             1);
+  }
+
+  // pthread_atfork handlers, see startForkedSession()
+  static void onForkPrepare();
+  static void onForkParent();
+  static void onForkChild();
+  void startForkedSession() noexcept;
+
+  friend class AsyncSpan;
   friend class MeasureScope;
   friend class LocationID;
   friend class MeasureBuffer;
@@ -79,81 +384,501 @@ private:
 public:
   ~ProfilingSession();
 
-  void initialize(const std::string &outFolder);
+  void initialize(const std::string &outFolder,
+                  const SessionConfig &config = SessionConfig());
 
   void enable();
   void disable();
   bool enabled() const;
 	void close();
 
+  // Records only the locations enabled by filter (see location_filter.hpp),
+  // the ones registered later included, until the next call or the next
+  // initialize(). Scopes of disabled locations don't read the clock. Returns
+  // false, keeping the current filter, if filter is invalid. Locations with
+  // an index of kFilteredLocations or more are always recorded.
+  static constexpr size_t kFilteredLocations = 1 << 16;
+  bool setLocationFilter(const std::string &filter);
+
+  // Whether the records of loc are kept: the session is enabled and the
+  // location filter doesn't disable it.
+  static bool isRecorded(const LocationID &loc) noexcept;
+
+  // Number of measures discarded because a thread's ring was full.
+  uint64_t droppedMeasures() const noexcept;
+
+  // Merges the histograms of every thread, see SessionConfig::aggregate.
+  // Histograms cover the whole process lifetime, threads that exited
+  // included.
+  std::vector<location_stats_t> snapshot();
+
+  // Writes the rings of every thread to a new session folder inside the
+  // output folder, see SessionConfig::flightRecorder. The reason is saved
+  // in the session info. Returns the folder, empty if nothing was written.
+  std::string dump(const std::string &reason);
+
   static ProfilingSession &getGlobalInstace() noexcept;
 
+  // Name of the calling thread in the session, instead of the one given to
+  // pthread_setname_np when the thread first recorded something.
+  static void setThreadName(const std::string &name);
+
+  // Timestamped numeric samples, see MEASURE_COUNTER and MEASURE_GAUGE.
+  // Counter samples are increments, gauge samples are absolute values.
+  static void recordCounter(const LocationID &loc, int64_t increment) noexcept;
+  static void recordGauge(const LocationID &loc, int64_t value) noexcept;
+
+  // Wait and hold intervals of a ProfiledMutex, in ticks of now(). instance
+  // tells apart the mutexes sharing the location.
+  static void recordLockWait(const LocationID &loc, uint32_t instance,
+                             int64_t start, int64_t end) noexcept;
+  static void recordLockHold(const LocationID &loc, uint32_t instance,
+                             int64_t start, int64_t end) noexcept;
+
+  // Current time in ticks of the clock selected at initialize().
+  static int64_t now() noexcept { return profiler_clock::now(activeClock); }
+
+  ClockSource clockSource() const noexcept { return activeClock; }
+  PerfCounterMode perfCounterMode() const noexcept { return activePerfMode; }
+  double ticksPerNs() const noexcept { return clockTicksPerNs; }
+  // Measured at initialize(), 0 if not calibrated (see
+  // SessionConfig::calibrateOverhead). The first is the part of its own
+  // duration a scope records for itself, the second what each nested scope
+  // adds to the duration of the scopes around it.
+  double scopeOverheadNs() const noexcept { return ownOverheadNs; }
+  double nestedScopeOverheadNs() const noexcept { return nestedOverheadNs; }
+
 private:
+  void calibrateOverhead();
+  void writeSessionInfo(const std::string &folder,
+                        const std::string &dumpReason = "") noexcept;
+  std::string sessionInfo(const std::string &dumpReason = "") const;
+
+  inline static ClockSource activeClock = ClockSource::SteadyClock;
+  inline static PerfCounterMode activePerfMode = PerfCounterMode::Disabled;
+  inline static bool aggregateMode = false;
+  inline static bool flightRecorderMode = false;
+  inline static bool cpuTracking = false;
+  inline static bool contextSwitchTracking = false;
+  // Read by every MeasureScope, see isRecorded()
+  inline static std::atomic<bool> amIEnabled{false};
+
+  // Bits of the locations disabled by the location filter, by index, only
+  // read while locationFiltering is set
+  inline static std::atomic<bool> locationFiltering{false};
+  inline static std::array<std::atomic<uint64_t>, kFilteredLocations / 64>
+      disabledLocations{};
+
   std::mutex mtx;
-  bool amIEnabled = false;
   bool initialized = false;
   std::string outFolder;
-  time_point initializationTime;
+  // Folder given to initialize(), outFolder is a process folder inside it in
+  // forked children
+  std::string rootFolder;
+  // Process that forked this one after initialize(), 0 in the original one
+  int parentPid = 0;
+  // Set by the fork prepare handler, mtx and locationsMtx are held until the
+  // fork returns
+  bool forkLocked = false;
+  // Set in a forked child until its session is opened by the first thread
+  // recording in it
+  std::atomic<bool> forkedSessionPending{false};
+  int64_t initializationTicks = 0;
+  double clockTicksPerNs = 1.0;
+  // Wall clock time at initializationTicks, nanoseconds since the epoch
+  int64_t startWallNs = 0;
+  // Preamble and session header starting every session file
+  std::vector<uint8_t> sessionHead;
+  double ownOverheadNs = 0.0;
+  double nestedOverheadNs = 0.0;
 
-  std::map<std::string, uint64_t> locationIDMap;
-  std::vector<MeasureBuffer *> buffers;
+  static constexpr size_t kMaxThreads = 1024;
+
+  // Locations living outside of the registry section, registered on first
+  // use. Their indices follow the ones of the registry. Appended under
+  // locationsMtx and read without it (by the crash handler too), chunks are
+  // allocated as needed and never freed while the session lives.
+  static constexpr size_t kDynamicLocationChunkSize = 256;
+  static constexpr size_t kDynamicLocationChunks = 256;
+  using dynamic_location_chunk_t =
+      std::array<std::atomic<const LocationID *>, kDynamicLocationChunkSize>;
+  std::mutex locationsMtx;
+  std::array<std::atomic<dynamic_location_chunk_t *>, kDynamicLocationChunks>
+      dynamicLocationChunks{};
+  std::atomic<size_t> dynamicLocationCount{0};
+  // Guarded by locationsMtx, applied to the locations as they register
+  std::vector<location_filter::rule_t> filterRules;
+  // Filter given to initialize(), restored when the control file is removed
+  std::string initialFilter;
+  // Control file, see SessionConfig::locationFilterFile
+  std::string filterFile;
+  std::chrono::milliseconds filterPeriod{0};
+  // Last content read by the watcher
+  bool filterFilePresent = false;
+  std::string filterFileContent;
+  std::atomic<bool> filterWatcherRunning{false};
+  std::thread filterWatcher;
+  std::vector<uint8_t> blockBuffer;
+  std::vector<uint8_t> compressedBuffer;
+  std::array<std::atomic<MeasureRing *>, kMaxThreads> rings{};
+  std::atomic<size_t> ringsHighWater{0};
   std::atomic<uint64_t> nextThreadId{0};
+  std::atomic<uint64_t> dropped{0};
+  // Histograms of the threads that exited, by location
+  std::vector<log_histogram::merged_t> retiredHistograms;
+
+  struct thread_entry_t {
+    uint64_t threadId;
+    int64_t tid;
+    std::string name;
+  };
+  // Registrations not written yet
+  std::mutex threadsMtx;
+  std::vector<thread_entry_t> pendingThreads;
+  // Guarded by mtx, registrations written so far and their lines in the
+  // thread table file. Kept across sessions like the rings of the threads.
+  std::vector<thread_entry_t> threadEntries;
+  std::string threadLines;
+  std::unique_ptr<FILE, FileCloser> threadsFile;
+
+  // Memory of the registered rings, only checked against the budget under mtx
+  std::atomic<size_t> ringBytes{0};
+  size_t recordingRingCapacity = 0;
+  size_t flightRingCapacity = 0;
+  size_t flightBudget = 0;
+  int64_t flightWindowTicks = 0;
+  uint64_t dumpCount = 0;
+  std::thread dumpThread;
+
+  // Prepared at initialize(), the crash handler can't allocate
+  std::vector<uint8_t> crashBuffer;
+  std::string crashSessionPath;
+  std::string crashLocationsPath;
+  std::string crashInfoPath;
+  std::string crashThreadsPath;
+
+  std::atomic<bool> writerRunning{false};
+  std::thread writer;
+  // Wakes the writer backing off on empty rings, see wakeWriter()
+  std::mutex writerWakeMtx;
+  std::condition_variable writerWake;
+  std::atomic<bool> writerSleeping{false};
+  // Guarded by writerWakeMtx
+  bool writerWakeRequested = false;
+
+  std::unique_ptr<SessionSink> session;
+  SinkType sinkType = SinkType::Stdio;
+  SinkOptions sinkOptions;
+  session_encoding::BlockCodec blockCodec = session_encoding::BlockCodec::None;
 
-  std::unique_ptr<FILE, FileCloser> session;
+  // Segments of a rotated session, guarded by mtx
+  RotationPolicy rotation;
+  uint64_t segmentIndex = 0;
+  uint64_t segmentBytes = 0;
+  // Locations defined in the current file
+  size_t definedLocationCount = 0;
+  // Size of the tables closing a segment, with the location and thread
+  // counts it was computed for
+  size_t tablesSize = 0;
+  size_t tablesLocationCount = 0;
+  size_t tablesThreadCount = 0;
+  std::vector<uint8_t> definitionsBuffer;
+  std::chrono::steady_clock::time_point segmentStart;
+  // Segments on disk, oldest first
+  std::deque<uint64_t> segments;
+
+  // Guarded by mtx
+  std::string liveSocketPath;
+  size_t liveClientQueue = 0;
+  std::unique_ptr<LiveStream> liveStream;
+  std::string liveInfo;
+  // Location table lines published so far
+  std::string liveLocations;
+  size_t liveLocationCount = 0;
 };
 
+// Single-producer/single-consumer ring of measures. The owning thread pushes
+// without locking, the session writer thread drains it into the session file.
+// Rings are owned by the session and freed by the writer once retired and
+// empty, so a thread exiting never waits on I/O.
+class MeasureRing {
+public:
+  // capacity must be a power of two
+  explicit MeasureRing(size_t capacity)
+      : data(new measure_t[capacity]), mask(capacity - 1) {}
+  ~MeasureRing() noexcept;
+
+  bool push(const measure_t &m) noexcept {
+    const size_t h = head.load(std::memory_order_relaxed);
+    if (h - cachedTail > mask) {
+      cachedTail = tail.load(std::memory_order_acquire);
+      if (h - cachedTail > mask) {
+        dropped.store(dropped.load(std::memory_order_relaxed) + 1,
+                      std::memory_order_relaxed);
+        return false;
+      }
+    }
+    data[h & mask] = m;
+    head.store(h + 1, std::memory_order_release);
+    return true;
+  }
+
+  // Flight recorder push, overwrites the oldest measure when full. Readers
+  // validate what they copied against head, see copyRecent().
+  void overwrite(const measure_t &m) noexcept {
+    const size_t h = head.load(std::memory_order_relaxed);
+    data[h & mask] = m;
+    head.store(h + 1, std::memory_order_release);
+  }
+
+  size_t capacity() const noexcept { return mask + 1; }
+
+  // Producer side, measures pushed since the tail was last seen
+  size_t unreadEstimate() const noexcept {
+    return head.load(std::memory_order_relaxed) - cachedTail;
+  }
+
+  void aggregate(uint32_t location, uint64_t duration) noexcept {
+    histogram_chunk_t *chunk =
+        location < kHistogramChunkSize * kHistogramChunks
+            ? histogramChunks[location / kHistogramChunkSize].load(
+                  std::memory_order_relaxed)
+            : nullptr;
+    log_histogram::concurrent_t *histogram =
+        chunk ? chunk->histograms[location % kHistogramChunkSize].load(
+                    std::memory_order_relaxed)
+              : nullptr;
+    if (!histogram) [[unlikely]] {
+      histogram = createHistogram(location);
+      if (!histogram) {
+        return;
+      }
+    }
+    histogram->add(duration);
+  }
+
+private:
+  // Histograms of the aggregate mode by location, allocated by the owning
+  // thread on first use and published with release stores.
+  static constexpr size_t kHistogramChunkSize = 256;
+  static constexpr size_t kHistogramChunks = 256;
+  struct histogram_chunk_t {
+    std::array<std::atomic<log_histogram::concurrent_t *>, kHistogramChunkSize>
+        histograms{};
+  };
+  log_histogram::concurrent_t *createHistogram(uint32_t location) noexcept;
+  const log_histogram::concurrent_t *histogramAt(size_t location) const noexcept;
+
+  // Copies the measures still in the ring, oldest first, while the owner
+  // keeps overwriting it.
+  void copyRecent(std::vector<measure_t> &out) const;
+
+  // Producer side
+  alignas(64) std::atomic<size_t> head{0};
+  const std::unique_ptr<measure_t[]> data;
+  const size_t mask;
+  size_t cachedTail = 0;
+  std::atomic<uint64_t> dropped{0};
+  std::atomic<bool> retired{false};
+
+  // Consumer side
+  alignas(64) std::atomic<size_t> tail{0};
+  uint64_t droppedReported = 0;
+
+  uint64_t threadId = 0;
+  // Thread table entry of the owner for the crash handler, which can't read
+  // the registrations. The name is truncated and may be read while the
+  // owner renames itself.
+  int64_t tid = 0;
+  std::array<std::atomic<char>, 64> name{};
+  std::array<std::atomic<histogram_chunk_t *>, kHistogramChunks>
+      histogramChunks{};
+
+  friend class ProfilingSession;
+  friend class MeasureBuffer;
+};
+
+// Thread local handle to the ring of the calling thread.
 class MeasureBuffer {
 public:
   ~MeasureBuffer() noexcept;
-  void push(measure_t m) noexcept;
+  void push(const measure_t &m) noexcept;
+  void aggregate(uint32_t location, uint64_t duration) noexcept;
 
 private:
-  static constexpr size_t kCapacity = 1024;
+  bool acquireRing() noexcept;
 
-  std::array<measure_t, kCapacity> data;
-  size_t count = 0;
-  bool registered = false;
-  uint64_t threadId = 0;
+  MeasureRing *ring = nullptr;
+  bool registrationFailed = false;
+  // Set with ProfilingSession::setThreadName()
+  std::string threadName;
 
   friend class ProfilingSession;
 };
 
-class LocationID {
+// Static description of a measured location. Instances are meant to be
+// constant initialized (see PROFILER_LOCATION): those placed in the registry
+// section get their index at initialize(), any other instance is registered
+// the first time it is used.
+class alignas(32) LocationID {
 public:
-  static constexpr unsigned long hash(const source_loc &loc) {
-    unsigned long hash = 5381;
-
-    const auto &hashStr = [](unsigned long hash,
-                             const char *str) -> unsigned long {
-      char c;
-      while ((c = *str++)) {
-        hash = hash * 33 + c;
-      }
-      return hash;
-    };
-    hash = hashStr(hash, loc.file_name());
-    hash += loc.line();
-    hash = hashStr(hash, loc.function_name());
+  static constexpr uint32_t kUnregistered = UINT32_MAX;
 
-    return hash;
-  }
+  constexpr LocationID(
+      const char *_name,
+      const source_loc &loc = std::source_location::current()) noexcept
+      : name(_name), file(loc.file_name()), function(loc.function_name()),
+        line(loc.line()) {}
+  LocationID(const LocationID &) = delete;
+  LocationID &operator=(const LocationID &) = delete;
 
-  LocationID(const char *name,
-             const source_loc &loc = std::source_location::current()) noexcept
-      : locationID(hash(loc)) {
-    ProfilingSession::getGlobalInstace().addLocation(name, loc, locationID);
+  // Dense index of the location
+  uint32_t locationID() const noexcept {
+    const uint32_t id = index.load(std::memory_order_relaxed);
+    if (id != kUnregistered) [[likely]] {
+      return id;
+    }
+    return ProfilingSession::getGlobalInstace().registerLocation(*this);
   }
 
-  const uint64_t locationID;
+  const char *const name;
+  const char *const file;
+  const char *const function;
+  const uint32_t line;
+
+private:
+  mutable std::atomic<uint32_t> index{kUnregistered};
+
+  friend class ProfilingSession;
+};
+// Registry entries must be laid out without padding to be walked as an array
+static_assert(sizeof(LocationID) == 32);
+
+// CPU the calling thread runs on, -1 if unknown
+inline int currentCpu() noexcept {
+#if defined(__linux__)
+  return sched_getcpu();
+#else
+  return -1;
+#endif
+}
+
+// Innermost active scope of a thread. Each MeasureScope saves the previous
+// state and restores it on destruction.
+struct scope_stack_t {
+  uint32_t current = measure_t::kNoParent;
+  uint32_t depth = 0;
+  // Allocations made by the innermost scope so far, only counted when the
+  // profiler_alloc library is linked
+  uint64_t allocations = 0;
+  uint64_t allocatedBytes = 0;
+  // Records the scopes of the thread while the session is disabled, used by
+  // ProfilingSession::calibrateOverhead()
+  bool forceEnabled = false;
 };
 
 class MeasureScope {
 public:
-  MeasureScope(const LocationID &_loc) noexcept
-      : loc(_loc), start(std::chrono::steady_clock::now()) {}
-  ~MeasureScope() noexcept;
+  MeasureScope(const LocationID &loc) noexcept
+      : location(loc.locationID()),
+        active(ProfilingSession::isThreadEnabled() &&
+               ProfilingSession::isLocationEnabled(location)) {
+    // Inactive scopes are invisible, their children nest in the enclosing
+    // active scope
+    if (!active) {
+      return;
+    }
+    parent = tlsScopeStack.current;
+    depth = tlsScopeStack.depth;
+    parentAllocations = tlsScopeStack.allocations;
+    parentAllocatedBytes = tlsScopeStack.allocatedBytes;
+    tlsScopeStack.current = location;
+    tlsScopeStack.depth++;
+    tlsScopeStack.allocations = 0;
+    tlsScopeStack.allocatedBytes = 0;
+    if (ProfilingSession::activePerfMode != PerfCounterMode::Disabled)
+        [[unlikely]] {
+      if (perf_counters::read(ProfilingSession::activePerfMode, perfStart)) {
+        perfMode = ProfilingSession::activePerfMode;
+      }
+    }
+    if (ProfilingSession::cpuTracking) [[unlikely]] {
+      startCpu = currentCpu();
+    }
+    if (ProfilingSession::contextSwitchTracking) [[unlikely]] {
+      startSwitches = perf_counters::contextSwitches();
+    }
+    start = ProfilingSession::now();
+  }
+  ~MeasureScope() noexcept {
+    if (active) {
+      record();
+    }
+  }
+
+  // Attributes an allocation to the innermost active scope of the calling
+  // thread, called by the operator new replacements of profiler_alloc.
+  static void countAllocation(size_t size) noexcept {
+    tlsScopeStack.allocations++;
+    tlsScopeStack.allocatedBytes += size;
+  }
 
 private:
-  const LocationID &loc;
-  const time_point start;
+  // Reads the end of the scope, restores the stack and records the scope
+  void record() noexcept;
+
+  inline static thread_local scope_stack_t tlsScopeStack;
+
+  const uint32_t location;
+  const bool active;
+  // Saved state of the thread scope stack, only set when active
+  uint32_t parent;
+  uint32_t depth;
+  uint64_t parentAllocations;
+  uint64_t parentAllocatedBytes;
+  int64_t start;
+  // -1 unless SessionConfig::trackCpuMigrations
+  int startCpu = -1;
+  // -1 unless SessionConfig::trackContextSwitches
+  int64_t startSwitches = -1;
+  // Mode of the counters read in perfStart, Disabled if none
+  PerfCounterMode perfMode = PerfCounterMode::Disabled;
+  perf_counters::sample_t perfStart;
+
+  friend class MeasureBuffer;
+  friend class MeasureRing;
+  friend class ProfilingSession;
+};
+
+// Call site of MEASURE_SCOPE_CAT, the default argument is evaluated in the
+// function using the macro. Empty when the category is disabled.
+template <bool Enabled> struct CategorySite {
+  consteval CategorySite(
+      const source_loc &_loc = std::source_location::current()) noexcept
+      : loc(_loc) {}
+  source_loc loc;
+};
+
+template <> struct CategorySite<false> {
+  static constexpr source_loc loc{};
 };
+
+// Scope of MEASURE_SCOPE_CAT, empty when its category is disabled
+template <bool Enabled> class CategoryScope : public MeasureScope {
+public:
+  explicit CategoryScope(const LocationID *loc) noexcept : MeasureScope(*loc) {}
+};
+
+template <> class CategoryScope<false> {
+public:
+  explicit constexpr CategoryScope(const LocationID *) noexcept {}
+};
+
+inline bool ProfilingSession::isThreadEnabled() noexcept {
+  return amIEnabled.load(std::memory_order_relaxed) ||
+         MeasureScope::tlsScopeStack.forceEnabled;
+}
+
+inline bool ProfilingSession::isRecorded(const LocationID &loc) noexcept {
+  return isThreadEnabled() && isLocationEnabled(loc.locationID());
+}
@@ -0,0 +1,572 @@
+#include "session_sink.hpp"
+
+#include <algorithm>
+#include <cerrno>
+#include <cstdio>
+#include <cstring>
+#include <new>
+
+#if defined(__unix__)
+#include <unistd.h>
+#endif
+
+#if defined(__linux__)
+#include <fcntl.h>
+#include <sys/mman.h>
+#include <sys/syscall.h>
+#include <sys/uio.h>
+
+#if __has_include(<linux/io_uring.h>)
+#include <atomic>
+#include <linux/io_uring.h>
+#include <vector>
+#define PROFILER_HAVE_IO_URING 1
+#endif
+#endif
+
+static constexpr size_t kStdioBufferSize = 1 << 20;
+static constexpr size_t kDirectIOAlignment = 4096;
+
+// The FILE is unbuffered, the sink buffers the data itself so that the crash
+// handler knows what was not written yet.
+class StdioSink : public SessionSink {
+public:
+  StdioSink(FILE *_file, std::unique_ptr<uint8_t[]> _buffer) noexcept
+      : file(_file), buffer(std::move(_buffer)) {
+    setvbuf(file, nullptr, _IONBF, 0);
+#if defined(__unix__)
+    descriptor = fileno(file);
+#endif
+  }
+  ~StdioSink() override {
+    if (file) {
+      writeBuffer();
+      fclose(file);
+    }
+  }
+
+  bool write(const void *data, size_t size) noexcept override {
+    if (size > kStdioBufferSize - used) {
+      if (!writeBuffer()) {
+        return false;
+      }
+      if (size >= kStdioBufferSize) {
+        return writeFile(data, size);
+      }
+    }
+    memcpy(buffer.get() + used, data, size);
+    used += size;
+    return true;
+  }
+  void flush() noexcept override { writeBuffer(); }
+
+  int fd() const noexcept override { return descriptor; }
+  uint64_t committedSize() const noexcept override { return committed; }
+
+  void crashFlush() noexcept override {
+#if defined(__unix__)
+    size_t written = 0;
+    while (written < used) {
+      const ssize_t res = pwrite(descriptor, buffer.get() + written,
+                                 used - written, committed + written);
+      if (res <= 0) {
+        break;
+      }
+      written += res;
+    }
+    committed += written;
+    used = 0;
+#endif
+  }
+
+  // Nothing is buffered in the FILE, closing it doesn't write the parent's
+  // data
+  void abandon() noexcept override {
+    used = 0;
+    fclose(file);
+    file = nullptr;
+  }
+
+private:
+  bool writeFile(const void *data, size_t size) noexcept {
+    const size_t written = fwrite(data, 1, size, file);
+    committed += written;
+    return written == size;
+  }
+  bool writeBuffer() noexcept {
+    const bool written = writeFile(buffer.get(), used);
+    used = 0;
+    return written;
+  }
+
+  FILE *file;
+  int descriptor = -1;
+  std::unique_ptr<uint8_t[]> buffer;
+  size_t used = 0;
+  uint64_t committed = 0;
+};
+
+#if defined(__linux__)
+// The file is extended with fallocate one window ahead of the mapped one, so
+// that the page cache never has to allocate blocks under the copy. On close
+// the file is truncated to the written size.
+class MmapSink : public SessionSink {
+public:
+  MmapSink(int _file, size_t _windowSize) noexcept
+      : file(_file), windowSize(_windowSize) {}
+  ~MmapSink() override {
+    unmapWindow();
+    if (file < 0) {
+      return;
+    }
+    if (ftruncate(file, cursor) != 0) {
+      perror("profiler: ftruncate");
+    }
+    ::close(file);
+  }
+
+  bool write(const void *data, size_t size) noexcept override {
+    const uint8_t *in = static_cast<const uint8_t *>(data);
+    while (size > 0) {
+      if (!window || cursor == windowOffset + windowSize) {
+        if (!mapWindow(cursor)) {
+          return false;
+        }
+      }
+      const size_t offsetInWindow = cursor - windowOffset;
+      const size_t chunk = std::min(size, windowSize - offsetInWindow);
+      memcpy(window + offsetInWindow, in, chunk);
+      in += chunk;
+      size -= chunk;
+      cursor += chunk;
+    }
+    return true;
+  }
+
+  void flush() noexcept override {
+    if (window) {
+      msync(window, windowSize, MS_ASYNC);
+    }
+  }
+
+  int fd() const noexcept override { return file; }
+  // Mapped pages outlive the process, only the preallocated tail is past the
+  // cursor
+  uint64_t committedSize() const noexcept override { return cursor; }
+
+  // The parent keeps writing through its own mappings, truncating the file
+  // would make them fault
+  void abandon() noexcept override {
+    unmapWindow();
+    ::close(file);
+    file = -1;
+  }
+
+  bool mapWindow(size_t offset) noexcept {
+    unmapWindow();
+    // Allocate the new window and the following one ahead of the cursor
+    if (offset + 2 * windowSize > allocated) {
+      const size_t allocationStart = std::max(allocated, offset);
+      const size_t allocationEnd = offset + 2 * windowSize;
+      if (posix_fallocate(file, allocationStart,
+                          allocationEnd - allocationStart) != 0 &&
+          ftruncate(file, allocationEnd) != 0) {
+        return false;
+      }
+      allocated = allocationEnd;
+    }
+    void *addr = mmap(nullptr, windowSize, PROT_READ | PROT_WRITE, MAP_SHARED,
+                      file, offset);
+    if (addr == MAP_FAILED) {
+      return false;
+    }
+    // Best effort, huge pages are only honoured by filesystems supporting
+    // large folios (e.g. tmpfs mounted with huge=)
+    madvise(addr, windowSize, MADV_SEQUENTIAL);
+#ifdef MADV_HUGEPAGE
+    madvise(addr, windowSize, MADV_HUGEPAGE);
+#endif
+    window = static_cast<uint8_t *>(addr);
+    windowOffset = offset;
+    return true;
+  }
+
+  void unmapWindow() noexcept {
+    if (!window) {
+      return;
+    }
+    munmap(window, windowSize);
+    window = nullptr;
+  }
+
+private:
+  int file;
+  size_t windowSize;
+  uint8_t *window = nullptr;
+  size_t windowOffset = 0;
+  size_t cursor = 0;
+  size_t allocated = 0;
+};
+
+static std::unique_ptr<SessionSink> openMmapSink(const std::string &path,
+                                                 const SinkOptions &options) {
+  const size_t pageSize = sysconf(_SC_PAGESIZE);
+  const size_t windowSize =
+      std::max(pageSize, (options.mmapWindowSize + pageSize - 1) / pageSize *
+                             pageSize);
+  int fd = open(path.c_str(), O_RDWR | O_CREAT | O_TRUNC | O_CLOEXEC, 0644);
+  if (fd < 0) {
+    return nullptr;
+  }
+  auto sink = std::make_unique<MmapSink>(fd, windowSize);
+  if (!sink->mapWindow(0)) {
+    return nullptr;
+  }
+  return sink;
+}
+#endif
+
+#if defined(PROFILER_HAVE_IO_URING)
+// Data is accumulated in a pool of page aligned buffers. Full buffers are
+// submitted as a single write and only reused once their completion is
+// reaped, so the writer thread only waits when every buffer is in flight.
+// Failed or short writes are completed synchronously with pwrite.
+class IoUringSink : public SessionSink {
+public:
+  ~IoUringSink() override {
+    if (ringFd >= 0) {
+      if (current >= 0 && currentFill > 0) {
+        submitCurrent();
+      }
+      while (inFlight > 0 && reap(1)) {
+      }
+      if (direct && ftruncate(file, logicalSize) != 0) {
+        perror("profiler: ftruncate");
+      }
+    }
+    if (sqes) {
+      munmap(sqes, sqesSize);
+    }
+    if (cqRing && cqRing != sqRing) {
+      munmap(cqRing, cqRingSize);
+    }
+    if (sqRing) {
+      munmap(sqRing, sqRingSize);
+    }
+    if (ringFd >= 0) {
+      ::close(ringFd);
+    }
+    for (uint8_t *buffer : buffers) {
+      free(buffer);
+    }
+    if (file >= 0) {
+      ::close(file);
+    }
+  }
+
+  bool init(int _file, bool _direct, const SinkOptions &options) noexcept {
+    file = _file;
+    direct = _direct;
+    bufferSize = std::max(kDirectIOAlignment,
+                          (options.ioUringBufferSize + kDirectIOAlignment - 1) /
+                              kDirectIOAlignment * kDirectIOAlignment);
+    const size_t bufferCount = std::max<size_t>(options.ioUringBufferCount, 2);
+
+    io_uring_params params{};
+    ringFd = (int)syscall(__NR_io_uring_setup, (unsigned)bufferCount, &params);
+    if (ringFd < 0) {
+      return false;
+    }
+    sqRingSize = params.sq_off.array + params.sq_entries * sizeof(unsigned);
+    cqRingSize = params.cq_off.cqes + params.cq_entries * sizeof(io_uring_cqe);
+    if (params.features & IORING_FEAT_SINGLE_MMAP) {
+      sqRingSize = cqRingSize = std::max(sqRingSize, cqRingSize);
+    }
+    sqRing = mapRing(sqRingSize, IORING_OFF_SQ_RING);
+    if (!sqRing) {
+      return false;
+    }
+    cqRing = (params.features & IORING_FEAT_SINGLE_MMAP)
+                 ? sqRing
+                 : mapRing(cqRingSize, IORING_OFF_CQ_RING);
+    sqesSize = params.sq_entries * sizeof(io_uring_sqe);
+    sqes = static_cast<io_uring_sqe *>(mapRing(sqesSize, IORING_OFF_SQES));
+    if (!cqRing || !sqes) {
+      return false;
+    }
+    sqTail = ringField(sqRing, params.sq_off.tail);
+    sqMask = *ringField(sqRing, params.sq_off.ring_mask);
+    sqArray = ringField(sqRing, params.sq_off.array);
+    cqHead = ringField(cqRing, params.cq_off.head);
+    cqTail = ringField(cqRing, params.cq_off.tail);
+    cqMask = *ringField(cqRing, params.cq_off.ring_mask);
+    cqes = reinterpret_cast<io_uring_cqe *>(static_cast<uint8_t *>(cqRing) +
+                                            params.cq_off.cqes);
+
+    std::vector<iovec> iovecs;
+    for (size_t i = 0; i < bufferCount; i++) {
+      void *buffer;
+      if (posix_memalign(&buffer, kDirectIOAlignment, bufferSize) != 0) {
+        return false;
+      }
+      buffers.push_back(static_cast<uint8_t *>(buffer));
+      iovecs.push_back({buffer, bufferSize});
+      freeBuffers.push_back((int)i);
+    }
+    bufferOffsets.resize(bufferCount);
+    bufferLengths.resize(bufferCount);
+    registeredBuffers =
+        syscall(__NR_io_uring_register, ringFd, IORING_REGISTER_BUFFERS,
+                iovecs.data(), (unsigned)iovecs.size()) == 0;
+    return true;
+  }
+
+  bool write(const void *data, size_t size) noexcept override {
+    const uint8_t *in = static_cast<const uint8_t *>(data);
+    while (size > 0) {
+      if (current < 0 && !acquireBuffer()) {
+        return false;
+      }
+      const size_t chunk = std::min(size, bufferSize - currentFill);
+      memcpy(buffers[current] + currentFill, in, chunk);
+      currentFill += chunk;
+      in += chunk;
+      size -= chunk;
+      if (currentFill == bufferSize && !submitCurrent()) {
+        return false;
+      }
+    }
+    return !failed;
+  }
+
+  int fd() const noexcept override { return file; }
+  // Submitted buffers count as written, without the padding of O_DIRECT
+  uint64_t committedSize() const noexcept override { return logicalSize; }
+
+  // Buffers in flight may be cancelled when the process dies, rewrite them
+  // synchronously along with the one being filled.
+  void crashFlush() noexcept override {
+    for (size_t i = 0; i < buffers.size(); i++) {
+      if (bufferLengths[i] > 0) {
+        pwriteAll(buffers[i], bufferLengths[i], bufferOffsets[i]);
+      }
+    }
+    if (current >= 0 && currentFill > 0) {
+      size_t length = currentFill;
+      if (direct) {
+        length = (length + kDirectIOAlignment - 1) / kDirectIOAlignment *
+                 kDirectIOAlignment;
+        memset(buffers[current] + currentFill, 0, length - currentFill);
+      }
+      pwriteAll(buffers[current], length, fileOffset);
+      logicalSize += currentFill;
+      currentFill = 0;
+    }
+  }
+
+  // The ring and the buffers in flight are the parent's: release the
+  // mappings and the descriptors without submitting or waiting
+  void abandon() noexcept override {
+    current = -1;
+    currentFill = 0;
+    inFlight = 0;
+    direct = false;
+  }
+
+private:
+  void pwriteAll(const uint8_t *data, size_t size, uint64_t offset) noexcept {
+    while (size > 0) {
+      const ssize_t res = pwrite(file, data, size, offset);
+      if (res <= 0) {
+        return;
+      }
+      data += res;
+      size -= res;
+      offset += res;
+    }
+  }
+
+  void *mapRing(size_t size, off_t offset) noexcept {
+    void *addr = mmap(nullptr, size, PROT_READ | PROT_WRITE,
+                      MAP_SHARED | MAP_POPULATE, ringFd, offset);
+    return addr == MAP_FAILED ? nullptr : addr;
+  }
+  static unsigned *ringField(void *ring, uint32_t offset) noexcept {
+    return reinterpret_cast<unsigned *>(static_cast<uint8_t *>(ring) + offset);
+  }
+
+  bool acquireBuffer() noexcept {
+    while (freeBuffers.empty()) {
+      if (!reap(1)) {
+        return false;
+      }
+    }
+    current = freeBuffers.back();
+    freeBuffers.pop_back();
+    currentFill = 0;
+    return true;
+  }
+
+  bool submitCurrent() noexcept {
+    size_t length = currentFill;
+    if (direct) {
+      // O_DIRECT writes must cover whole blocks, the padding of the last
+      // buffer is truncated away on close
+      length = (length + kDirectIOAlignment - 1) / kDirectIOAlignment *
+               kDirectIOAlignment;
+      memset(buffers[current] + currentFill, 0, length - currentFill);
+    }
+    bufferOffsets[current] = fileOffset;
+    bufferLengths[current] = length;
+
+    const unsigned tail = *sqTail;
+    const unsigned index = tail & sqMask;
+    io_uring_sqe &sqe = sqes[index];
+    memset(&sqe, 0, sizeof(sqe));
+    sqe.opcode = registeredBuffers ? IORING_OP_WRITE_FIXED : IORING_OP_WRITE;
+    sqe.fd = file;
+    sqe.addr = (uint64_t)(uintptr_t)buffers[current];
+    sqe.len = (uint32_t)length;
+    sqe.off = fileOffset;
+    sqe.buf_index = registeredBuffers ? (uint16_t)current : 0;
+    sqe.user_data = (uint64_t)current;
+    sqArray[index] = index;
+    std::atomic_ref<unsigned>(*sqTail).store(tail + 1,
+                                             std::memory_order_release);
+
+    fileOffset += length;
+    logicalSize += currentFill;
+    inFlight++;
+    current = -1;
+    currentFill = 0;
+
+    while (syscall(__NR_io_uring_enter, ringFd, 1, 0, 0, nullptr, 0) < 0) {
+      if (errno != EINTR && errno != EAGAIN) {
+        perror("profiler: io_uring_enter");
+        failed = true;
+        return false;
+      }
+    }
+    return reap(0);
+  }
+
+  // Waits for at least minComplete completions and recycles their buffers
+  bool reap(unsigned minComplete) noexcept {
+    if (minComplete > 0 &&
+        syscall(__NR_io_uring_enter, ringFd, 0, minComplete,
+                IORING_ENTER_GETEVENTS, nullptr, 0) < 0 &&
+        errno != EINTR) {
+      failed = true;
+      return false;
+    }
+    unsigned head = *cqHead;
+    const unsigned tail =
+        std::atomic_ref<unsigned>(*cqTail).load(std::memory_order_acquire);
+    for (; head != tail; head++) {
+      const io_uring_cqe &cqe = cqes[head & cqMask];
+      const int buffer = (int)cqe.user_data;
+      const size_t written = cqe.res < 0 ? 0 : (size_t)cqe.res;
+      if (written < bufferLengths[buffer]) {
+        completeSynchronously(buffer, written);
+      }
+      bufferLengths[buffer] = 0;
+      freeBuffers.push_back(buffer);
+      inFlight--;
+    }
+    std::atomic_ref<unsigned>(*cqHead).store(head, std::memory_order_release);
+    return !failed;
+  }
+
+  void completeSynchronously(int buffer, size_t written) noexcept {
+    while (written < bufferLengths[buffer]) {
+      const ssize_t res =
+          pwrite(file, buffers[buffer] + written, bufferLengths[buffer] - written,
+                 bufferOffsets[buffer] + written);
+      if (res <= 0) {
+        perror("profiler: io_uring sink write");
+        failed = true;
+        return;
+      }
+      written += res;
+    }
+  }
+
+  int file = -1;
+  bool direct = false;
+  int ringFd = -1;
+  void *sqRing = nullptr;
+  void *cqRing = nullptr;
+  size_t sqRingSize = 0;
+  size_t cqRingSize = 0;
+  io_uring_sqe *sqes = nullptr;
+  size_t sqesSize = 0;
+  unsigned *sqTail = nullptr;
+  unsigned *sqArray = nullptr;
+  unsigned sqMask = 0;
+  unsigned *cqHead = nullptr;
+  unsigned *cqTail = nullptr;
+  unsigned cqMask = 0;
+  io_uring_cqe *cqes = nullptr;
+
+  bool registeredBuffers = false;
+  size_t bufferSize = 0;
+  std::vector<uint8_t *> buffers;
+  std::vector<uint64_t> bufferOffsets;
+  std::vector<size_t> bufferLengths;
+  std::vector<int> freeBuffers;
+  int current = -1;
+  size_t currentFill = 0;
+  unsigned inFlight = 0;
+  uint64_t fileOffset = 0;
+  uint64_t logicalSize = 0;
+  bool failed = false;
+};
+
+static std::unique_ptr<SessionSink>
+openIoUringSink(const std::string &path, const SinkOptions &options) {
+  const int flags = O_WRONLY | O_CREAT | O_TRUNC | O_CLOEXEC;
+  bool direct = options.ioUringDirect;
+  int fd = direct ? open(path.c_str(), flags | O_DIRECT, 0644) : -1;
+  if (fd < 0) {
+    direct = false;
+    fd = open(path.c_str(), flags, 0644);
+  }
+  if (fd < 0) {
+    return nullptr;
+  }
+  auto sink = std::make_unique<IoUringSink>();
+  if (!sink->init(fd, direct, options)) {
+    return nullptr;
+  }
+  return sink;
+}
+#endif
+
+std::unique_ptr<SessionSink> openSessionSink(SinkType type,
+                                             const std::string &path,
+                                             const SinkOptions &options) {
+#if defined(__linux__)
+  if (type == SinkType::Mmap) {
+    if (auto sink = openMmapSink(path, options)) {
+      return sink;
+    }
+  }
+#if defined(PROFILER_HAVE_IO_URING)
+  if (type == SinkType::IoUring) {
+    if (auto sink = openIoUringSink(path, options)) {
+      return sink;
+    }
+  }
+#endif
+#else
+  (void)type;
+  (void)options;
+#endif
+  std::unique_ptr<uint8_t[]> buffer(new (std::nothrow)
+                                        uint8_t[kStdioBufferSize]);
+  FILE *file = buffer ? fopen(path.c_str(), "wb") : nullptr;
+  if (!file) {
+    return nullptr;
+  }
+  return std::make_unique<StdioSink>(file, std::move(buffer));
+}
@@ -0,0 +1,58 @@
+#pragma once
+
+#include <cstddef>
+#include <cstdint>
+#include <memory>
+#include <string>
+
+// Destination of the encoded session stream. Sinks are only used by the
+// session writer thread (and by close() once the writer stopped), so they
+// don't need to be thread safe.
+enum class SinkType : uint8_t {
+  // fwrite through a large stdio buffer
+  Stdio = 0,
+  // Copies blocks into growable mmap windows of the session file
+  Mmap = 1,
+  // Asynchronous writes of full buffers submitted through io_uring
+  IoUring = 2,
+};
+
+struct SinkOptions {
+  // Size of each mapped window of the Mmap sink, rounded up to the page size
+  size_t mmapWindowSize = 64 << 20;
+
+  // Size and number of the buffers in flight of the IoUring sink. Buffers
+  // are registered with the ring when the memlock limit allows it.
+  size_t ioUringBufferSize = 1 << 20;
+  size_t ioUringBufferCount = 8;
+  // Open the session file with O_DIRECT, bypassing the page cache
+  bool ioUringDirect = false;
+};
+
+class SessionSink {
+public:
+  virtual ~SessionSink() = default;
+
+  virtual bool write(const void *data, size_t size) noexcept = 0;
+  virtual void flush() noexcept {}
+  // Descriptor of the session file, -1 if the platform has none
+  virtual int fd() const noexcept = 0;
+  // Bytes of the file the kernel already holds, the data still buffered by
+  // the sink follows them. The crash handler truncates the file to this size
+  // after crashFlush().
+  virtual uint64_t committedSize() const noexcept = 0;
+  // Hands the buffered data to the kernel with pwrite on fd() only, moving
+  // committedSize() past it. Called by the crash handler when no write() is
+  // in progress, the sink is not used afterwards.
+  virtual void crashFlush() noexcept {}
+  // Called in a child process forked while the sink was open: the file and
+  // the data buffered so far belong to the parent. Drops the buffered data
+  // and makes the destructor release the sink without touching the file.
+  virtual void abandon() noexcept = 0;
+};
+
+// Opens path with the requested sink, falling back to the Stdio sink if the
+// requested one is not available. Returns nullptr if path can't be opened.
+std::unique_ptr<SessionSink> openSessionSink(SinkType type,
+                                             const std::string &path,
+                                             const SinkOptions &options);